@@ -2,10 +2,21 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include "gb.h"
 
 #define GB_CLOCK_RATE 0x400000
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef __GNUC__
 #define likely(x)   __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
@@ -14,6 +25,51 @@
 #define unlikely(x) x
 #endif
 
+#ifdef __GNUC__
+#define always_inline inline __attribute__((always_inline))
+#else
+#define always_inline inline
+#endif
+
+/* The shared tables below are built by the first instance that needs them. Instances can be
+   created on several threads at once, so building is claimed with a compare-and-swap, and
+   the other threads wait until the builder publishes the finished tables. */
+enum {
+    TABLES_NOT_BUILT,
+    TABLES_BUILDING,
+    TABLES_READY,
+};
+
+static void build_tables_once(atomic_int *state, void (*build)(void))
+{
+    if (atomic_load_explicit(state, memory_order_acquire) == TABLES_READY) return;
+    int expected = TABLES_NOT_BUILT;
+    if (atomic_compare_exchange_strong_explicit(state, &expected, TABLES_BUILDING,
+                                                memory_order_acquire, memory_order_acquire)) {
+        build();
+        atomic_store_explicit(state, TABLES_READY, memory_order_release);
+        return;
+    }
+    /* Building only takes a few milliseconds, and never happens on the audio thread */
+    while (atomic_load_explicit(state, memory_order_acquire) != TABLES_READY);
+}
+
+/* The models whose APUs differ in the code that runs every cycle. GB_apu_run is compiled once
+   per family with the family as a constant, so that code never has to look at gb->model. Finer
+   differences between the revisions of a family only matter on register writes. */
+typedef enum {
+    APU_FAMILY_DMG, // DMG, MGB, SGB and SGB2
+    APU_FAMILY_CGB,
+    APU_FAMILY_AGB,
+} apu_family_t;
+
+static inline apu_family_t model_family(GB_gameboy_t *gb)
+{
+    if (gb->model >= GB_MODEL_AGB) return APU_FAMILY_AGB;
+    if (CGB) return APU_FAMILY_CGB;
+    return APU_FAMILY_DMG;
+}
+
 static const uint8_t duties[] = {
     0, 0, 0, 0, 0, 0, 0, 1,
     1, 0, 0, 0, 0, 0, 0, 1,
@@ -29,9 +85,144 @@ static void refresh_channel(GB_gameboy_t *gb, unsigned index, unsigned cycles_of
     gb->apu_output.last_update[index] = gb->apu_output.cycles_since_render + cycles_offset;
 }
 
-bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index)
+/* libm's pow, exp, sin and cos aren't correctly rounded, so their last bits can differ between
+   platforms and compiler versions. Anything that ends up in the output is computed with these
+   instead, which only use basic arithmetic that IEEE 754 defines exactly. */
+static double reproducible_exp(double x)
 {
-    if (gb->model >= GB_MODEL_AGB) {
+    /* exp(x) = exp(x / 2^k)^(2^k), with a Taylor series for the small part */
+    unsigned halvings = 0;
+    while (x > 0.5 || x < -0.5) {
+        x /= 2;
+        halvings++;
+    }
+    double term = 1;
+    double sum = 1;
+    for (unsigned i = 1; i < 20; i++) {
+        term *= x / i;
+        sum += term;
+    }
+    while (halvings--) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+static double reproducible_sin(double x)
+{
+    /* Reduce to [-pi/2, pi/2], where the Taylor series converges quickly */
+    x -= 2 * M_PI * floor(x / (2 * M_PI) + 0.5);
+    if (x > M_PI / 2) {
+        x = M_PI - x;
+    }
+    else if (x < -M_PI / 2) {
+        x = -M_PI - x;
+    }
+    double term = x;
+    double sum = x;
+    for (unsigned i = 1; i < 14; i++) {
+        term *= -x * x / ((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static double reproducible_cos(double x)
+{
+    return reproducible_sin(x + M_PI / 2);
+}
+
+/* blip_tables.kernel[phase] is a band-limited step that happens phase / GB_BLIP_PHASES of a
+   sample into the current sample, as the differences between consecutive output samples,
+   in 1 << GB_BLIP_UNIT_BITS units. Every phase adds up to exactly one unit, so the
+   integrator can't drift. */
+static atomic_int blip_tables_state;
+static struct {
+    int32_t kernel[GB_BLIP_PHASES][GB_BLIP_KERNEL_SIZE];
+} blip_tables;
+
+/* Blackman windowed sinc, x in output samples */
+static double blip_impulse(double x)
+{
+    const double half_width = (GB_BLIP_KERNEL_SIZE - 1) / 2.0;
+    const double cutoff = 0.45; // Relative to the output sample rate
+    if (x <= -half_width || x >= half_width) return 0;
+    
+    double window = 0.42 + 0.5 * reproducible_cos(M_PI * x / half_width) + 0.08 * reproducible_cos(2 * M_PI * x / half_width);
+    double sinc = x == 0? 1 : reproducible_sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+    return 2 * cutoff * sinc * window;
+}
+
+static void build_blip_tables(void)
+{
+    /* Integrate the impulse tap by tap with Simpson's rule to get the step response
+       at every tap, then difference it back in fixed point */
+    const double half_width = (GB_BLIP_KERNEL_SIZE - 1) / 2.0;
+    const unsigned intervals = 16;
+    for (unsigned phase = 0; phase < GB_BLIP_PHASES; phase++) {
+        double step[GB_BLIP_KERNEL_SIZE + 1];
+        step[0] = 0;
+        for (unsigned i = 0; i < GB_BLIP_KERNEL_SIZE; i++) {
+            double start = i - phase / (double)GB_BLIP_PHASES - half_width;
+            double h = 1.0 / intervals;
+            double sum = blip_impulse(start) + blip_impulse(start + 1);
+            for (unsigned j = 1; j < intervals; j++) {
+                sum += blip_impulse(start + j * h) * ((j & 1)? 4 : 2);
+            }
+            step[i + 1] = step[i] + sum * h / 3;
+        }
+        
+        long previous = 0;
+        for (unsigned i = 0; i < GB_BLIP_KERNEL_SIZE; i++) {
+            long current = lround(step[i + 1] / step[GB_BLIP_KERNEL_SIZE] * (1 << GB_BLIP_UNIT_BITS));
+            blip_tables.kernel[phase][i] = current - previous;
+            previous = current;
+        }
+    }
+}
+
+static void init_blip_tables(void)
+{
+    build_tables_once(&blip_tables_state, build_blip_tables);
+}
+
+/* phase is in 1 / GB_BLIP_PHASES samples since the last rendered sample */
+static void blip_add_delta(GB_gameboy_t *gb, unsigned index, unsigned phase, int32_t left, int32_t right)
+{
+    if (phase >= GB_BLIP_PHASES * 2) {
+        phase = GB_BLIP_PHASES * 2 - 1;
+    }
+    unsigned position = gb->apu_output.blip_position + phase / GB_BLIP_PHASES;
+    const int32_t *kernel = blip_tables.kernel[phase % GB_BLIP_PHASES];
+    for (unsigned i = 0; i < GB_BLIP_KERNEL_SIZE; i++) {
+        int32_t *slot = gb->apu_output.blip_buffer[(position + i) & (GB_BLIP_BUFFER_SIZE - 1)][index];
+        slot[0] += left * kernel[i];
+        slot[1] += right * kernel[i];
+    }
+}
+
+static unsigned blip_phase(GB_gameboy_t *gb, unsigned cycles_offset)
+{
+    return ((uint64_t)(gb->apu_output.cycles_since_render + cycles_offset) * gb->apu_output.blip_phase_scale +
+            gb->apu_output.blip_phase_base) >> 16;
+}
+
+static void blip_update_channel(GB_gameboy_t *gb, unsigned index, GB_sample_t output, unsigned phase)
+{
+    int32_t left = output.left;
+    int32_t right = output.right;
+    if (left == gb->apu_output.blip_level[index][0] && right == gb->apu_output.blip_level[index][1]) return;
+    
+    blip_add_delta(gb, index, phase,
+                   left - gb->apu_output.blip_level[index][0],
+                   right - gb->apu_output.blip_level[index][1]);
+    gb->apu_output.blip_level[index][0] = left;
+    gb->apu_output.blip_level[index][1] = right;
+}
+
+static always_inline bool dac_enabled_for(GB_gameboy_t *gb, apu_family_t family, unsigned index)
+{
+    if (family == APU_FAMILY_AGB) {
         /* On the AGB, mixing is done digitally, so there are no per-channel
            DACs. Instead, all channels are summed digital regardless of
            whatever the DAC state would be on a CGB or earlier model. */
@@ -55,6 +246,11 @@ bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index)
     return false;
 }
 
+bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index)
+{
+    return dac_enabled_for(gb, model_family(gb), index);
+}
+
 static uint8_t agb_bias_for_channel(GB_gameboy_t *gb, unsigned index)
 {
     if (!gb->apu.is_active[index]) return 0;
@@ -72,50 +268,59 @@ static uint8_t agb_bias_for_channel(GB_gameboy_t *gb, unsigned index)
     return 0;
 }
 
-static void update_sample(GB_gameboy_t *gb, unsigned index, int8_t value, unsigned cycles_offset)
+/* The output of a channel playing PCM sample value, given the current NR50/NR51 routing */
+static always_inline GB_sample_t sample_for_value(GB_gameboy_t *gb, apu_family_t family, unsigned index, int8_t value)
 {
-    if (gb->model >= GB_MODEL_AGB) {
+    if (family == APU_FAMILY_AGB) {
         /* On the AGB, because no analog mixing is done, the behavior of NR51 is a bit different.
            A channel that is not connected to a terminal is idenitcal to a connected channel
            playing PCM sample 0. */
-        gb->apu.samples[index] = value;
+        unsigned right_volume = (gb->io_registers[GB_IO_NR50] & 7) + 1;
+        unsigned left_volume = ((gb->io_registers[GB_IO_NR50] >> 4) & 7) + 1;
         
-        if (gb->apu_output.sample_rate) {
-            unsigned right_volume = (gb->io_registers[GB_IO_NR50] & 7) + 1;
-            unsigned left_volume = ((gb->io_registers[GB_IO_NR50] >> 4) & 7) + 1;
-            
-            if (index == GB_WAVE) {
-                /* For some reason, channel 3 is inverted on the AGB */
-                value ^= 0xF;
-            }
-            
-            GB_sample_t output;
-            uint8_t bias = agb_bias_for_channel(gb, index);
-            
-            if (gb->io_registers[GB_IO_NR51] & (1 << index)) {
-                output.right = (0xf - value * 2 + bias) * right_volume;
-            }
-            else {
-                output.right = 0xf * right_volume;
-            }
-            
-            if (gb->io_registers[GB_IO_NR51] & (0x10 << index)) {
-                output.left = (0xf - value * 2 + bias) * left_volume;
-            }
-            else {
-                output.left = 0xf * left_volume;
-            }
-            
-            if (*(uint32_t *)&(gb->apu_output.current_sample[index]) != *(uint32_t *)&output) {
-                refresh_channel(gb, index, cycles_offset);
-                gb->apu_output.current_sample[index] = output;
-            }
+        if (index == GB_WAVE) {
+            /* For some reason, channel 3 is inverted on the AGB */
+            value ^= 0xF;
         }
         
-        return;
+        GB_sample_t output;
+        uint8_t bias = agb_bias_for_channel(gb, index);
+        
+        if (gb->io_registers[GB_IO_NR51] & (1 << index)) {
+            output.right = (0xf - value * 2 + bias) * right_volume;
+        }
+        else {
+            output.right = 0xf * right_volume;
+        }
+        
+        if (gb->io_registers[GB_IO_NR51] & (0x10 << index)) {
+            output.left = (0xf - value * 2 + bias) * left_volume;
+        }
+        else {
+            output.left = 0xf * left_volume;
+        }
+        
+        return output;
     }
     
-    if (!GB_apu_is_DAC_enabled(gb, index)) {
+    unsigned right_volume = 0;
+    if (gb->io_registers[GB_IO_NR51] & (1 << index)) {
+        right_volume = (gb->io_registers[GB_IO_NR50] & 7) + 1;
+    }
+    unsigned left_volume = 0;
+    if (gb->io_registers[GB_IO_NR51] & (0x10 << index)) {
+        left_volume = ((gb->io_registers[GB_IO_NR50] >> 4) & 7) + 1;
+    }
+    GB_sample_t output = {(0xf - value * 2) * left_volume, (0xf - value * 2) * right_volume};
+    return output;
+}
+
+static always_inline void update_sample_for(GB_gameboy_t *gb, apu_family_t family, unsigned index, int8_t value, unsigned cycles_offset)
+{
+    if (family == APU_FAMILY_AGB) {
+        gb->apu.samples[index] = value;
+    }
+    else if (!dac_enabled_for(gb, family, index)) {
         value = gb->apu.samples[index];
     }
     else {
@@ -123,33 +328,30 @@ static void update_sample(GB_gameboy_t *gb, unsigned index, int8_t value, unsign
     }
 
     if (gb->apu_output.sample_rate) {
-        unsigned right_volume = 0;
-        if (gb->io_registers[GB_IO_NR51] & (1 << index)) {
-            right_volume = (gb->io_registers[GB_IO_NR50] & 7) + 1;
-        }
-        unsigned left_volume = 0;
-        if (gb->io_registers[GB_IO_NR51] & (0x10 << index)) {
-            left_volume = ((gb->io_registers[GB_IO_NR50] >> 4) & 7) + 1;
-        }
-        GB_sample_t output = {(0xf - value * 2) * left_volume, (0xf - value * 2) * right_volume};
+        GB_sample_t output = sample_for_value(gb, family, index, value);
         if (*(uint32_t *)&(gb->apu_output.current_sample[index]) != *(uint32_t *)&output) {
-            refresh_channel(gb, index, cycles_offset);
+            if (gb->apu_output.band_limited) {
+                blip_update_channel(gb, index, output, blip_phase(gb, cycles_offset));
+            }
+            else {
+                refresh_channel(gb, index, cycles_offset);
+            }
             gb->apu_output.current_sample[index] = output;
         }
     }
 }
 
-static double smooth(double x)
+static void update_sample(GB_gameboy_t *gb, unsigned index, int8_t value, unsigned cycles_offset)
 {
-    return 3*x*x - 2*x*x*x;
+    update_sample_for(gb, model_family(gb), index, value, cycles_offset);
 }
 
-static signed interference(GB_gameboy_t *gb)
+static always_inline signed interference_for(GB_gameboy_t *gb, apu_family_t family)
 {
     /* These aren't scientifically measured, but based on ear based on several recordings */
     signed ret = 0;
     if (gb->halted) {
-        if (gb->model != GB_MODEL_AGB) {
+        if (family != APU_FAMILY_AGB || gb->model != GB_MODEL_AGB) {
             ret -= MAX_CH_AMP / 5;
         }
         else {
@@ -158,7 +360,7 @@ static signed interference(GB_gameboy_t *gb)
     }
     if (gb->io_registers[GB_IO_LCDC] & 0x80) {
         ret += MAX_CH_AMP / 7;
-        if ((gb->io_registers[GB_IO_STAT] & 3) == 3 && gb->model != GB_MODEL_AGB) {
+        if ((gb->io_registers[GB_IO_STAT] & 3) == 3 && (family != APU_FAMILY_AGB || gb->model != GB_MODEL_AGB)) {
             ret += MAX_CH_AMP / 14;
         }
         else if ((gb->io_registers[GB_IO_STAT] & 3) == 1) {
@@ -170,11 +372,11 @@ static signed interference(GB_gameboy_t *gb)
         ret += MAX_CH_AMP / 10;
     }
     
-    if (CGB && gb->model < GB_MODEL_AGB && (gb->io_registers[GB_IO_RP] & 1)) {
+    if (family == APU_FAMILY_CGB && (gb->io_registers[GB_IO_RP] & 1)) {
         ret += MAX_CH_AMP / 10;
     }
     
-    if (!CGB) {
+    if (family == APU_FAMILY_DMG) {
         ret /= 4;
     }
     
@@ -183,117 +385,300 @@ static signed interference(GB_gameboy_t *gb)
     return ret;
 }
 
-static void render(GB_gameboy_t *gb)
+/* Captures one sample: every channel's amplitude, plus whatever the block stage needs to know
+   about the APU's state at this point. Mixing and filtering happen in GB_apu_flush_block. */
+static always_inline void render_for(GB_gameboy_t *gb, apu_family_t family)
 {
-    GB_sample_t output = {0, 0};
+    if (gb->apu_output.block_length == GB_APU_BLOCK_SIZE) {
+        /* Nobody asked for these samples, but the DAC fades and the filter still have to see them */
+        GB_apu_flush_block(gb, NULL, NULL);
+    }
+    unsigned position = gb->apu_output.block_length++;
+    uint8_t dac_enabled = 0;
 
     unrolled for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
-        double multiplier = CH_STEP;
+        if (dac_enabled_for(gb, family, i)) {
+            dac_enabled |= 1 << i;
+        }
         
-        if (gb->model < GB_MODEL_AGB) {
-            if (!GB_apu_is_DAC_enabled(gb, i)) {
-                gb->apu_output.dac_discharge[i] -= ((double) DAC_DECAY_SPEED) / gb->apu_output.sample_rate;
-                if (gb->apu_output.dac_discharge[i] < 0) {
-                    multiplier = 0;
-                    gb->apu_output.dac_discharge[i] = 0;
-                }
-                else {
-                    multiplier *= smooth(gb->apu_output.dac_discharge[i]);
-                }
-            }
-            else {
-                gb->apu_output.dac_discharge[i] += ((double) DAC_ATTACK_SPEED) / gb->apu_output.sample_rate;
-                if (gb->apu_output.dac_discharge[i] > 1) {
-                    gb->apu_output.dac_discharge[i] = 1;
-                }
-                else {
-                    multiplier *= smooth(gb->apu_output.dac_discharge[i]);
-                }
-            }
+        float left, right;
+        if (gb->apu_output.band_limited) {
+            /* Catches up after the band-limited stage was reset */
+            blip_update_channel(gb, i, gb->apu_output.current_sample[i], GB_BLIP_PHASES);
+            int32_t *slot = gb->apu_output.blip_buffer[gb->apu_output.blip_position][i];
+            gb->apu_output.blip_integrator[i][0] += slot[0];
+            gb->apu_output.blip_integrator[i][1] += slot[1];
+            slot[0] = slot[1] = 0;
+            left = gb->apu_output.blip_integrator[i][0] * (1.0f / (1 << GB_BLIP_UNIT_BITS));
+            right = gb->apu_output.blip_integrator[i][1] * (1.0f / (1 << GB_BLIP_UNIT_BITS));
         }
-
-        if (likely(gb->apu_output.last_update[i] == 0)) {
-            output.left += gb->apu_output.current_sample[i].left * multiplier;
-            output.right += gb->apu_output.current_sample[i].right * multiplier;
+        else if (likely(gb->apu_output.last_update[i] == 0)) {
+            left = gb->apu_output.current_sample[i].left;
+            right = gb->apu_output.current_sample[i].right;
         }
         else {
             refresh_channel(gb, i, 0);
-            output.left += (signed long) gb->apu_output.summed_samples[i].left * multiplier
-                            / gb->apu_output.cycles_since_render;
-            output.right += (signed long) gb->apu_output.summed_samples[i].right * multiplier
-                            / gb->apu_output.cycles_since_render;
+            left = (float) gb->apu_output.summed_samples[i].left / gb->apu_output.cycles_since_render;
+            right = (float) gb->apu_output.summed_samples[i].right / gb->apu_output.cycles_since_render;
             gb->apu_output.summed_samples[i] = (GB_sample_t){0, 0};
         }
         gb->apu_output.last_update[i] = 0;
+        gb->apu_output.block_amplitude[i][0][position] = left;
+        gb->apu_output.block_amplitude[i][1][position] = right;
     }
+    gb->apu_output.block_dac_enabled[position] = dac_enabled;
     gb->apu_output.cycles_since_render = 0;
+    
+    if (gb->apu_output.band_limited) {
+        gb->apu_output.blip_position = (gb->apu_output.blip_position + 1) & (GB_BLIP_BUFFER_SIZE - 1);
+        /* Samples are rendered on the first CPU cycle past their boundary, the left over
+           part of the sample accumulator is how far past it. On top of that, the APU runs up to
+           one DIV step ahead of the CPU. */
+        uint64_t late = gb->apu_output.sample_cycles;
+        if (gb->div_cycles < 0) {
+            late += (uint64_t)(-gb->div_cycles << !gb->cgb_double_speed) * gb->apu_output.cycles_per_sample_den;
+        }
+        gb->apu_output.blip_phase_base = late * (GB_BLIP_PHASES << 16) / gb->apu_output.cycles_per_sample_num;
+    }
 
-    GB_sample_t filtered_output = gb->apu_output.highpass_mode?
-        (GB_sample_t) {output.left - gb->apu_output.highpass_diff.left,
-                       output.right - gb->apu_output.highpass_diff.right} :
-        output;
-
-    switch (gb->apu_output.highpass_mode) {
-        case GB_HIGHPASS_OFF:
-            gb->apu_output.highpass_diff = (GB_double_sample_t) {0, 0};
-            break;
-        case GB_HIGHPASS_ACCURATE:
-            gb->apu_output.highpass_diff = (GB_double_sample_t)
-                {output.left - filtered_output.left * gb->apu_output.highpass_rate,
-                    output.right - filtered_output.right * gb->apu_output.highpass_rate};
-            break;
-        case GB_HIGHPASS_REMOVE_DC_OFFSET: {
-            unsigned mask = gb->io_registers[GB_IO_NR51];
-            unsigned left_volume = 0;
-            unsigned right_volume = 0;
-            unrolled for (unsigned i = GB_N_CHANNELS; i--;) {
-                if (gb->apu.is_active[i]) {
-                    if (mask & 1) {
-                        left_volume += (gb->io_registers[GB_IO_NR50] & 7) * CH_STEP * 0xF;
-                    }
-                    if (mask & 0x10) {
-                        right_volume += ((gb->io_registers[GB_IO_NR50] >> 4) & 7) * CH_STEP * 0xF;
-                    }
+    if (gb->apu_output.highpass_mode == GB_HIGHPASS_REMOVE_DC_OFFSET) {
+        unsigned mask = gb->io_registers[GB_IO_NR51];
+        unsigned left_volume = 0;
+        unsigned right_volume = 0;
+        unrolled for (unsigned i = GB_N_CHANNELS; i--;) {
+            if (gb->apu.is_active[i]) {
+                if (mask & 1) {
+                    left_volume += (gb->io_registers[GB_IO_NR50] & 7) * CH_STEP * 0xF;
                 }
-                else {
-                    left_volume += gb->apu_output.current_sample[i].left * CH_STEP;
-                    right_volume += gb->apu_output.current_sample[i].right * CH_STEP;
+                if (mask & 0x10) {
+                    right_volume += ((gb->io_registers[GB_IO_NR50] >> 4) & 7) * CH_STEP * 0xF;
                 }
-                mask >>= 1;
             }
-            gb->apu_output.highpass_diff = (GB_double_sample_t)
-            {left_volume * (1 - gb->apu_output.highpass_rate) + gb->apu_output.highpass_diff.left * gb->apu_output.highpass_rate,
-                right_volume * (1 - gb->apu_output.highpass_rate) + gb->apu_output.highpass_diff.right * gb->apu_output.highpass_rate};
-
-        case GB_HIGHPASS_MAX:;
+            else {
+                left_volume += gb->apu_output.current_sample[i].left * CH_STEP;
+                right_volume += gb->apu_output.current_sample[i].right * CH_STEP;
+            }
+            mask >>= 1;
         }
-
+        gb->apu_output.block_dc_offset[0][position] = left_volume;
+        gb->apu_output.block_dc_offset[1][position] = right_volume;
     }
     
-    
     if (gb->apu_output.interference_volume) {
-        signed interference_bias = interference(gb);
+        signed interference_bias = interference_for(gb, family);
         int16_t interference_sample = (interference_bias - gb->apu_output.interference_highpass);
         gb->apu_output.interference_highpass = gb->apu_output.interference_highpass * gb->apu_output.highpass_rate +
         (1 - gb->apu_output.highpass_rate) * interference_sample;
-        interference_bias *= gb->apu_output.interference_volume;
-        
-        filtered_output.left = MAX(MIN(filtered_output.left + interference_bias, 0x7FFF), -0x8000);
-        filtered_output.right = MAX(MIN(filtered_output.right + interference_bias, 0x7FFF), -0x8000);
+        gb->apu_output.block_interference[position] = interference_bias * gb->apu_output.interference_volume;
+    }
+}
+
+/* The DAC of each channel fades in and out instead of switching instantly. Fills multiplier
+   with the channel's volume for every captured sample. */
+static void dac_multipliers(GB_gameboy_t *gb, unsigned index, float *multiplier)
+{
+    unsigned count = gb->apu_output.block_length;
+    if (gb->model >= GB_MODEL_AGB) {
+        for (unsigned i = 0; i < count; i++) {
+            multiplier[i] = CH_STEP;
+        }
+        return;
+    }
+    
+    uint8_t all_enabled = 0xFF, any_enabled = 0;
+    for (unsigned i = 0; i < count; i++) {
+        all_enabled &= gb->apu_output.block_dac_enabled[i];
+        any_enabled |= gb->apu_output.block_dac_enabled[i];
+    }
+    uint8_t bit = 1 << index;
+    uint8_t steps = gb->apu_output.dac_steps;
+    uint8_t position = gb->apu_output.dac_position[index];
+    if (((all_enabled & bit) && position == steps) || (!(any_enabled & bit) && position == 0)) {
+        /* Fully faded in or out for the whole block */
+        float value = gb->apu_output.dac_curve[position];
+        for (unsigned i = 0; i < count; i++) {
+            multiplier[i] = value;
+        }
+        return;
+    }
+    
+    for (unsigned i = 0; i < count; i++) {
+        if (gb->apu_output.block_dac_enabled[i] & bit) {
+            if (position < steps) position++;
+        }
+        else {
+            if (position) position--;
+        }
+        multiplier[i] = gb->apu_output.dac_curve[position];
+    }
+    gb->apu_output.dac_position[index] = position;
+}
+
+/* out = the sum of every channel's amplitude times its DAC multiplier */
+static void mix_block(float *out, const float *amplitude[GB_N_CHANNELS], const float *multiplier[GB_N_CHANNELS], unsigned count)
+{
+    unsigned i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_mul_ps(_mm256_loadu_ps(amplitude[0] + i), _mm256_loadu_ps(multiplier[0] + i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(amplitude[1] + i), _mm256_loadu_ps(multiplier[1] + i)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(amplitude[2] + i), _mm256_loadu_ps(multiplier[2] + i)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(amplitude[3] + i), _mm256_loadu_ps(multiplier[3] + i)));
+        _mm256_storeu_ps(out + i, sum);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_mul_ps(_mm_loadu_ps(amplitude[0] + i), _mm_loadu_ps(multiplier[0] + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(amplitude[1] + i), _mm_loadu_ps(multiplier[1] + i)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(amplitude[2] + i), _mm_loadu_ps(multiplier[2] + i)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(amplitude[3] + i), _mm_loadu_ps(multiplier[3] + i)));
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+    for (; i < count; i++) {
+        float sum = amplitude[0][i] * multiplier[0][i];
+        sum += amplitude[1][i] * multiplier[1][i];
+        sum += amplitude[2][i] * multiplier[2][i];
+        sum += amplitude[3][i] * multiplier[3][i];
+        out[i] = sum;
+    }
+}
+
+/* Runs the highpass filter over both sides of a mixed block and converts the result to
+   normalized floats. The filter is a recursion, so it's vectorized across the two sides
+   rather than across samples. mode is always a constant, so every call gets its own loop. */
+static inline void filter_block(GB_gameboy_t *gb, GB_highpass_mode_t mode, float *left, float *right, unsigned count)
+{
+    const double rate = gb->apu_output.highpass_rate;
+    const bool interference = gb->apu_output.interference_volume != 0;
+#if defined(__SSE2__)
+    const __m128d rate_v = _mm_set1_pd(rate);
+    const __m128d one_minus_rate = _mm_set1_pd(1 - rate);
+    const __m128d scale = _mm_set1_pd(1.0 / 0x8000);
+    const __m128d minimum = _mm_set1_pd(-0x8000);
+    const __m128d maximum = _mm_set1_pd(0x7FFF);
+    __m128d diff = _mm_set_pd(gb->apu_output.highpass_diff.right, gb->apu_output.highpass_diff.left);
+    __m128d output = _mm_setzero_pd();
+    for (unsigned i = 0; i < count; i++) {
+        __m128d input = _mm_set_pd(right[i], left[i]);
+        output = input;
+        if (mode != GB_HIGHPASS_OFF) {
+            output = _mm_sub_pd(input, diff);
+        }
+        if (mode == GB_HIGHPASS_ACCURATE) {
+            /* Uses the unrounded filter output. Rounding it every sample makes quiet signals decay
+               linearly instead of exponentially, and the higher the sample rate, the worse it gets. */
+            diff = _mm_sub_pd(input, _mm_mul_pd(output, rate_v));
+        }
+        else if (mode == GB_HIGHPASS_REMOVE_DC_OFFSET) {
+            __m128d target = _mm_set_pd(gb->apu_output.block_dc_offset[1][i], gb->apu_output.block_dc_offset[0][i]);
+            diff = _mm_add_pd(_mm_mul_pd(target, one_minus_rate), _mm_mul_pd(diff, rate_v));
+        }
+        if (unlikely(interference)) {
+            output = _mm_add_pd(output, _mm_set1_pd(gb->apu_output.block_interference[i]));
+            output = _mm_min_pd(_mm_max_pd(output, minimum), maximum);
+        }
+        __m128 converted = _mm_cvtpd_ps(_mm_mul_pd(output, scale));
+        left[i] = _mm_cvtss_f32(converted);
+        right[i] = _mm_cvtss_f32(_mm_shuffle_ps(converted, converted, 1));
+    }
+    if (mode == GB_HIGHPASS_OFF) {
+        diff = _mm_setzero_pd();
+    }
+    _mm_storel_pd(&gb->apu_output.highpass_diff.left, diff);
+    _mm_storeh_pd(&gb->apu_output.highpass_diff.right, diff);
+    if (count) {
+        _mm_storel_pd(&gb->apu_output.last_output.left, output);
+        _mm_storeh_pd(&gb->apu_output.last_output.right, output);
+    }
+#else
+    GB_double_sample_t diff = gb->apu_output.highpass_diff;
+    GB_double_sample_t output = gb->apu_output.last_output;
+    for (unsigned i = 0; i < count; i++) {
+        GB_double_sample_t input = {left[i], right[i]};
+        output = input;
+        if (mode != GB_HIGHPASS_OFF) {
+            output = (GB_double_sample_t) {input.left - diff.left, input.right - diff.right};
+        }
+        if (mode == GB_HIGHPASS_ACCURATE) {
+            /* Uses the unrounded filter output. Rounding it every sample makes quiet signals decay
+               linearly instead of exponentially, and the higher the sample rate, the worse it gets. */
+            diff = (GB_double_sample_t) {input.left - output.left * rate, input.right - output.right * rate};
+        }
+        else if (mode == GB_HIGHPASS_REMOVE_DC_OFFSET) {
+            diff = (GB_double_sample_t)
+                {gb->apu_output.block_dc_offset[0][i] * (1 - rate) + diff.left * rate,
+                    gb->apu_output.block_dc_offset[1][i] * (1 - rate) + diff.right * rate};
+        }
+        if (unlikely(interference)) {
+            output.left = MAX(MIN(output.left + gb->apu_output.block_interference[i], 0x7FFF), -0x8000);
+            output.right = MAX(MIN(output.right + gb->apu_output.block_interference[i], 0x7FFF), -0x8000);
+        }
+        left[i] = output.left * (1.0 / 0x8000);
+        right[i] = output.right * (1.0 / 0x8000);
+    }
+    if (mode == GB_HIGHPASS_OFF) {
+        diff = (GB_double_sample_t) {0, 0};
     }
+    gb->apu_output.highpass_diff = diff;
+    gb->apu_output.last_output = output;
+#endif
+}
 
-    gb->apu_output.final_sample=filtered_output;
+void GB_apu_flush_block(GB_gameboy_t *gb, float *left, float *right)
+{
+    unsigned count = gb->apu_output.block_length;
+    if (!count) return;
+    
+    float scratch[2][GB_APU_BLOCK_SIZE];
+    if (!left || !right) {
+        left = scratch[0];
+        right = scratch[1];
+    }
+    
+    float multipliers[GB_N_CHANNELS][GB_APU_BLOCK_SIZE];
+    const float *multiplier[GB_N_CHANNELS];
+    const float *amplitude[2][GB_N_CHANNELS];
+    unrolled for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
+        dac_multipliers(gb, i, multipliers[i]);
+        multiplier[i] = multipliers[i];
+        amplitude[0][i] = gb->apu_output.block_amplitude[i][0];
+        amplitude[1][i] = gb->apu_output.block_amplitude[i][1];
+    }
+    mix_block(left, amplitude[0], multiplier, count);
+    mix_block(right, amplitude[1], multiplier, count);
+    
+    switch (gb->apu_output.highpass_mode) {
+        case GB_HIGHPASS_ACCURATE:
+            filter_block(gb, GB_HIGHPASS_ACCURATE, left, right, count);
+            break;
+        case GB_HIGHPASS_REMOVE_DC_OFFSET:
+            filter_block(gb, GB_HIGHPASS_REMOVE_DC_OFFSET, left, right, count);
+            break;
+        case GB_HIGHPASS_OFF:
+        case GB_HIGHPASS_MAX:
+            filter_block(gb, GB_HIGHPASS_OFF, left, right, count);
+            break;
+    }
+    
+    gb->apu_output.block_length = 0;
 }
 
-static void update_square_sample(GB_gameboy_t *gb, unsigned index)
+static always_inline void update_square_sample_for(GB_gameboy_t *gb, apu_family_t family, unsigned index, unsigned cycles_offset)
 {
     if (gb->apu.square_channels[index].current_sample_index & 0x80) return;
 
     uint8_t duty = gb->io_registers[index == GB_SQUARE_1? GB_IO_NR11 :GB_IO_NR21] >> 6;
-    update_sample(gb, index,
-                  duties[gb->apu.square_channels[index].current_sample_index + duty * 8]?
-                  gb->apu.square_channels[index].current_volume : 0,
-                  0);
+    update_sample_for(gb, family, index,
+                      duties[gb->apu.square_channels[index].current_sample_index + duty * 8]?
+                      gb->apu.square_channels[index].current_volume : 0,
+                      cycles_offset);
+}
+
+static void update_square_sample(GB_gameboy_t *gb, unsigned index, unsigned cycles_offset)
+{
+    update_square_sample_for(gb, model_family(gb), index, cycles_offset);
 }
 
 
@@ -405,7 +790,7 @@ static void tick_square_envelope(GB_gameboy_t *gb, enum GB_CHANNELS index)
     }
 
     if (gb->apu.is_active[index]) {
-        update_square_sample(gb, index);
+        update_square_sample(gb, index, 0);
     }
 }
 
@@ -560,7 +945,7 @@ void GB_apu_div_secondary_event(GB_gameboy_t *gb)
     }
 }
 
-static void step_lfsr(GB_gameboy_t *gb, unsigned cycles_offset)
+static always_inline void step_lfsr_for(GB_gameboy_t *gb, apu_family_t family, unsigned cycles_offset)
 {
     unsigned high_bit_mask = gb->apu.noise_channel.narrow ? 0x4040 : 0x4000;
     bool new_high_bit = (gb->apu.noise_channel.lfsr ^ (gb->apu.noise_channel.lfsr >> 1) ^ 1) & 1;
@@ -576,22 +961,152 @@ static void step_lfsr(GB_gameboy_t *gb, unsigned cycles_offset)
     
     gb->apu.current_lfsr_sample = gb->apu.noise_channel.lfsr & 1;
     if (gb->apu.is_active[GB_NOISE]) {
-        update_sample(gb, GB_NOISE,
-                      gb->apu.current_lfsr_sample ?
-                      gb->apu.noise_channel.current_volume : 0,
-                      cycles_offset);
+        update_sample_for(gb, family, GB_NOISE,
+                          gb->apu.current_lfsr_sample ?
+                          gb->apu.noise_channel.current_volume : 0,
+                          cycles_offset);
     }
 }
 
-void GB_apu_run(GB_gameboy_t *gb)
+static void step_lfsr(GB_gameboy_t *gb, unsigned cycles_offset)
+{
+    step_lfsr_for(gb, model_family(gb), cycles_offset);
+}
+
+/* Apart from its lock-up state (all ones), the noise LFSR is a maximal length sequence:
+   the 15-bit LFSR cycles through all other 32767 states, and the low 7 bits of the narrow
+   one through 127. These tables map states to their position in that cycle and back, and
+   count the 1 outputs up to every position, so any number of steps can be taken at once. */
+#define LFSR_15_PERIOD 0x7FFF
+#define LFSR_7_PERIOD 0x7F
+#define LFSR_BULK_MIN_STEPS 8
+
+static atomic_int lfsr_tables_state;
+static struct {
+    uint16_t state_15[LFSR_15_PERIOD];
+    uint16_t position_15[0x8000];
+    uint16_t ones_15[LFSR_15_PERIOD + 1]; // 1 outputs in positions [0, i)
+    uint8_t state_7[LFSR_7_PERIOD];
+    uint8_t position_7[0x80];
+    uint16_t ones_7[LFSR_7_PERIOD + 1];
+} lfsr_tables;
+
+static void build_lfsr_tables(void)
+{
+    uint16_t lfsr = 0;
+    lfsr_tables.position_15[0x7FFF] = 0xFFFF;
+    for (unsigned i = 0; i < LFSR_15_PERIOD; i++) {
+        lfsr_tables.state_15[i] = lfsr;
+        lfsr_tables.position_15[lfsr] = i;
+        lfsr_tables.ones_15[i + 1] = lfsr_tables.ones_15[i] + (lfsr & 1);
+        lfsr = (lfsr >> 1) | (((lfsr ^ (lfsr >> 1) ^ 1) & 1) << 14);
+    }
+    
+    lfsr = 0;
+    lfsr_tables.position_7[0x7F] = 0xFF;
+    for (unsigned i = 0; i < LFSR_7_PERIOD; i++) {
+        lfsr_tables.state_7[i] = lfsr;
+        lfsr_tables.position_7[lfsr] = i;
+        lfsr_tables.ones_7[i + 1] = lfsr_tables.ones_7[i] + (lfsr & 1);
+        lfsr = (lfsr >> 1) | (((lfsr ^ (lfsr >> 1) ^ 1) & 1) << 6);
+    }
+}
+
+static void init_lfsr_tables(void)
+{
+    build_tables_once(&lfsr_tables_state, build_lfsr_tables);
+}
+
+/* Number of 1 outputs in the count positions starting at position, wrapping around the cycle */
+static unsigned lfsr_ones(const uint16_t *ones, unsigned period, unsigned position, unsigned count)
+{
+    unsigned ret = (count / period) * ones[period];
+    unsigned end = position + count % period;
+    if (end <= period) {
+        return ret + ones[end] - ones[position];
+    }
+    return ret + ones[period] - ones[position] + ones[end - period];
+}
+
+/* Same as calling step_lfsr() steps times, at cycles_offset, cycles_offset + period, and so on */
+static always_inline void step_lfsr_bulk_for(GB_gameboy_t *gb, apu_family_t family, unsigned steps, unsigned cycles_offset, unsigned period)
+{
+    uint16_t lfsr = gb->apu.noise_channel.lfsr;
+    bool narrow = gb->apu.noise_channel.narrow;
+    if (steps < LFSR_BULK_MIN_STEPS || gb->apu_output.band_limited ||
+        (narrow? (lfsr & 0x7F) == 0x7F : lfsr == 0x7FFF)) {
+        for (unsigned i = 0; i < steps; i++) {
+            step_lfsr_for(gb, family, cycles_offset + i * period);
+        }
+        return;
+    }
+    
+    /* The first and last steps are taken normally, they take care of the switching widths
+       quirk, the output changes caused by register writes and the sample bookkeeping.
+       Everything in between only alternates between the same two output values. */
+    step_lfsr_for(gb, family, cycles_offset);
+    lfsr = gb->apu.noise_channel.lfsr;
+    bool first_output = lfsr & 1;
+    unsigned middle = steps - 2;
+    unsigned ones;
+    
+    if (narrow) {
+        unsigned position = lfsr_tables.position_7[lfsr & 0x7F];
+        ones = lfsr_ones(lfsr_tables.ones_7, LFSR_7_PERIOD, position, middle);
+        /* Bits 7-14 are the low bits shifted down, followed by the new high bits */
+        uint16_t new_lfsr = lfsr_tables.state_7[(position + middle) % LFSR_7_PERIOD];
+        for (unsigned bit = 7; bit <= 14; bit++) {
+            unsigned source = bit + middle;
+            if (source <= 14) {
+                new_lfsr |= ((lfsr >> source) & 1) << bit;
+            }
+            else {
+                new_lfsr |= ((lfsr_tables.state_7[(position + source - 14) % LFSR_7_PERIOD] >> 6) & 1) << bit;
+            }
+        }
+        lfsr = new_lfsr;
+    }
+    else {
+        unsigned position = lfsr_tables.position_15[lfsr];
+        ones = lfsr_ones(lfsr_tables.ones_15, LFSR_15_PERIOD, position, middle);
+        lfsr = lfsr_tables.state_15[(position + middle) % LFSR_15_PERIOD];
+    }
+    
+    gb->apu.noise_channel.lfsr = lfsr;
+    gb->apu.current_lfsr_sample = lfsr & 1;
+    
+    if (gb->apu.is_active[GB_NOISE] && dac_enabled_for(gb, family, GB_NOISE)) {
+        int8_t value = gb->apu.current_lfsr_sample ? gb->apu.noise_channel.current_volume : 0;
+        gb->apu.samples[GB_NOISE] = value;
+        GB_sample_t high = sample_for_value(gb, family, GB_NOISE, gb->apu.noise_channel.current_volume);
+        GB_sample_t low = sample_for_value(gb, family, GB_NOISE, 0);
+        bool changed = *(uint32_t *)&high != *(uint32_t *)&low &&
+                       !(ones == (first_output? middle : 0) && gb->apu.current_lfsr_sample == first_output);
+        /* render() relies on last_update staying 0 if the output never changed, so only
+           touch the sums if it did change at some point between the first and last steps */
+        if (gb->apu_output.sample_rate && changed) {
+            refresh_channel(gb, GB_NOISE, cycles_offset);
+            unsigned zeros = middle - ones;
+            gb->apu_output.summed_samples[GB_NOISE].left += (high.left * ones + low.left * zeros) * period;
+            gb->apu_output.summed_samples[GB_NOISE].right += (high.right * ones + low.right * zeros) * period;
+            gb->apu_output.last_update[GB_NOISE] += middle * period;
+            gb->apu_output.current_sample[GB_NOISE] = sample_for_value(gb, family, GB_NOISE, value);
+        }
+    }
+    /* With the DAC off the output stays the same no matter what the LFSR does */
+    
+    step_lfsr_for(gb, family, cycles_offset + (steps - 1) * period);
+}
+
+static always_inline void apu_run_for(GB_gameboy_t *gb, apu_family_t family)
 {
     /* Convert 4MHZ to 2MHz. apu_cycles is always divisable by 4. */
-    uint8_t cycles = gb->apu.apu_cycles >> 2;
+    unsigned cycles = gb->apu.apu_cycles >> 2;
     gb->apu.apu_cycles = 0;
     if (!cycles) return;
     
     bool start_ch4 = false;
-    if (likely(!gb->stopped || CGB)) {
+    if (likely(!gb->stopped || family != APU_FAMILY_DMG)) {
         if (gb->apu.channel_4_dmg_delayed_start) {
             if (gb->apu.channel_4_dmg_delayed_start == cycles) {
                 gb->apu.channel_4_dmg_delayed_start = 0;
@@ -627,7 +1142,7 @@ void GB_apu_run(GB_gameboy_t *gb)
                 }
                 if (gb->apu.shadow_sweep_sample_length + gb->apu.sweep_length_addend > 0x7FF && !(gb->io_registers[GB_IO_NR10] & 8)) {
                     gb->apu.is_active[GB_SQUARE_1] = false;
-                    update_sample(gb, GB_SQUARE_1, 0, gb->apu.square_sweep_calculate_countdown - cycles);
+                    update_sample_for(gb, family, GB_SQUARE_1, 0, gb->apu.square_sweep_calculate_countdown - cycles);
                 }
                 gb->apu.channel1_completed_addend = gb->apu.sweep_length_addend;
                 
@@ -646,7 +1161,7 @@ void GB_apu_run(GB_gameboy_t *gb)
 
         unrolled for (unsigned i = GB_SQUARE_1; i <= GB_SQUARE_2; i++) {
             if (gb->apu.is_active[i]) {
-                uint8_t cycles_left = cycles;
+                unsigned cycles_left = cycles;
                 while (unlikely(cycles_left > gb->apu.square_channels[i].sample_countdown)) {
                     cycles_left -= gb->apu.square_channels[i].sample_countdown + 1;
                     gb->apu.square_channels[i].sample_countdown = (gb->apu.square_channels[i].sample_length ^ 0x7FF) * 2 + 1;
@@ -656,7 +1171,7 @@ void GB_apu_run(GB_gameboy_t *gb)
                         gb->apu.pcm_mask[0] &= i == GB_SQUARE_1? 0xF0 : 0x0F;
                     }
 
-                    update_square_sample(gb, i);
+                    update_square_sample_for(gb, family, i, cycles - cycles_left);
                 }
                 if (cycles_left) {
                     gb->apu.square_channels[i].sample_countdown -= cycles_left;
@@ -666,7 +1181,7 @@ void GB_apu_run(GB_gameboy_t *gb)
 
         gb->apu.wave_channel.wave_form_just_read = false;
         if (gb->apu.is_active[GB_WAVE]) {
-            uint8_t cycles_left = cycles;
+            unsigned cycles_left = cycles;
             while (unlikely(cycles_left > gb->apu.wave_channel.sample_countdown)) {
                 uint8_t base = (!gb->apu.wave_channel.double_length && gb->apu.wave_channel.bank_select) ? 32 : 0;
                 cycles_left -= gb->apu.wave_channel.sample_countdown + 1;
@@ -678,7 +1193,7 @@ void GB_apu_run(GB_gameboy_t *gb)
                 int8_t sample = gb->apu.wave_channel.force_3 ?
                     (gb->apu.wave_channel.current_sample * 3) >> 2 :
                     gb->apu.wave_channel.current_sample >> gb->apu.wave_channel.shift;
-                update_sample(gb, GB_WAVE, sample, cycles - cycles_left);
+                update_sample_for(gb, family, GB_WAVE, sample, cycles - cycles_left);
                 gb->apu.wave_channel.wave_form_just_read = true;
             }
             if (cycles_left) {
@@ -688,14 +1203,50 @@ void GB_apu_run(GB_gameboy_t *gb)
         }
         
         // The noise channel can step even if inactive on the DMG
-        if (gb->apu.is_active[GB_NOISE] || !CGB) {
-            uint8_t cycles_left = cycles;
+        if (gb->apu.is_active[GB_NOISE] || family == APU_FAMILY_DMG) {
+            unsigned cycles_left = cycles;
             unsigned divisor = (gb->io_registers[GB_IO_NR43] & 0x07) << 2;
             if (!divisor) divisor = 2;
             if (gb->apu.noise_channel.counter_countdown == 0) {
                 gb->apu.noise_channel.counter_countdown = divisor;
             }
             while (unlikely(cycles_left >= gb->apu.noise_channel.counter_countdown)) {
+                /* Counter ticks that can't clock the LFSR only move the counter, so jump over
+                   them in one go and stop right before the next tick that can. */
+                if (!gb->apu.channel_4_delta) {
+                    unsigned shift = gb->io_registers[GB_IO_NR43] >> 4;
+                    unsigned quiet_ticks = 0x4000;
+                    if (shift < 14) {
+                        unsigned period = 2 << shift;
+                        quiet_ticks = (((1 << shift) - gb->apu.noise_channel.counter) & (period - 1));
+                        if (!quiet_ticks) quiet_ticks = period;
+                        quiet_ticks--;
+                    }
+                    unsigned ticks = 1 + (cycles_left - gb->apu.noise_channel.counter_countdown) / divisor;
+                    if (ticks > quiet_ticks) ticks = quiet_ticks;
+                    if (ticks) {
+                        cycles_left -= gb->apu.noise_channel.counter_countdown + (ticks - 1) * divisor;
+                        gb->apu.noise_channel.counter_countdown = divisor;
+                        gb->apu.noise_channel.counter += ticks;
+                        gb->apu.noise_channel.counter &= 0x3FFF;
+                        continue;
+                    }
+                    /* The next tick steps the LFSR, and so does every (2 << shift)th tick after it.
+                       Take all of those steps but the last at once, the last one is taken below. */
+                    if (shift < 14) {
+                        unsigned period = (2 << shift) * divisor;
+                        unsigned steps = (cycles_left - gb->apu.noise_channel.counter_countdown) / period;
+                        if (steps >= LFSR_BULK_MIN_STEPS) {
+                            unsigned first_step = cycles - cycles_left + gb->apu.noise_channel.counter_countdown;
+                            step_lfsr_bulk_for(gb, family, steps, first_step, period);
+                            cycles_left -= gb->apu.noise_channel.counter_countdown + (steps - 1) * period;
+                            gb->apu.noise_channel.counter_countdown = divisor;
+                            gb->apu.noise_channel.counter += 1 + (steps - 1) * (2 << shift);
+                            gb->apu.noise_channel.counter &= 0x3FFF;
+                            continue;
+                        }
+                    }
+                }
                 cycles_left -= gb->apu.noise_channel.counter_countdown;
                 gb->apu.noise_channel.counter_countdown = divisor + gb->apu.channel_4_delta;
                 gb->apu.channel_4_delta = 0;
@@ -709,7 +1260,7 @@ void GB_apu_run(GB_gameboy_t *gb)
                     if (cycles_left == 0 && gb->apu.samples[GB_NOISE] == 0) {
                         gb->apu.pcm_mask[1] &= 0x0F;
                     }
-                    step_lfsr(gb, cycles - cycles_left);
+                    step_lfsr_for(gb, family, cycles - cycles_left);
                 }
             }
             if (cycles_left) {
@@ -725,9 +1276,9 @@ void GB_apu_run(GB_gameboy_t *gb)
     if (gb->apu_output.sample_rate) {
         gb->apu_output.cycles_since_render += cycles;
 
-        if (gb->apu_output.sample_cycles >= gb->apu_output.cycles_per_sample) {
-            gb->apu_output.sample_cycles -= gb->apu_output.cycles_per_sample;
-            render(gb);
+        if (gb->apu_output.sample_cycles >= gb->apu_output.cycles_per_sample_num) {
+            gb->apu_output.sample_cycles -= gb->apu_output.cycles_per_sample_num;
+            render_for(gb, family);
         }
     }
     if (start_ch4) {
@@ -735,12 +1286,35 @@ void GB_apu_run(GB_gameboy_t *gb)
     }
 }
 
-void GB_apu_init(GB_gameboy_t *gb)
+static void apu_run_dmg(GB_gameboy_t *gb)
 {
-    memset(&gb->apu, 0, sizeof(gb->apu));
-    /* Restore the wave form */
-    for (unsigned reg = GB_IO_WAV_START; reg <= GB_IO_WAV_END; reg++) {
-        gb->apu.wave_channel.wave_form[(reg - GB_IO_WAV_START) * 2]      = gb->io_registers[reg] >> 4;
+    apu_run_for(gb, APU_FAMILY_DMG);
+}
+
+static void apu_run_cgb(GB_gameboy_t *gb)
+{
+    apu_run_for(gb, APU_FAMILY_CGB);
+}
+
+static void apu_run_agb(GB_gameboy_t *gb)
+{
+    apu_run_for(gb, APU_FAMILY_AGB);
+}
+
+void GB_apu_run(GB_gameboy_t *gb)
+{
+    gb->apu_output.run(gb);
+}
+
+void GB_apu_init(GB_gameboy_t *gb)
+{
+    init_lfsr_tables();
+    init_blip_tables();
+    GB_apu_update_model(gb);
+    memset(&gb->apu, 0, sizeof(gb->apu));
+    /* Restore the wave form */
+    for (unsigned reg = GB_IO_WAV_START; reg <= GB_IO_WAV_END; reg++) {
+        gb->apu.wave_channel.wave_form[(reg - GB_IO_WAV_START) * 2]      = gb->io_registers[reg] >> 4;
         gb->apu.wave_channel.wave_form[(reg - GB_IO_WAV_START) * 2 + 1]  = gb->io_registers[reg] & 0xF;
         gb->apu.wave_channel.wave_form[(reg - GB_IO_WAV_START) * 2 + 32] = gb->io_registers[reg] >> 4;
         gb->apu.wave_channel.wave_form[(reg - GB_IO_WAV_START) * 2 + 33] = gb->io_registers[reg] & 0xF;
@@ -754,47 +1328,75 @@ void GB_apu_init(GB_gameboy_t *gb)
     }
 }
 
-uint8_t GB_apu_read(GB_gameboy_t *gb, uint8_t reg)
+/* Register accesses are dispatched through per-family tables, see GB_apu_update_model. Every
+   write handler stores the written value itself, because some of them change it first. */
+typedef void (*apu_write_handler_t)(GB_gameboy_t *gb, uint8_t reg, uint8_t value);
+typedef uint8_t (*apu_read_handler_t)(GB_gameboy_t *gb, uint8_t reg);
+
+struct GB_apu_register_handlers_s {
+    apu_write_handler_t write[2][GB_IO_WAV_END - GB_IO_NR10 + 1]; // [global_enable][reg - GB_IO_NR10]
+    apu_read_handler_t read[GB_IO_WAV_END - GB_IO_NR10 + 1];
+};
+
+static const uint8_t read_mask[GB_IO_WAV_END - GB_IO_NR10 + 1] = {
+ /* NRX0  NRX1  NRX2  NRX3  NRX4 */
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR1X
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, // NR2X
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR3X
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, // NR4X
+    0x00, 0x00, 0x70, 0xFF, 0xFF, // NR5X
+
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // Unused
+    // Wave RAM
+    0, /* ... */
+};
+
+static uint8_t read_masked(GB_gameboy_t *gb, uint8_t reg)
 {
-    if (reg == GB_IO_NR52) {
-        uint8_t value = 0;
-        for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
-            value >>= 1;
-            if (gb->apu.is_active[i]) {
-                value |= 0x8;
-            }
-        }
-        if (gb->apu.global_enable) {
-            value |= 0x80;
+    return gb->io_registers[reg] | read_mask[reg - GB_IO_NR10];
+}
+
+static uint8_t read_nr52(GB_gameboy_t *gb, uint8_t reg)
+{
+    uint8_t value = 0;
+    for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
+        value >>= 1;
+        if (gb->apu.is_active[i]) {
+            value |= 0x8;
         }
-        value |= 0x70;
-        return value;
     }
+    if (gb->apu.global_enable) {
+        value |= 0x80;
+    }
+    value |= 0x70;
+    return value;
+}
 
-    static const char read_mask[GB_IO_WAV_END - GB_IO_NR10 + 1] = {
-     /* NRX0  NRX1  NRX2  NRX3  NRX4 */
-        0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR1X
-        0xFF, 0x3F, 0x00, 0xFF, 0xBF, // NR2X
-        0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR3X
-        0xFF, 0xFF, 0x00, 0x00, 0xBF, // NR4X
-        0x00, 0x00, 0x70, 0xFF, 0xFF, // NR5X
-
-        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // Unused
-        // Wave RAM
-        0, /* ... */
-    };
-
-    if (reg >= GB_IO_WAV_START && reg <= GB_IO_WAV_END && gb->apu.is_active[GB_WAVE]) {
-        if (!CGB && !gb->apu.wave_channel.wave_form_just_read) {
+static uint8_t read_wave_dmg(GB_gameboy_t *gb, uint8_t reg)
+{
+    if (gb->apu.is_active[GB_WAVE]) {
+        if (!gb->apu.wave_channel.wave_form_just_read) {
             return 0xFF;
         }
+        reg = GB_IO_WAV_START + gb->apu.wave_channel.current_sample_index / 2;
+    }
+    return gb->io_registers[reg];
+}
+
+static uint8_t read_wave_cgb(GB_gameboy_t *gb, uint8_t reg)
+{
+    if (gb->apu.is_active[GB_WAVE]) {
         if (gb->model == GB_MODEL_AGB) {
             return 0xFF;
         }
         reg = GB_IO_WAV_START + gb->apu.wave_channel.current_sample_index / 2;
     }
+    return gb->io_registers[reg];
+}
 
-    return gb->io_registers[reg] | read_mask[reg - GB_IO_NR10];
+uint8_t GB_apu_read(GB_gameboy_t *gb, uint8_t reg)
+{
+    return gb->apu_output.register_handlers->read[reg - GB_IO_NR10](gb, reg);
 }
 
 static inline uint16_t effective_channel4_counter(GB_gameboy_t *gb)
@@ -920,531 +1522,681 @@ static inline uint16_t effective_channel4_counter(GB_gameboy_t *gb)
     return effective_counter;
 }
 
-void GB_apu_write(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+/* Writes to most registers are ignored while the APU is off */
+static void write_ignored(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
 {
-    if (!gb->apu.global_enable && reg != GB_IO_NR52 && reg < GB_IO_WAV_START && (CGB ||
-                                                                                (
-                                                                                reg != GB_IO_NR11 &&
-                                                                                reg != GB_IO_NR21 &&
-                                                                                reg != GB_IO_NR31 &&
-                                                                                reg != GB_IO_NR41
-                                                                                )
-                                                                                )) {
-        return;
+}
+
+/* Unused registers read back as all ones, so storing the value is all a write does */
+static void write_unused(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr50_nr51(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    /* Rewriting the current routing or volume doesn't change anything */
+    if (gb->io_registers[reg] == value) return;
+    gb->io_registers[reg] = value;
+    /* These registers affect the output of all 4 channels (but not the output of the PCM registers).*/
+    /* We call update_samples with the current value so the APU output is updated with the new outputs */
+    for (unsigned i = GB_N_CHANNELS; i--;) {
+        update_sample(gb, i, gb->apu.samples[i], 0);
     }
+}
 
-    if (reg >= GB_IO_WAV_START && reg <= GB_IO_WAV_END && gb->apu.is_active[GB_WAVE]) {
-        if (!CGB && !gb->apu.wave_channel.wave_form_just_read) {
-            return;
+static void write_nr52(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    uint8_t old_pulse_lengths[] = {
+        gb->apu.square_channels[0].pulse_length,
+        gb->apu.square_channels[1].pulse_length,
+        gb->apu.wave_channel.pulse_length,
+        gb->apu.noise_channel.pulse_length
+    };
+    if ((value & 0x80) && !gb->apu.global_enable) {
+        GB_apu_init(gb);
+        gb->apu.global_enable = true;
+    }
+    else if (!(value & 0x80) && gb->apu.global_enable)  {
+        for (unsigned i = GB_N_CHANNELS; i--;) {
+            update_sample(gb, i, 0, 0);
         }
-        reg = GB_IO_WAV_START + gb->apu.wave_channel.current_sample_index / 2;
+        memset(&gb->apu, 0, sizeof(gb->apu));
+        memset(gb->io_registers + GB_IO_NR10, 0, GB_IO_WAV_START - GB_IO_NR10);
+        gb->apu.global_enable = false;
     }
 
-    /* Todo: this can and should be rewritten with a function table. */
-    switch (reg) {
-        /* Globals */
-        case GB_IO_NR50:
-        case GB_IO_NR51:
-            gb->io_registers[reg] = value;
-            /* These registers affect the output of all 4 channels (but not the output of the PCM registers).*/
-            /* We call update_samples with the current value so the APU output is updated with the new outputs */
-            for (unsigned i = GB_N_CHANNELS; i--;) {
-                update_sample(gb, i, gb->apu.samples[i], 0);
-            }
-            break;
-        case GB_IO_NR52: {
-
-            uint8_t old_pulse_lengths[] = {
-                gb->apu.square_channels[0].pulse_length,
-                gb->apu.square_channels[1].pulse_length,
-                gb->apu.wave_channel.pulse_length,
-                gb->apu.noise_channel.pulse_length
-            };
-            if ((value & 0x80) && !gb->apu.global_enable) {
-                GB_apu_init(gb);
-                gb->apu.global_enable = true;
-            }
-            else if (!(value & 0x80) && gb->apu.global_enable)  {
-                for (unsigned i = GB_N_CHANNELS; i--;) {
-                    update_sample(gb, i, 0, 0);
-                }
-                memset(&gb->apu, 0, sizeof(gb->apu));
-                memset(gb->io_registers + GB_IO_NR10, 0, GB_IO_WAV_START - GB_IO_NR10);
-                gb->apu.global_enable = false;
-            }
+    if (!CGB && (value & 0x80)) {
+        gb->apu.square_channels[0].pulse_length = old_pulse_lengths[0];
+        gb->apu.square_channels[1].pulse_length = old_pulse_lengths[1];
+        gb->apu.wave_channel.pulse_length = old_pulse_lengths[2];
+        gb->apu.noise_channel.pulse_length = old_pulse_lengths[3];
+    }
+    gb->io_registers[reg] = value;
+}
 
-            if (!CGB && (value & 0x80)) {
-                gb->apu.square_channels[0].pulse_length = old_pulse_lengths[0];
-                gb->apu.square_channels[1].pulse_length = old_pulse_lengths[1];
-                gb->apu.wave_channel.pulse_length = old_pulse_lengths[2];
-                gb->apu.noise_channel.pulse_length = old_pulse_lengths[3];
-            }
-        }
-        break;
+static void write_nr10(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    bool old_negate = gb->io_registers[GB_IO_NR10] & 8;
+    gb->io_registers[GB_IO_NR10] = value;
+    if (gb->apu.shadow_sweep_sample_length + gb->apu.channel1_completed_addend + old_negate > 0x7FF &&
+        !(value & 8)) {
+        gb->apu.is_active[GB_SQUARE_1] = false;
+        update_sample(gb, GB_SQUARE_1, 0, 0);
+    }
+    trigger_sweep_calculation(gb);
+    gb->io_registers[reg] = value;
+}
+
+static void write_nrx1_square(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    unsigned index = reg == GB_IO_NR21? GB_SQUARE_2: GB_SQUARE_1;
+    gb->apu.square_channels[index].pulse_length = (0x40 - (value & 0x3f));
+    if (!gb->apu.global_enable) {
+        value &= 0x3f;
+    }
+    gb->io_registers[reg] = value;
+}
 
-        /* Square channels */
-        case GB_IO_NR10:{
-            bool old_negate = gb->io_registers[GB_IO_NR10] & 8;
-            gb->io_registers[GB_IO_NR10] = value;
-            if (gb->apu.shadow_sweep_sample_length + gb->apu.channel1_completed_addend + old_negate > 0x7FF &&
-                !(value & 8)) {
-                gb->apu.is_active[GB_SQUARE_1] = false;
-                update_sample(gb, GB_SQUARE_1, 0, 0);
+static void write_nrx2_square(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    unsigned index = reg == GB_IO_NR22? GB_SQUARE_2: GB_SQUARE_1;
+    if ((value & 0xF8) == 0) {
+        /* This disables the DAC */
+        gb->io_registers[reg] = value;
+        gb->apu.is_active[index] = false;
+        update_sample(gb, index, 0, 0);
+    }
+    else if (gb->apu.is_active[index]) {
+        nrx2_glitch(gb, &gb->apu.square_channels[index].current_volume,
+                    value, gb->io_registers[reg], &gb->apu.square_channels[index].volume_countdown,
+                    &gb->apu.square_envelope_clock[index]);
+        update_square_sample(gb, index, 0);
+    }
+    gb->io_registers[reg] = value;
+}
+
+static void write_nrx3_square(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    unsigned index = reg == GB_IO_NR23? GB_SQUARE_2: GB_SQUARE_1;
+    gb->apu.square_channels[index].sample_length &= ~0xFF;
+    gb->apu.square_channels[index].sample_length |= value & 0xFF;
+    gb->io_registers[reg] = value;
+}
+
+static void write_nrx4_square(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    unsigned index = reg == GB_IO_NR24? GB_SQUARE_2: GB_SQUARE_1;
+    bool was_active = gb->apu.is_active[index];
+    /* TODO: When the sample length changes right before being updated, the countdown should change to the
+             old length, but the current sample should not change. Because our write timing isn't accurate to
+             the T-cycle, we hack around it by stepping the sample index backwards. */
+    if ((value & 0x80) == 0 && gb->apu.is_active[index]) {
+        /* On an AGB, as well as on CGB C and earlier (TODO: Tested: 0, B and C), it behaves slightly different on
+           double speed. */
+        if (gb->model == GB_MODEL_CGB_E /* || gb->model == GB_MODEL_CGB_D */ || gb->apu.square_channels[index].sample_countdown & 1) {
+            if (gb->apu.square_channels[index].sample_countdown >> 1 == (gb->apu.square_channels[index].sample_length ^ 0x7FF)) {
+                gb->apu.square_channels[index].current_sample_index--;
+                gb->apu.square_channels[index].current_sample_index &= 7;
             }
-            trigger_sweep_calculation(gb);
-            break;
         }
+    }
 
-        case GB_IO_NR11:
-        case GB_IO_NR21: {
-            unsigned index = reg == GB_IO_NR21? GB_SQUARE_2: GB_SQUARE_1;
-            gb->apu.square_channels[index].pulse_length = (0x40 - (value & 0x3f));
-            if (!gb->apu.global_enable) {
-                value &= 0x3f;
+    uint16_t old_sample_length = gb->apu.square_channels[index].sample_length;
+    gb->apu.square_channels[index].sample_length &= 0xFF;
+    gb->apu.square_channels[index].sample_length |= (value & 7) << 8;
+    if (value & 0x80) {
+        /* Current sample index remains unchanged when restarting channels 1 or 2. It is only reset by
+           turning the APU off. */
+        gb->apu.square_envelope_clock[index].locked = false;
+        gb->apu.square_envelope_clock[index].clock = false;
+        if (!gb->apu.is_active[index]) {
+            gb->apu.square_channels[index].sample_countdown = (gb->apu.square_channels[index].sample_length ^ 0x7FF) * 2 + 6 - gb->apu.lf_div;
+            if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
+                gb->apu.square_channels[index].sample_countdown += 2;
             }
-            break;
         }
-
-        case GB_IO_NR12:
-        case GB_IO_NR22: {
-            unsigned index = reg == GB_IO_NR22? GB_SQUARE_2: GB_SQUARE_1;
-            if ((value & 0xF8) == 0) {
-                /* This disables the DAC */
-                gb->io_registers[reg] = value;
-                gb->apu.is_active[index] = false;
-                update_sample(gb, index, 0, 0);
+        else {
+            unsigned extra_delay = 0;
+            if (gb->model == GB_MODEL_CGB_E /* || gb->model == GB_MODEL_CGB_D */) {
+                if (!(value & 4) && !(((gb->apu.square_channels[index].sample_countdown - 1) / 2) & 0x400)) {
+                    gb->apu.square_channels[index].current_sample_index++;
+                    gb->apu.square_channels[index].current_sample_index &= 0x7;
+                    gb->apu.is_active[index] = true;
+                }
+                /* Todo: verify with the schematics what's going on in here */
+                else if (gb->apu.square_channels[index].sample_length == 0x7FF &&
+                         old_sample_length != 0x7FF &&
+                         (gb->apu.square_channels[index].current_sample_index & 0x80)) {
+                    extra_delay += 2;
+                }
             }
-            else if (gb->apu.is_active[index]) {
-                nrx2_glitch(gb, &gb->apu.square_channels[index].current_volume,
-                            value, gb->io_registers[reg], &gb->apu.square_channels[index].volume_countdown,
-                            &gb->apu.square_envelope_clock[index]);
-                update_square_sample(gb, index);
+            /* Timing quirk: if already active, sound starts 2 (2MHz) ticks earlier.*/
+            gb->apu.square_channels[index].sample_countdown = (gb->apu.square_channels[index].sample_length ^ 0x7FF) * 2 + 4 - gb->apu.lf_div + extra_delay;
+            if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
+                gb->apu.square_channels[index].sample_countdown += 2;
             }
-
-            break;
         }
-
-        case GB_IO_NR13:
-        case GB_IO_NR23: {
-            unsigned index = reg == GB_IO_NR23? GB_SQUARE_2: GB_SQUARE_1;
-            gb->apu.square_channels[index].sample_length &= ~0xFF;
-            gb->apu.square_channels[index].sample_length |= value & 0xFF;
-            break;
+        gb->apu.square_channels[index].current_volume = gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] >> 4;
+        /* The volume changes caused by NRX4 sound start take effect instantly (i.e. the effect the previously
+           started sound). The playback itself is not instant which is why we don't update the sample for other
+           cases. */
+        if (gb->apu.is_active[index]) {
+            update_square_sample(gb, index, 0);
         }
 
-        case GB_IO_NR14:
-        case GB_IO_NR24: {
-            /* TODO: GB_MODEL_CGB_D fails channel_1_sweep_restart_2, don't forget when adding support for this revision! */
-            unsigned index = reg == GB_IO_NR24? GB_SQUARE_2: GB_SQUARE_1;
-            bool was_active = gb->apu.is_active[index];
-            /* TODO: When the sample length changes right before being updated, the countdown should change to the
-                     old length, but the current sample should not change. Because our write timing isn't accurate to
-                     the T-cycle, we hack around it by stepping the sample index backwards. */
-            if ((value & 0x80) == 0 && gb->apu.is_active[index]) {
-                /* On an AGB, as well as on CGB C and earlier (TODO: Tested: 0, B and C), it behaves slightly different on
-                   double speed. */
-                if (gb->model == GB_MODEL_CGB_E /* || gb->model == GB_MODEL_CGB_D */ || gb->apu.square_channels[index].sample_countdown & 1) {
-                    if (gb->apu.square_channels[index].sample_countdown >> 1 == (gb->apu.square_channels[index].sample_length ^ 0x7FF)) {
-                        gb->apu.square_channels[index].current_sample_index--;
-                        gb->apu.square_channels[index].current_sample_index &= 7;
-                    }
-                }
-            }
-
-            uint16_t old_sample_length = gb->apu.square_channels[index].sample_length;
-            gb->apu.square_channels[index].sample_length &= 0xFF;
-            gb->apu.square_channels[index].sample_length |= (value & 7) << 8;
-            if (value & 0x80) {
-                /* Current sample index remains unchanged when restarting channels 1 or 2. It is only reset by
-                   turning the APU off. */
-                gb->apu.square_envelope_clock[index].locked = false;
-                gb->apu.square_envelope_clock[index].clock = false;
-                if (!gb->apu.is_active[index]) {
-                    gb->apu.square_channels[index].sample_countdown = (gb->apu.square_channels[index].sample_length ^ 0x7FF) * 2 + 6 - gb->apu.lf_div;
-                    if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
-                        gb->apu.square_channels[index].sample_countdown += 2;
-                    }
-                }
-                else {
-                    unsigned extra_delay = 0;
-                    if (gb->model == GB_MODEL_CGB_E /* || gb->model == GB_MODEL_CGB_D */) {
-                        if (!(value & 4) && !(((gb->apu.square_channels[index].sample_countdown - 1) / 2) & 0x400)) {
-                            gb->apu.square_channels[index].current_sample_index++;
-                            gb->apu.square_channels[index].current_sample_index &= 0x7;
-                            gb->apu.is_active[index] = true;
-                        }
-                        /* Todo: verify with the schematics what's going on in here */
-                        else if (gb->apu.square_channels[index].sample_length == 0x7FF &&
-                                 old_sample_length != 0x7FF &&
-                                 (gb->apu.square_channels[index].current_sample_index & 0x80)) {
-                            extra_delay += 2;
-                        }
-                    }
-                    /* Timing quirk: if already active, sound starts 2 (2MHz) ticks earlier.*/
-                    gb->apu.square_channels[index].sample_countdown = (gb->apu.square_channels[index].sample_length ^ 0x7FF) * 2 + 4 - gb->apu.lf_div + extra_delay;
-                    if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
-                        gb->apu.square_channels[index].sample_countdown += 2;
-                    }
-                }
-                gb->apu.square_channels[index].current_volume = gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] >> 4;
-                /* The volume changes caused by NRX4 sound start take effect instantly (i.e. the effect the previously
-                   started sound). The playback itself is not instant which is why we don't update the sample for other
-                   cases. */
-                if (gb->apu.is_active[index]) {
-                    update_square_sample(gb, index);
-                }
+        gb->apu.square_channels[index].volume_countdown = gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] & 7;
 
-                gb->apu.square_channels[index].volume_countdown = gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] & 7;
+        if ((gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] & 0xF8) != 0 && !gb->apu.is_active[index]) {
+            gb->apu.is_active[index] = true;
+            update_sample(gb, index, 0, 0);
+            /* We use the highest bit in current_sample_index to mark this sample is not actually playing yet, */
+            gb->apu.square_channels[index].current_sample_index |= 0x80;
+        }
+        if (gb->apu.square_channels[index].pulse_length == 0) {
+            gb->apu.square_channels[index].pulse_length = 0x40;
+            gb->apu.square_channels[index].length_enabled = false;
+        }
 
-                if ((gb->io_registers[index == GB_SQUARE_1 ? GB_IO_NR12 : GB_IO_NR22] & 0xF8) != 0 && !gb->apu.is_active[index]) {
-                    gb->apu.is_active[index] = true;
-                    update_sample(gb, index, 0, 0);
-                    /* We use the highest bit in current_sample_index to mark this sample is not actually playing yet, */
-                    gb->apu.square_channels[index].current_sample_index |= 0x80;
+        if (index == GB_SQUARE_1) {
+            gb->apu.shadow_sweep_sample_length = 0;
+            gb->apu.channel1_completed_addend = 0;
+            if (gb->io_registers[GB_IO_NR10] & 7) {
+                /* APU bug: if shift is nonzero, overflow check also occurs on trigger */
+                gb->apu.square_sweep_calculate_countdown = (gb->io_registers[GB_IO_NR10] & 0x7) * 2 + 5 - gb->apu.lf_div;
+                if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
+                    /* TODO: I used to think this is correct, but it caused several regressions.
+                             More research is needed to figure how calculation time is different
+                             in models prior to CGB-D */
+                    // gb->apu.square_sweep_calculate_countdown += 2;
                 }
-                if (gb->apu.square_channels[index].pulse_length == 0) {
-                    gb->apu.square_channels[index].pulse_length = 0x40;
-                    gb->apu.square_channels[index].length_enabled = false;
-                }
-
-                if (index == GB_SQUARE_1) {
-                    gb->apu.shadow_sweep_sample_length = 0;
-                    gb->apu.channel1_completed_addend = 0;
-                    if (gb->io_registers[GB_IO_NR10] & 7) {
-                        /* APU bug: if shift is nonzero, overflow check also occurs on trigger */
-                        gb->apu.square_sweep_calculate_countdown = (gb->io_registers[GB_IO_NR10] & 0x7) * 2 + 5 - gb->apu.lf_div;
-                        if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
-                            /* TODO: I used to think this is correct, but it caused several regressions.
-                                     More research is needed to figure how calculation time is different
-                                     in models prior to CGB-D */
-                            // gb->apu.square_sweep_calculate_countdown += 2;
-                        }
-                        gb->apu.enable_zombie_calculate_stepping = false;
-                        gb->apu.unshifted_sweep = false;
-                        if (!was_active) {
-                            gb->apu.square_sweep_calculate_countdown += 2;
-                        }
-                        gb->apu.sweep_length_addend = gb->apu.square_channels[GB_SQUARE_1].sample_length;
-                        gb->apu.sweep_length_addend >>= (gb->io_registers[GB_IO_NR10] & 7);
-                    }
-                    else {
-                        gb->apu.sweep_length_addend = 0;
-                    }
-                    gb->apu.channel_1_restart_hold = 2 - gb->apu.lf_div + CGB * 2;
-                    if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
-                        gb->apu.channel_1_restart_hold += 2;
-                    }
-                    gb->apu.square_sweep_countdown = ((gb->io_registers[GB_IO_NR10] >> 4) & 7) ^ 7;
+                gb->apu.enable_zombie_calculate_stepping = false;
+                gb->apu.unshifted_sweep = false;
+                if (!was_active) {
+                    gb->apu.square_sweep_calculate_countdown += 2;
                 }
+                gb->apu.sweep_length_addend = gb->apu.square_channels[GB_SQUARE_1].sample_length;
+                gb->apu.sweep_length_addend >>= (gb->io_registers[GB_IO_NR10] & 7);
             }
-
-            /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
-            if ((value & 0x40) &&
-                !gb->apu.square_channels[index].length_enabled &&
-                (gb->apu.div_divider & 1) &&
-                gb->apu.square_channels[index].pulse_length) {
-                gb->apu.square_channels[index].pulse_length--;
-                if (gb->apu.square_channels[index].pulse_length == 0) {
-                    if (value & 0x80) {
-                        gb->apu.square_channels[index].pulse_length = 0x3F;
-                    }
-                    else {
-                        gb->apu.is_active[index] = false;
-                        update_sample(gb, index, 0, 0);
-                    }
-                }
+            else {
+                gb->apu.sweep_length_addend = 0;
             }
-            gb->apu.square_channels[index].length_enabled = value & 0x40;
-            break;
+            gb->apu.channel_1_restart_hold = 2 - gb->apu.lf_div + CGB * 2;
+            if (gb->model <= GB_MODEL_CGB_C && gb->apu.lf_div) {
+                gb->apu.channel_1_restart_hold += 2;
+            }
+            gb->apu.square_sweep_countdown = ((gb->io_registers[GB_IO_NR10] >> 4) & 7) ^ 7;
         }
+    }
 
-        /* Wave channel */
-        case GB_IO_NR30:
-            gb->apu.wave_channel.enable = value & 0x80;
-            if (!gb->apu.wave_channel.enable) {
-                gb->apu.is_active[GB_WAVE] = false;
-                update_sample(gb, GB_WAVE, 0, 0);
+    /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
+    if ((value & 0x40) &&
+        !gb->apu.square_channels[index].length_enabled &&
+        (gb->apu.div_divider & 1) &&
+        gb->apu.square_channels[index].pulse_length) {
+        gb->apu.square_channels[index].pulse_length--;
+        if (gb->apu.square_channels[index].pulse_length == 0) {
+            if (value & 0x80) {
+                gb->apu.square_channels[index].pulse_length = 0x3F;
             }
-            if (gb->model==GB_MODEL_AGB_NATIVE) {
-                gb->apu.wave_channel.bank_select = value & 0x40;
-                gb->apu.wave_channel.double_length = value & 0x20;
+            else {
+                gb->apu.is_active[index] = false;
+                update_sample(gb, index, 0, 0);
             }
-            break;
-        case GB_IO_NR31:
-            gb->apu.wave_channel.pulse_length = (0x100 - value);
-            break;
-        case GB_IO_NR32:
-            gb->apu.wave_channel.shift = (uint8_t[]){4, 0, 1, 2}[(value >> 5) & 3];
-            if (gb->model==GB_MODEL_AGB_NATIVE) {
-                gb->apu.wave_channel.force_3 = value & 0x80;
+        }
+    }
+    gb->apu.square_channels[index].length_enabled = value & 0x40;
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr30(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.wave_channel.enable = value & 0x80;
+    if (!gb->apu.wave_channel.enable) {
+        gb->apu.is_active[GB_WAVE] = false;
+        update_sample(gb, GB_WAVE, 0, 0);
+    }
+    if (gb->model==GB_MODEL_AGB_NATIVE) {
+        gb->apu.wave_channel.bank_select = value & 0x40;
+        gb->apu.wave_channel.double_length = value & 0x20;
+    }
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr31(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.wave_channel.pulse_length = (0x100 - value);
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr32(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.wave_channel.shift = (uint8_t[]){4, 0, 1, 2}[(value >> 5) & 3];
+    if (gb->model==GB_MODEL_AGB_NATIVE) {
+        gb->apu.wave_channel.force_3 = value & 0x80;
+    }
+    if (gb->apu.is_active[GB_WAVE]) {
+        int8_t sample = gb->apu.wave_channel.force_3 ?
+            (gb->apu.wave_channel.current_sample * 3) >> 2 :
+            gb->apu.wave_channel.current_sample >> gb->apu.wave_channel.shift;
+        update_sample(gb, GB_WAVE, sample, 0);
+    }
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr33(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.wave_channel.sample_length &= ~0xFF;
+    gb->apu.wave_channel.sample_length |= value & 0xFF;
+    gb->io_registers[reg] = value;
+}
+
+static void write_nr34(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.wave_channel.sample_length &= 0xFF;
+    gb->apu.wave_channel.sample_length |= (value & 7) << 8;
+    if ((value & 0x80)) {
+        /* DMG bug: wave RAM gets corrupted if the channel is retriggerred 1 cycle before the APU
+                    reads from it. */
+        if (!CGB &&
+            gb->apu.is_active[GB_WAVE] &&
+            gb->apu.wave_channel.sample_countdown == 0 &&
+            gb->apu.wave_channel.enable) {
+            unsigned offset = ((gb->apu.wave_channel.current_sample_index + 1) >> 1) & 0xF;
+
+            /* This glitch varies between models and even specific instances:
+               DMG-B:     Most of them behave as emulated. A few behave differently.
+               SGB:       As far as I know, all tested instances behave as emulated.
+               MGB, SGB2: Most instances behave non-deterministically, a few behave as emulated.
+
+              Additionally, I believe DMGs, including those we behave differently than emulated,
+              are all deterministic. */
+            if (offset < 4) {
+                gb->io_registers[GB_IO_WAV_START] = gb->io_registers[GB_IO_WAV_START + offset];
+                gb->apu.wave_channel.wave_form[0] = gb->apu.wave_channel.wave_form[offset / 2];
+                gb->apu.wave_channel.wave_form[1] = gb->apu.wave_channel.wave_form[offset / 2 + 1];
             }
-            if (gb->apu.is_active[GB_WAVE]) {
-                int8_t sample = gb->apu.wave_channel.force_3 ?
-                    (gb->apu.wave_channel.current_sample * 3) >> 2 :
-                    gb->apu.wave_channel.current_sample >> gb->apu.wave_channel.shift;
-                update_sample(gb, GB_WAVE, sample, 0);
+            else {
+                memcpy(gb->io_registers + GB_IO_WAV_START,
+                       gb->io_registers + GB_IO_WAV_START + (offset & ~3),
+                       4);
+                memcpy(gb->apu.wave_channel.wave_form,
+                       gb->apu.wave_channel.wave_form + (offset & ~3) * 2,
+                       8);
             }
-            break;
-        case GB_IO_NR33:
-            gb->apu.wave_channel.sample_length &= ~0xFF;
-            gb->apu.wave_channel.sample_length |= value & 0xFF;
-            break;
-        case GB_IO_NR34:
-            gb->apu.wave_channel.sample_length &= 0xFF;
-            gb->apu.wave_channel.sample_length |= (value & 7) << 8;
-            if ((value & 0x80)) {
-                /* DMG bug: wave RAM gets corrupted if the channel is retriggerred 1 cycle before the APU
-                            reads from it. */
-                if (!CGB &&
-                    gb->apu.is_active[GB_WAVE] &&
-                    gb->apu.wave_channel.sample_countdown == 0 &&
-                    gb->apu.wave_channel.enable) {
-                    unsigned offset = ((gb->apu.wave_channel.current_sample_index + 1) >> 1) & 0xF;
-
-                    /* This glitch varies between models and even specific instances:
-                       DMG-B:     Most of them behave as emulated. A few behave differently.
-                       SGB:       As far as I know, all tested instances behave as emulated.
-                       MGB, SGB2: Most instances behave non-deterministically, a few behave as emulated.
-
-                      Additionally, I believe DMGs, including those we behave differently than emulated,
-                      are all deterministic. */
-                    if (offset < 4) {
-                        gb->io_registers[GB_IO_WAV_START] = gb->io_registers[GB_IO_WAV_START + offset];
-                        gb->apu.wave_channel.wave_form[0] = gb->apu.wave_channel.wave_form[offset / 2];
-                        gb->apu.wave_channel.wave_form[1] = gb->apu.wave_channel.wave_form[offset / 2 + 1];
-                    }
-                    else {
-                        memcpy(gb->io_registers + GB_IO_WAV_START,
-                               gb->io_registers + GB_IO_WAV_START + (offset & ~3),
-                               4);
-                        memcpy(gb->apu.wave_channel.wave_form,
-                               gb->apu.wave_channel.wave_form + (offset & ~3) * 2,
-                               8);
-                    }
-                }
-                if (!gb->apu.is_active[GB_WAVE]) {
-                    gb->apu.is_active[GB_WAVE] = true;
-                    int8_t sample = gb->apu.wave_channel.force_3 ?
-                        (gb->apu.wave_channel.current_sample * 3) >> 2 :
-                        gb->apu.wave_channel.current_sample >> gb->apu.wave_channel.shift;
-                    update_sample(gb, GB_WAVE, sample, 0);
-                }
-                gb->apu.wave_channel.sample_countdown = (gb->apu.wave_channel.sample_length ^ 0x7FF) + 3;
-                gb->apu.wave_channel.current_sample_index = 0;
-                if (gb->apu.wave_channel.pulse_length == 0) {
-                    gb->apu.wave_channel.pulse_length = 0x100;
-                    gb->apu.wave_channel.length_enabled = false;
-                }
-                /* Note that we don't change the sample just yet! This was verified on hardware. */
-            }
-
-            /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
-            if ((value & 0x40) &&
-                !gb->apu.wave_channel.length_enabled &&
-                (gb->apu.div_divider & 1) &&
-                gb->apu.wave_channel.pulse_length) {
-                gb->apu.wave_channel.pulse_length--;
-                if (gb->apu.wave_channel.pulse_length == 0) {
-                    if (value & 0x80) {
-                        gb->apu.wave_channel.pulse_length = 0xFF;
-                    }
-                    else {
-                        gb->apu.is_active[GB_WAVE] = false;
-                        update_sample(gb, GB_WAVE, 0, 0);
-                    }
-                }
+        }
+        if (!gb->apu.is_active[GB_WAVE]) {
+            gb->apu.is_active[GB_WAVE] = true;
+            int8_t sample = gb->apu.wave_channel.force_3 ?
+                (gb->apu.wave_channel.current_sample * 3) >> 2 :
+                gb->apu.wave_channel.current_sample >> gb->apu.wave_channel.shift;
+            update_sample(gb, GB_WAVE, sample, 0);
+        }
+        gb->apu.wave_channel.sample_countdown = (gb->apu.wave_channel.sample_length ^ 0x7FF) + 3;
+        gb->apu.wave_channel.current_sample_index = 0;
+        if (gb->apu.wave_channel.pulse_length == 0) {
+            gb->apu.wave_channel.pulse_length = 0x100;
+            gb->apu.wave_channel.length_enabled = false;
+        }
+        /* Note that we don't change the sample just yet! This was verified on hardware. */
+    }
+
+    /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
+    if ((value & 0x40) &&
+        !gb->apu.wave_channel.length_enabled &&
+        (gb->apu.div_divider & 1) &&
+        gb->apu.wave_channel.pulse_length) {
+        gb->apu.wave_channel.pulse_length--;
+        if (gb->apu.wave_channel.pulse_length == 0) {
+            if (value & 0x80) {
+                gb->apu.wave_channel.pulse_length = 0xFF;
             }
-            gb->apu.wave_channel.length_enabled = value & 0x40;
-            if (gb->apu.is_active[GB_WAVE] && !gb->apu.wave_channel.enable) {
+            else {
                 gb->apu.is_active[GB_WAVE] = false;
                 update_sample(gb, GB_WAVE, 0, 0);
             }
+        }
+    }
+    gb->apu.wave_channel.length_enabled = value & 0x40;
+    if (gb->apu.is_active[GB_WAVE] && !gb->apu.wave_channel.enable) {
+        gb->apu.is_active[GB_WAVE] = false;
+        update_sample(gb, GB_WAVE, 0, 0);
+    }
+    gb->io_registers[reg] = value;
+}
 
-            break;
+static void write_nr41(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.noise_channel.pulse_length = (0x40 - (value & 0x3f));
+    gb->io_registers[reg] = value;
+}
 
-        /* Noise Channel */
+static void write_nr42(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    if ((value & 0xF8) == 0) {
+        /* This disables the DAC */
+        gb->io_registers[reg] = value;
+        gb->apu.is_active[GB_NOISE] = false;
+        update_sample(gb, GB_NOISE, 0, 0);
+    }
+    else if (gb->apu.is_active[GB_NOISE]) {
+        nrx2_glitch(gb, &gb->apu.noise_channel.current_volume,
+                    value, gb->io_registers[reg], &gb->apu.noise_channel.volume_countdown,
+                    &gb->apu.noise_envelope_clock);
+        update_sample(gb, GB_NOISE,
+                      gb->apu.current_lfsr_sample ?
+                      gb->apu.noise_channel.current_volume : 0,
+                      0);
+    }
+    gb->io_registers[reg] = value;
+}
 
-        case GB_IO_NR41: {
-            gb->apu.noise_channel.pulse_length = (0x40 - (value & 0x3f));
-            break;
+static void write_nr43(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu.noise_channel.narrow = value & 8;
+    uint16_t effective_counter = effective_channel4_counter(gb);
+    bool old_bit = (effective_counter >> (gb->io_registers[GB_IO_NR43] >> 4)) & 1;
+    gb->io_registers[GB_IO_NR43] = value;
+    bool new_bit = (effective_counter >> (gb->io_registers[GB_IO_NR43] >> 4)) & 1;
+    if (gb->apu.channel_4_countdown_reloaded) {
+        unsigned divisor = (gb->io_registers[GB_IO_NR43] & 0x07) << 2;
+        if (!divisor) divisor = 2;
+        if (gb->model > GB_MODEL_CGB_C) {
+            gb->apu.noise_channel.counter_countdown =
+            divisor + (divisor == 2? 0 : (uint8_t[]){2, 1, 0, 3}[(gb->apu.noise_channel.alignment) & 3]);
         }
-
-        case GB_IO_NR42: {
-            if ((value & 0xF8) == 0) {
-                /* This disables the DAC */
-                gb->io_registers[reg] = value;
-                gb->apu.is_active[GB_NOISE] = false;
-                update_sample(gb, GB_NOISE, 0, 0);
-            }
-            else if (gb->apu.is_active[GB_NOISE]) {
-                nrx2_glitch(gb, &gb->apu.noise_channel.current_volume,
-                            value, gb->io_registers[reg], &gb->apu.noise_channel.volume_countdown,
-                            &gb->apu.noise_envelope_clock);
-                update_sample(gb, GB_NOISE,
-                              gb->apu.current_lfsr_sample ?
-                              gb->apu.noise_channel.current_volume : 0,
-                              0);
-            }
-            break;
+        else {
+            gb->apu.noise_channel.counter_countdown =
+            divisor + (divisor == 2? 0 : (uint8_t[]){2, 1, 4, 3}[(gb->apu.noise_channel.alignment) & 3]);
+        }
+        gb->apu.channel_4_delta = 0;
+    }
+    /* Step LFSR */
+    if (new_bit && (!old_bit || gb->model <= GB_MODEL_CGB_C)) {
+        if (gb->model <= GB_MODEL_CGB_C) {
+            bool previous_narrow = gb->apu.noise_channel.narrow;
+            gb->apu.noise_channel.narrow = true;
+            step_lfsr(gb, 0);
+            gb->apu.noise_channel.narrow = previous_narrow;
+        }
+        else {
+            step_lfsr(gb, 0);
         }
+    }
+    gb->io_registers[reg] = value;
+}
 
-        case GB_IO_NR43: {
-            gb->apu.noise_channel.narrow = value & 8;
-            uint16_t effective_counter = effective_channel4_counter(gb);
-            bool old_bit = (effective_counter >> (gb->io_registers[GB_IO_NR43] >> 4)) & 1;
-            gb->io_registers[GB_IO_NR43] = value;
-            bool new_bit = (effective_counter >> (gb->io_registers[GB_IO_NR43] >> 4)) & 1;
-            if (gb->apu.channel_4_countdown_reloaded) {
-                unsigned divisor = (gb->io_registers[GB_IO_NR43] & 0x07) << 2;
-                if (!divisor) divisor = 2;
-                if (gb->model > GB_MODEL_CGB_C) {
-                    gb->apu.noise_channel.counter_countdown =
-                    divisor + (divisor == 2? 0 : (uint8_t[]){2, 1, 0, 3}[(gb->apu.noise_channel.alignment) & 3]);
+static void write_nr44(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    if (value & 0x80) {
+        gb->apu.noise_envelope_clock.locked = false;
+        gb->apu.noise_envelope_clock.clock = false;
+        if (!CGB && (gb->apu.noise_channel.alignment & 3) != 0) {
+            gb->apu.channel_4_dmg_delayed_start = 6;
+        }
+        else {
+            unsigned divisor = (gb->io_registers[GB_IO_NR43] & 0x07) << 2;
+            if (!divisor) divisor = 2;
+            gb->apu.channel_4_delta = 0;
+            gb->apu.noise_channel.counter_countdown = divisor + 4;
+            if (divisor == 2) {
+                if (gb->model <= GB_MODEL_CGB_C) {
+                    gb->apu.noise_channel.counter_countdown += gb->apu.lf_div;
+                    if (!gb->cgb_double_speed) {
+                        gb->apu.noise_channel.counter_countdown -= 1;
+                    }
                 }
                 else {
-                    gb->apu.noise_channel.counter_countdown =
-                    divisor + (divisor == 2? 0 : (uint8_t[]){2, 1, 4, 3}[(gb->apu.noise_channel.alignment) & 3]);
+                    gb->apu.noise_channel.counter_countdown += 1 - gb->apu.lf_div;
                 }
-                gb->apu.channel_4_delta = 0;
             }
-            /* Step LFSR */
-            if (new_bit && (!old_bit || gb->model <= GB_MODEL_CGB_C)) {
+            else {
                 if (gb->model <= GB_MODEL_CGB_C) {
-                    bool previous_narrow = gb->apu.noise_channel.narrow;
-                    gb->apu.noise_channel.narrow = true;
-                    step_lfsr(gb, 0);
-                    gb->apu.noise_channel.narrow = previous_narrow;
+                    gb->apu.noise_channel.counter_countdown += (uint8_t[]){2, 1, 4, 3}[gb->apu.noise_channel.alignment & 3];
                 }
                 else {
-                    step_lfsr(gb, 0);
+                    gb->apu.noise_channel.counter_countdown += (uint8_t[]){2, 1, 0, 3}[gb->apu.noise_channel.alignment & 3];
                 }
-            }
-            break;
-        }
-
-        case GB_IO_NR44: {
-            if (value & 0x80) {
-                gb->apu.noise_envelope_clock.locked = false;
-                gb->apu.noise_envelope_clock.clock = false;
-                if (!CGB && (gb->apu.noise_channel.alignment & 3) != 0) {
-                    gb->apu.channel_4_dmg_delayed_start = 6;
-                }
-                else {
-                    unsigned divisor = (gb->io_registers[GB_IO_NR43] & 0x07) << 2;
-                    if (!divisor) divisor = 2;
-                    gb->apu.channel_4_delta = 0;
-                    gb->apu.noise_channel.counter_countdown = divisor + 4;
-                    if (divisor == 2) {
-                        if (gb->model <= GB_MODEL_CGB_C) {
-                            gb->apu.noise_channel.counter_countdown += gb->apu.lf_div;
-                            if (!gb->cgb_double_speed) {
-                                gb->apu.noise_channel.counter_countdown -= 1;
-                            }
-                        }
-                        else {
-                            gb->apu.noise_channel.counter_countdown += 1 - gb->apu.lf_div;
-                        }
+                if (((gb->apu.noise_channel.alignment + 1) & 3) < 2) {
+                    if ((gb->io_registers[GB_IO_NR43] & 0x07) == 1) {
+                        gb->apu.noise_channel.counter_countdown -= 2;
+                        gb->apu.channel_4_delta = 2;
                     }
                     else {
-                        if (gb->model <= GB_MODEL_CGB_C) {
-                            gb->apu.noise_channel.counter_countdown += (uint8_t[]){2, 1, 4, 3}[gb->apu.noise_channel.alignment & 3];
-                        }
-                        else {
-                            gb->apu.noise_channel.counter_countdown += (uint8_t[]){2, 1, 0, 3}[gb->apu.noise_channel.alignment & 3];
-                        }
-                        if (((gb->apu.noise_channel.alignment + 1) & 3) < 2) {
-                            if ((gb->io_registers[GB_IO_NR43] & 0x07) == 1) {
-                                gb->apu.noise_channel.counter_countdown -= 2;
-                                gb->apu.channel_4_delta = 2;
-                            }
-                            else {
-                                gb->apu.noise_channel.counter_countdown -= 4;
-                            }
-                        }
-                    }
-                    
-                    /* TODO: These are quite weird. Verify further */
-                    if (gb->model <= GB_MODEL_CGB_C) {
-                        if (gb->cgb_double_speed) {
-                            if (!(gb->io_registers[GB_IO_NR43] & 0xF0) && (gb->io_registers[GB_IO_NR43] & 0x07)) {
-                                 gb->apu.noise_channel.counter_countdown -= 1;
-                            }
-                            else if ((gb->io_registers[GB_IO_NR43] & 0xF0) && !(gb->io_registers[GB_IO_NR43] & 0x07)) {
-                                gb->apu.noise_channel.counter_countdown += 1;
-                            }
-                        }
-                        else {
-                            gb->apu.noise_channel.counter_countdown -= 2;
-                        }
-                    }
-   
-                    gb->apu.noise_channel.current_volume = gb->io_registers[GB_IO_NR42] >> 4;
-
-                    /* The volume changes caused by NRX4 sound start take effect instantly (i.e. the effect the previously
-                     started sound). The playback itself is not instant which is why we don't update the sample for other
-                     cases. */
-                    if (gb->apu.is_active[GB_NOISE]) {
-                        update_sample(gb, GB_NOISE,
-                                      gb->apu.current_lfsr_sample ?
-                                      gb->apu.noise_channel.current_volume : 0,
-                                      0);
-                    }
-                    gb->apu.noise_channel.lfsr = 0;
-                    gb->apu.current_lfsr_sample = false;
-                    gb->apu.noise_channel.volume_countdown = gb->io_registers[GB_IO_NR42] & 7;
-
-                    if (!gb->apu.is_active[GB_NOISE] && (gb->io_registers[GB_IO_NR42] & 0xF8) != 0) {
-                        gb->apu.is_active[GB_NOISE] = true;
-                        update_sample(gb, GB_NOISE, 0, 0);
-                    }
-
-                    if (gb->apu.noise_channel.pulse_length == 0) {
-                        gb->apu.noise_channel.pulse_length = 0x40;
-                        gb->apu.noise_channel.length_enabled = false;
+                        gb->apu.noise_channel.counter_countdown -= 4;
                     }
                 }
             }
 
-            /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
-            if ((value & 0x40) &&
-                !gb->apu.noise_channel.length_enabled &&
-                (gb->apu.div_divider & 1) &&
-                gb->apu.noise_channel.pulse_length) {
-                gb->apu.noise_channel.pulse_length--;
-                if (gb->apu.noise_channel.pulse_length == 0) {
-                    if (value & 0x80) {
-                        gb->apu.noise_channel.pulse_length = 0x3F;
+            /* TODO: These are quite weird. Verify further */
+            if (gb->model <= GB_MODEL_CGB_C) {
+                if (gb->cgb_double_speed) {
+                    if (!(gb->io_registers[GB_IO_NR43] & 0xF0) && (gb->io_registers[GB_IO_NR43] & 0x07)) {
+                         gb->apu.noise_channel.counter_countdown -= 1;
                     }
-                    else {
-                        gb->apu.is_active[GB_NOISE] = false;
-                        update_sample(gb, GB_NOISE, 0, 0);
+                    else if ((gb->io_registers[GB_IO_NR43] & 0xF0) && !(gb->io_registers[GB_IO_NR43] & 0x07)) {
+                        gb->apu.noise_channel.counter_countdown += 1;
                     }
                 }
+                else {
+                    gb->apu.noise_channel.counter_countdown -= 2;
+                }
+            }
+
+            gb->apu.noise_channel.current_volume = gb->io_registers[GB_IO_NR42] >> 4;
+
+            /* The volume changes caused by NRX4 sound start take effect instantly (i.e. the effect the previously
+             started sound). The playback itself is not instant which is why we don't update the sample for other
+             cases. */
+            if (gb->apu.is_active[GB_NOISE]) {
+                update_sample(gb, GB_NOISE,
+                              gb->apu.current_lfsr_sample ?
+                              gb->apu.noise_channel.current_volume : 0,
+                              0);
+            }
+            gb->apu.noise_channel.lfsr = 0;
+            gb->apu.current_lfsr_sample = false;
+            gb->apu.noise_channel.volume_countdown = gb->io_registers[GB_IO_NR42] & 7;
+
+            if (!gb->apu.is_active[GB_NOISE] && (gb->io_registers[GB_IO_NR42] & 0xF8) != 0) {
+                gb->apu.is_active[GB_NOISE] = true;
+                update_sample(gb, GB_NOISE, 0, 0);
+            }
+
+            if (gb->apu.noise_channel.pulse_length == 0) {
+                gb->apu.noise_channel.pulse_length = 0x40;
+                gb->apu.noise_channel.length_enabled = false;
             }
-            gb->apu.noise_channel.length_enabled = value & 0x40;
-            break;
         }
+    }
 
-        default:
-            if (reg >= GB_IO_WAV_START && reg <= GB_IO_WAV_END) {
-                uint8_t base = 0;
-                if (gb->model == GB_MODEL_AGB_NATIVE &&
-                    (!gb->apu.global_enable || !gb->apu.wave_channel.bank_select)) {
-                    base = 32;
-                }
-                gb->apu.wave_channel.wave_form[base + (reg - GB_IO_WAV_START) * 2]     = value >> 4;
-                gb->apu.wave_channel.wave_form[base + (reg - GB_IO_WAV_START) * 2 + 1] = value & 0xF;
+    /* APU glitch - if length is enabled while the DIV-divider's LSB is 1, tick the length once. */
+    if ((value & 0x40) &&
+        !gb->apu.noise_channel.length_enabled &&
+        (gb->apu.div_divider & 1) &&
+        gb->apu.noise_channel.pulse_length) {
+        gb->apu.noise_channel.pulse_length--;
+        if (gb->apu.noise_channel.pulse_length == 0) {
+            if (value & 0x80) {
+                gb->apu.noise_channel.pulse_length = 0x3F;
             }
+            else {
+                gb->apu.is_active[GB_NOISE] = false;
+                update_sample(gb, GB_NOISE, 0, 0);
+            }
+        }
     }
+    gb->apu.noise_channel.length_enabled = value & 0x40;
     gb->io_registers[reg] = value;
 }
 
+static void store_wave(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    uint8_t base = 0;
+    if (gb->model == GB_MODEL_AGB_NATIVE &&
+        (!gb->apu.global_enable || !gb->apu.wave_channel.bank_select)) {
+        base = 32;
+    }
+    gb->apu.wave_channel.wave_form[base + (reg - GB_IO_WAV_START) * 2]     = value >> 4;
+    gb->apu.wave_channel.wave_form[base + (reg - GB_IO_WAV_START) * 2 + 1] = value & 0xF;
+    gb->io_registers[reg] = value;
+}
+
+/* While channel 3 plays, wave RAM accesses go to the byte it's reading instead, and on the DMG
+   only if it's reading it at that exact moment */
+static void write_wave_dmg(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    if (gb->apu.is_active[GB_WAVE]) {
+        if (!gb->apu.wave_channel.wave_form_just_read) return;
+        reg = GB_IO_WAV_START + gb->apu.wave_channel.current_sample_index / 2;
+    }
+    store_wave(gb, reg, value);
+}
+
+static void write_wave_cgb(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    if (gb->apu.is_active[GB_WAVE]) {
+        reg = GB_IO_WAV_START + gb->apu.wave_channel.current_sample_index / 2;
+    }
+    store_wave(gb, reg, value);
+}
+
+void GB_apu_write(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
+{
+    gb->apu_output.register_handlers->write[gb->apu.global_enable][reg - GB_IO_NR10](gb, reg, value);
+}
+
+void GB_apu_load_wave(GB_gameboy_t *gb, const uint8_t *wave_ram, const int8_t *wave_form)
+{
+    /* Turning the DAC off stops the channel, so every wave RAM write goes to the byte it addresses
+       and the whole of wave RAM can be replaced at once. */
+    GB_apu_write(gb, GB_IO_NR30, 0);
+    uint8_t base = 0;
+    if (gb->model == GB_MODEL_AGB_NATIVE &&
+        (!gb->apu.global_enable || !gb->apu.wave_channel.bank_select)) {
+        base = 32;
+    }
+    memcpy(gb->io_registers + GB_IO_WAV_START, wave_ram, 16);
+    memcpy(gb->apu.wave_channel.wave_form + base, wave_form, 32);
+    GB_apu_write(gb, GB_IO_NR30, 0x80);
+}
+
+static atomic_int register_handlers_state;
+static struct {
+    struct GB_apu_register_handlers_s family[3];
+} register_handlers;
+
+static void build_register_handlers(void)
+{
+    for (apu_family_t family = APU_FAMILY_DMG; family <= APU_FAMILY_AGB; family++) {
+        struct GB_apu_register_handlers_s *handlers = &register_handlers.family[family];
+        apu_write_handler_t *write = handlers->write[true];
+        for (unsigned reg = GB_IO_NR10; reg <= GB_IO_WAV_END; reg++) {
+            write[reg - GB_IO_NR10] = write_unused;
+            handlers->read[reg - GB_IO_NR10] = read_masked;
+        }
+        write[GB_IO_NR10 - GB_IO_NR10] = write_nr10;
+        write[GB_IO_NR11 - GB_IO_NR10] = write_nrx1_square;
+        write[GB_IO_NR12 - GB_IO_NR10] = write_nrx2_square;
+        write[GB_IO_NR13 - GB_IO_NR10] = write_nrx3_square;
+        write[GB_IO_NR14 - GB_IO_NR10] = write_nrx4_square;
+        write[GB_IO_NR21 - GB_IO_NR10] = write_nrx1_square;
+        write[GB_IO_NR22 - GB_IO_NR10] = write_nrx2_square;
+        write[GB_IO_NR23 - GB_IO_NR10] = write_nrx3_square;
+        write[GB_IO_NR24 - GB_IO_NR10] = write_nrx4_square;
+        write[GB_IO_NR30 - GB_IO_NR10] = write_nr30;
+        write[GB_IO_NR31 - GB_IO_NR10] = write_nr31;
+        write[GB_IO_NR32 - GB_IO_NR10] = write_nr32;
+        write[GB_IO_NR33 - GB_IO_NR10] = write_nr33;
+        write[GB_IO_NR34 - GB_IO_NR10] = write_nr34;
+        write[GB_IO_NR41 - GB_IO_NR10] = write_nr41;
+        write[GB_IO_NR42 - GB_IO_NR10] = write_nr42;
+        write[GB_IO_NR43 - GB_IO_NR10] = write_nr43;
+        write[GB_IO_NR44 - GB_IO_NR10] = write_nr44;
+        write[GB_IO_NR50 - GB_IO_NR10] = write_nr50_nr51;
+        write[GB_IO_NR51 - GB_IO_NR10] = write_nr50_nr51;
+        write[GB_IO_NR52 - GB_IO_NR10] = write_nr52;
+        handlers->read[GB_IO_NR52 - GB_IO_NR10] = read_nr52;
+        for (unsigned reg = GB_IO_WAV_START; reg <= GB_IO_WAV_END; reg++) {
+            write[reg - GB_IO_NR10] = family == APU_FAMILY_DMG? write_wave_dmg : write_wave_cgb;
+            handlers->read[reg - GB_IO_NR10] = family == APU_FAMILY_DMG? read_wave_dmg : read_wave_cgb;
+        }
+        
+        /* While the APU is off only NR52 and wave RAM can be written, as well as the length
+           counters on the DMG */
+        for (unsigned reg = GB_IO_NR10; reg <= GB_IO_WAV_END; reg++) {
+            handlers->write[false][reg - GB_IO_NR10] = reg < GB_IO_WAV_START? write_ignored : write[reg - GB_IO_NR10];
+        }
+        handlers->write[false][GB_IO_NR52 - GB_IO_NR10] = write_nr52;
+        if (family == APU_FAMILY_DMG) {
+            handlers->write[false][GB_IO_NR11 - GB_IO_NR10] = write_nrx1_square;
+            handlers->write[false][GB_IO_NR21 - GB_IO_NR10] = write_nrx1_square;
+            handlers->write[false][GB_IO_NR31 - GB_IO_NR10] = write_nr31;
+            handlers->write[false][GB_IO_NR41 - GB_IO_NR10] = write_nr41;
+        }
+    }
+}
+
+static void init_register_handlers(void)
+{
+    build_tables_once(&register_handlers_state, build_register_handlers);
+}
+
+void GB_apu_update_model(GB_gameboy_t *gb)
+{
+    init_register_handlers();
+    apu_family_t family = model_family(gb);
+    gb->apu_output.register_handlers = &register_handlers.family[family];
+    switch (family) {
+        case APU_FAMILY_DMG:
+            gb->apu_output.run = apu_run_dmg;
+            break;
+        case APU_FAMILY_CGB:
+            gb->apu_output.run = apu_run_cgb;
+            break;
+        case APU_FAMILY_AGB:
+            gb->apu_output.run = apu_run_agb;
+            break;
+    }
+}
+
+/* log(0.999958), the highpass filter's decay per 4 MHz cycle */
+#define HIGHPASS_LOG_RATE -4.200088202469678e-05
+
+#if DAC_ATTACK_SPEED != DAC_DECAY_SPEED
+#error The DAC curve assumes fading in and out take the same time
+#endif
+
+/* Precomputes the DAC fade curve (smoothstep) for the current sample rate, in whole samples */
+static void update_dac_curve(GB_gameboy_t *gb)
+{
+    if (!gb->apu_output.sample_rate) return;
+    unsigned old_steps = gb->apu_output.dac_steps;
+    uint64_t steps = (gb->apu_output.sample_rate + DAC_ATTACK_SPEED - 1) / DAC_ATTACK_SPEED;
+    if (steps < 1) steps = 1;
+    if (steps > GB_DAC_CURVE_SIZE - 1) steps = GB_DAC_CURVE_SIZE - 1;
+    for (uint64_t i = 0; i <= steps; i++) {
+        /* CH_STEP * (3x^2 - 2x^3) with x = i / steps, exact up to the final division */
+        uint64_t numerator = (3 * i * i * steps - 2 * i * i * i) * CH_STEP;
+        gb->apu_output.dac_curve[i] = (double)numerator / (steps * steps * steps);
+    }
+    gb->apu_output.dac_steps = steps;
+    unrolled for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
+        if (gb->apu_output.dac_position[i] >= old_steps && old_steps) {
+            gb->apu_output.dac_position[i] = steps;
+        }
+        else if (gb->apu_output.dac_position[i] > steps) {
+            gb->apu_output.dac_position[i] = steps;
+        }
+    }
+}
+
 void GB_set_sample_rate(GB_gameboy_t *gb, unsigned sample_rate)
 {
 
     gb->apu_output.sample_rate = sample_rate;
     if (sample_rate) {
-        gb->apu_output.highpass_rate = pow(0.999958,  GB_CLOCK_RATE / (double)sample_rate);
+        gb->apu_output.highpass_rate = reproducible_exp(HIGHPASS_LOG_RATE * (GB_CLOCK_RATE / (double)sample_rate));
     }
     gb->apu_output.rate_set_in_clocks = false;
     GB_apu_update_cycles_per_sample(gb);
@@ -1458,9 +2210,14 @@ void GB_set_sample_rate_by_clocks(GB_gameboy_t *gb, double cycles_per_sample)
         return;
     }
     gb->apu_output.cycles_per_sample = cycles_per_sample;
+    /* Arbitrary lengths are kept in 1/0x10000 of a cycle */
+    gb->apu_output.cycles_per_sample_num = (uint32_t)(cycles_per_sample * 0x10000 + 0.5);
+    gb->apu_output.cycles_per_sample_den = 0x10000;
     gb->apu_output.sample_rate = GB_CLOCK_RATE / cycles_per_sample * 2;
-    gb->apu_output.highpass_rate = pow(0.999958, cycles_per_sample);
+    gb->apu_output.highpass_rate = reproducible_exp(HIGHPASS_LOG_RATE * cycles_per_sample);
+    gb->apu_output.blip_phase_scale = GB_BLIP_PHASES * 4 * 65536.0 / cycles_per_sample + 0.5;
     gb->apu_output.rate_set_in_clocks = true;
+    update_dac_curve(gb);
 }
 
 void GB_apu_set_sample_callback(GB_gameboy_t *gb, GB_sample_callback_t callback)
@@ -1473,11 +2230,83 @@ void GB_set_highpass_filter_mode(GB_gameboy_t *gb, GB_highpass_mode_t mode)
     gb->apu_output.highpass_mode = mode;
 }
 
+void GB_set_band_limited_output(GB_gameboy_t *gb, bool enabled)
+{
+    if (gb->apu_output.band_limited == enabled) return;
+    init_blip_tables();
+    gb->apu_output.band_limited = enabled;
+    /* Start from silence, the next rendered sample steps up to the current output */
+    memset(gb->apu_output.blip_buffer, 0, sizeof(gb->apu_output.blip_buffer));
+    memset(gb->apu_output.blip_integrator, 0, sizeof(gb->apu_output.blip_integrator));
+    memset(gb->apu_output.blip_level, 0, sizeof(gb->apu_output.blip_level));
+    gb->apu_output.blip_position = 0;
+    gb->apu_output.blip_phase_base = 0;
+    if (!enabled) {
+        memset(gb->apu_output.summed_samples, 0, sizeof(gb->apu_output.summed_samples));
+        memset(gb->apu_output.last_update, 0, sizeof(gb->apu_output.last_update));
+    }
+}
+
+/* Whether a channel's PCM value is 0 and will stay 0 until a register is written */
+static bool channel_is_quiet(GB_gameboy_t *gb, unsigned index)
+{
+    if (!gb->apu.is_active[index]) return true;
+    
+    switch (index) {
+        case GB_SQUARE_1:
+        case GB_SQUARE_2: {
+            uint8_t nrx2 = gb->io_registers[index == GB_SQUARE_1? GB_IO_NR12 : GB_IO_NR22];
+            return gb->apu.square_channels[index].current_volume == 0 && !((nrx2 & 8) && (nrx2 & 7));
+        }
+        case GB_WAVE:
+            return gb->apu.wave_channel.shift == 4;
+        case GB_NOISE: {
+            uint8_t nr42 = gb->io_registers[GB_IO_NR42];
+            return gb->apu.noise_channel.current_volume == 0 && !((nr42 & 8) && (nr42 & 7));
+        }
+    }
+    return false;
+}
+
+/* True if the output is silent and will stay silent until a register is written, so the APU
+   doesn't have to be run at all until then. */
+bool GB_apu_is_idle(GB_gameboy_t *gb)
+{
+    if (gb->apu_output.block_length) return false;
+    /* Anything under one LSB used to round down to silence */
+    if (fabs(gb->apu_output.last_output.left) >= 1 || fabs(gb->apu_output.last_output.right) >= 1) return false;
+    if (gb->apu_output.interference_volume) return false;
+    
+    unrolled for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
+        if (!channel_is_quiet(gb, i)) return false;
+        if (gb->model < GB_MODEL_AGB &&
+            gb->apu_output.dac_position[i] != (GB_apu_is_DAC_enabled(gb, i)? gb->apu_output.dac_steps : 0)) {
+            return false; /* Still fading in or out */
+        }
+    }
+    
+    if (gb->apu_output.band_limited) {
+        /* Steps that haven't been fully integrated yet */
+        for (unsigned i = 0; i < GB_BLIP_BUFFER_SIZE; i++) {
+            unrolled for (unsigned j = 0; j < GB_N_CHANNELS; j++) {
+                if (gb->apu_output.blip_buffer[i][j][0] || gb->apu_output.blip_buffer[i][j][1]) return false;
+            }
+        }
+    }
+    
+    /* With constant input, the highpass filter's output only decays from here */
+    return true;
+}
+
 void GB_apu_update_cycles_per_sample(GB_gameboy_t *gb)
 {
     if (gb->apu_output.rate_set_in_clocks) return;
     if (gb->apu_output.sample_rate) {
         gb->apu_output.cycles_per_sample = 2 * GB_CLOCK_RATE / (double)gb->apu_output.sample_rate; /* 2 * because we use 8MHz units */
+        gb->apu_output.cycles_per_sample_num = 2 * GB_CLOCK_RATE;
+        gb->apu_output.cycles_per_sample_den = gb->apu_output.sample_rate;
+        gb->apu_output.blip_phase_scale = GB_BLIP_PHASES * 4 * 65536.0 / gb->apu_output.cycles_per_sample + 0.5;
+        update_dac_curve(gb);
     }
 }
 
@@ -52,10 +52,25 @@ typedef struct
 
 typedef void (*GB_sample_callback_t)(GB_gameboy_t *gb, GB_sample_t *sample);
 
+/* Band-limited output: every change in a channel's output adds a band-limited step,
+   spread over GB_BLIP_KERNEL_SIZE output samples, into a ring of deltas. Each
+   rendered sample integrates one slot of that ring. */
+#define GB_BLIP_PHASES 256
+#define GB_BLIP_KERNEL_SIZE 32
+#define GB_BLIP_BUFFER_SIZE 64 // Power of two, larger than the kernel plus one sample
+#define GB_BLIP_UNIT_BITS 15
+
+/* Rendered samples are first captured as one amplitude stream per channel, then mixed,
+   filtered and converted to float a whole block at a time */
+#define GB_APU_BLOCK_SIZE 256
+
+/* DAC fades are precomputed per sample rate, this is enough for up to 1.26 MHz */
+#define GB_DAC_CURVE_SIZE 64
+
 typedef struct
 {
     bool global_enable;
-    uint8_t apu_cycles;
+    unsigned apu_cycles; // In 8 MHz units, wide enough to span any number of cycles between two GB_apu_run calls
 
     uint8_t samples[GB_N_CHANNELS];
     bool is_active[GB_N_CHANNELS];
@@ -148,23 +163,47 @@ typedef enum {
 typedef struct {
     unsigned sample_rate;
 
-    double sample_cycles; // In 8 MHz units
-    double cycles_per_sample;
+    /* Each output sample lasts exactly cycles_per_sample_num / cycles_per_sample_den
+       8 MHz cycles. sample_cycles counts 8 MHz cycles multiplied by the denominator,
+       so the fractional part of a sample is carried over instead of being rounded
+       away, and the output never drifts against the host clock. */
+    uint64_t sample_cycles;
+    uint32_t cycles_per_sample_num;
+    uint32_t cycles_per_sample_den;
+    double cycles_per_sample; // In 8 MHz units
 
     // Samples are NOT normalized to MAX_CH_AMP * 4 at this stage!
     unsigned cycles_since_render;
     unsigned last_update[GB_N_CHANNELS];
     GB_sample_t current_sample[GB_N_CHANNELS];
     GB_sample_t summed_samples[GB_N_CHANNELS];
-    double dac_discharge[GB_N_CHANNELS];
+    uint8_t dac_position[GB_N_CHANNELS]; // How far each DAC has faded in, out of dac_steps
+    uint8_t dac_steps; // Samples it takes a DAC to fade in or out completely
+    float dac_curve[GB_DAC_CURVE_SIZE]; // Channel volume at each dac_position
 
     GB_highpass_mode_t highpass_mode;
     double highpass_rate;
     GB_double_sample_t highpass_diff;
     
     GB_sample_callback_t sample_callback;
+    void (*run)(GB_gameboy_t *gb); // GB_apu_run compiled for the model's family, see GB_apu_update_model
+    const struct GB_apu_register_handlers_s *register_handlers; // Register reads and writes for the model's family
 
-    GB_sample_t final_sample;
+    GB_double_sample_t last_output; // The last filtered sample, before conversion to float
+    
+    unsigned block_length; // Captured samples that weren't mixed yet
+    float block_amplitude[GB_N_CHANNELS][2][GB_APU_BLOCK_SIZE]; // Before DAC fades and mixing
+    uint8_t block_dac_enabled[GB_APU_BLOCK_SIZE]; // One bit per channel
+    float block_dc_offset[2][GB_APU_BLOCK_SIZE]; // Only for GB_HIGHPASS_REMOVE_DC_OFFSET
+    float block_interference[GB_APU_BLOCK_SIZE]; // Only if interference_volume is set
+    
+    bool band_limited;
+    uint32_t blip_phase_scale; // Kernel phases per 2 MHz cycle, 16.16 fixed point
+    uint32_t blip_phase_base; // How late the last sample was rendered, in 16.16 kernel phases
+    unsigned blip_position;
+    int32_t blip_buffer[GB_BLIP_BUFFER_SIZE][GB_N_CHANNELS][2];
+    int32_t blip_integrator[GB_N_CHANNELS][2];
+    int32_t blip_level[GB_N_CHANNELS][2]; // What the ring currently adds up to for each channel
     
     bool rate_set_in_clocks;
     double interference_volume;
@@ -174,16 +213,21 @@ typedef struct {
 void GB_set_sample_rate(GB_gameboy_t *gb, unsigned sample_rate);
 void GB_set_sample_rate_by_clocks(GB_gameboy_t *gb, double cycles_per_sample); /* Cycles are in 8MHz units */
 void GB_set_highpass_filter_mode(GB_gameboy_t *gb, GB_highpass_mode_t mode);
+void GB_set_band_limited_output(GB_gameboy_t *gb, bool enabled); /* Band-limited steps instead of a box filter, adds GB_BLIP_KERNEL_SIZE / 2 samples of latency */
 void GB_set_interference_volume(GB_gameboy_t *gb, double volume);
 void GB_apu_set_sample_callback(GB_gameboy_t *gb, GB_sample_callback_t callback);
 
 bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index);
+bool GB_apu_is_idle(GB_gameboy_t *gb);
+void GB_apu_flush_block(GB_gameboy_t *gb, float *left, float *right); /* Writes every captured sample, normalized to -1..1. left and right may be NULL */
 void GB_apu_write(GB_gameboy_t *gb, uint8_t reg, uint8_t value);
+void GB_apu_load_wave(GB_gameboy_t *gb, const uint8_t *wave_ram, const int8_t *wave_form); /* Same as turning channel 3's DAC off, writing all 16 bytes of wave RAM and turning the DAC back on. wave_form is wave_ram split into 32 samples */
 uint8_t GB_apu_read(GB_gameboy_t *gb, uint8_t reg);
 void GB_apu_div_event(GB_gameboy_t *gb);
 void GB_apu_div_secondary_event(GB_gameboy_t *gb);
 void GB_apu_init(GB_gameboy_t *gb);
 void GB_apu_run(GB_gameboy_t *gb);
+void GB_apu_update_model(GB_gameboy_t *gb); /* Must be called after changing gb->model */
 void GB_apu_update_cycles_per_sample(GB_gameboy_t *gb);
 void GB_borrow_sgb_border(GB_gameboy_t *gb);
 
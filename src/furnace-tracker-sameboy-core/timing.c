@@ -59,7 +59,7 @@ static void GB_set_internal_div_counter(GB_gameboy_t *gb, uint16_t value)
     gb->div_counter = value;
 }
 
-static void GB_timers_run(GB_gameboy_t *gb, uint8_t cycles)
+static void GB_timers_run(GB_gameboy_t *gb, unsigned cycles)
 {
     if (gb->stopped) {
         if (CGB) {
@@ -78,6 +78,17 @@ static void GB_timers_run(GB_gameboy_t *gb, uint8_t cycles)
 main:
     GB_SLEEP(gb, div, 1, 3);
     while (true) {
+        /* Skip ahead to the step just before the next event. With TIMA disabled and
+           no reload pending, the only thing that can happen in between is the DIV bit
+           the APU listens to flipping, so the steps up to it only move counters. */
+        if (gb->div_cycles > 4 && !(gb->io_registers[GB_IO_TAC] & 4) && gb->tima_reload_state == GB_TIMA_RUNNING) {
+            uint16_t apu_bit = gb->cgb_double_speed? 0x2000 : 0x1000;
+            unsigned steps = (apu_bit - (gb->div_counter & (apu_bit - 1))) / 4 - 1;
+            steps = MIN(steps, (unsigned)(gb->div_cycles - 1) / 4);
+            gb->div_counter = (gb->div_counter + steps * 4) & (INTERNAL_DIV_CYCLES - 1);
+            gb->apu.apu_cycles += (steps * 4) << !gb->cgb_double_speed;
+            gb->div_cycles -= steps * 4;
+        }
         advance_tima_state_machine(gb);
         GB_set_internal_div_counter(gb, gb->div_counter + 4);
         gb->apu.apu_cycles += 4 << !gb->cgb_double_speed;
@@ -93,7 +104,7 @@ main:
     }
 }
 
-void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles)
+static void advance_cycles(GB_gameboy_t *gb, unsigned cycles)
 {
     gb->apu.pcm_mask[0] = gb->apu.pcm_mask[1] = 0xFF; // Sort of hacky, but too many cross-component interactions to do it right
 
@@ -103,11 +114,83 @@ void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles)
         cycles <<= 1;
     }
     
-    gb->apu_output.sample_cycles += cycles;
+    gb->apu_output.sample_cycles += (uint64_t)cycles * gb->apu_output.cycles_per_sample_den;
     
     GB_apu_run(gb);
 }
 
+/* How many CPU cycles can run before the next output sample is due. Never 0. */
+static unsigned cycles_until_next_sample(GB_gameboy_t *gb)
+{
+    uint64_t missing = 0;
+    if (gb->apu_output.sample_cycles < gb->apu_output.cycles_per_sample_num) {
+        missing = gb->apu_output.cycles_per_sample_num - gb->apu_output.sample_cycles;
+    }
+    /* Round up to whole 8MHz cycles, then to whole CPU cycles */
+    uint64_t cycles = (missing + gb->apu_output.cycles_per_sample_den - 1) / gb->apu_output.cycles_per_sample_den;
+    if (!gb->cgb_double_speed) {
+        cycles = (cycles + 1) >> 1;
+    }
+    return cycles? cycles : 1;
+}
+
+void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles)
+{
+    advance_cycles(gb, cycles);
+}
+
+void GB_run_cycles(GB_gameboy_t *gb, uint64_t cycles)
+{
+    while (cycles) {
+        /* Stop at every sample boundary on the way so no output sample is skipped */
+        uint64_t step = cycles;
+        if (gb->apu_output.sample_rate) {
+            step = MIN(step, cycles_until_next_sample(gb));
+        }
+        else {
+            step = MIN(step, 0x10000);
+        }
+        advance_cycles(gb, step);
+        cycles -= step;
+    }
+}
+
+void GB_run_samples_float(GB_gameboy_t *gb, float *left, float *right, unsigned count)
+{
+    if (!gb->apu_output.sample_rate) return;
+    /* Samples rendered by GB_run_cycles were never asked for */
+    GB_apu_flush_block(gb, NULL, NULL);
+    while (count) {
+        unsigned block = MIN(count, GB_APU_BLOCK_SIZE);
+        while (gb->apu_output.block_length < block) {
+            advance_cycles(gb, cycles_until_next_sample(gb));
+        }
+        GB_apu_flush_block(gb, left, right);
+        if (left && right) {
+            left += block;
+            right += block;
+        }
+        count -= block;
+    }
+}
+
+void GB_run_samples(GB_gameboy_t *gb, GB_sample_t *samples, unsigned count)
+{
+    float left[GB_APU_BLOCK_SIZE], right[GB_APU_BLOCK_SIZE];
+    while (count) {
+        unsigned block = MIN(count, GB_APU_BLOCK_SIZE);
+        GB_run_samples_float(gb, left, right, block);
+        if (samples) {
+            for (unsigned i = 0; i < block; i++) {
+                samples[i].left = left[i] * 0x8000;
+                samples[i].right = right[i] * 0x8000;
+            }
+            samples += block;
+        }
+        count -= block;
+    }
+}
+
 /* 
    This glitch is based on the expected results of mooneye-gb rapid_toggle test.
    This glitch happens because how TIMA is increased, see GB_set_internal_div_counter.
@@ -3,6 +3,9 @@
 #include "gb_struct_def.h"
 
 void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles);
+void GB_run_cycles(GB_gameboy_t *gb, uint64_t cycles); /* Any number of cycles, rendering every output sample on the way */
+void GB_run_samples_float(GB_gameboy_t *gb, float *left, float *right, unsigned count); /* Runs until count output samples are rendered, normalized to -1..1. left and right may be NULL */
+void GB_run_samples(GB_gameboy_t *gb, GB_sample_t *samples, unsigned count); /* Same, but as 16-bit samples. samples may be NULL */
 void GB_emulate_timer_glitch(GB_gameboy_t *gb, uint8_t old_tac, uint8_t new_tac);
 bool GB_timing_sync_turbo(GB_gameboy_t *gb); /* Returns true if should skip frame */
 void GB_timing_sync(GB_gameboy_t *gb);
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include "log-ring.hpp"
+
+void logRingPush(LogRing* ring, uint8_t level, const char* format, ...){
+	const uint32_t writePos = ring->writePos.load(std::memory_order_relaxed);
+	if (writePos - ring->readPos.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	LogRecord* record = &(ring->records[writePos & (LOG_RING_SIZE - 1)]);
+	record->level = level;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(record->message, LOG_MESSAGE_SIZE, format, args);
+	va_end(args);
+	ring->writePos.store(writePos + 1, std::memory_order_release); // publishes the record
+}
+
+bool logRingPending(const LogRing* ring){
+	return ring->writePos.load(std::memory_order_acquire) != ring->readPos.load(std::memory_order_relaxed) || ring->dropped.load(std::memory_order_relaxed) != 0;
+}
+
+void logRingDrain(LogRing* ring){
+	static const char* const levelNames[] = {"debug", "info", "warning"};
+	const uint32_t writePos = ring->writePos.load(std::memory_order_acquire);
+	uint32_t readPos = ring->readPos.load(std::memory_order_relaxed);
+	for (; readPos != writePos; readPos++){
+		const LogRecord* record = &(ring->records[readPos & (LOG_RING_SIZE - 1)]);
+		printf("[%s] %s\n", levelNames[record->level], record->message);
+	}
+	ring->readPos.store(readPos, std::memory_order_release); // hands the records back to the producer
+	const uint32_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped) printf("[warning] %u log messages were dropped\n", dropped);
+	fflush(stdout);
+}
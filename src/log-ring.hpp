@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Lock-free single producer, single consumer queue of log messages. The audio thread formats messages into fixed-size records instead of calling printf, and a thread that is allowed to block prints them later.
+// Everything is stored inline so the ring can live inside the calloc'd plugin struct, and nothing is allocated while logging.
+#define LOG_RING_SIZE 256 // records. Must be a power of 2
+#define LOG_MESSAGE_SIZE 120 // longer messages are cut off
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO // messages below this level are compiled out
+#endif
+
+struct LogRecord {
+	uint8_t level;
+	char message[LOG_MESSAGE_SIZE];
+};
+
+struct LogRing {
+	std::atomic<uint32_t> writePos; // only written by the producer
+	std::atomic<uint32_t> readPos; // only written by the consumer
+	std::atomic<uint32_t> dropped; // messages lost because the ring was full. Reported (and reset) by the consumer
+	LogRecord records[LOG_RING_SIZE];
+};
+
+// producer side. Wait-free; the message is dropped if the ring is full.
+void logRingPush(LogRing* ring, uint8_t level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+// whether there are messages for the consumer to print
+bool logRingPending(const LogRing* ring);
+// consumer side. Prints every queued message to stdout.
+void logRingDrain(LogRing* ring);
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define logDebug(ring, ...) logRingPush(ring, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(ring, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define logInfo(ring, ...) logRingPush(ring, LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define logInfo(ring, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARNING
+#define logWarning(ring, ...) logRingPush(ring, LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define logWarning(ring, ...) ((void)0)
+#endif
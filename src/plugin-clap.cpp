@@ -4,7 +4,6 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
-#include <vector>
 #include "clap/clap.h"
 #include "gb.h"
 #include "gb_struct_def.h"
@@ -18,6 +17,8 @@ struct GameBoyPlugin {
 	
 	GameBoyPluginCore core; // The part of the plugin that is standard agnostic
 	bool prevPlaying;
+	MidiEventBuffer midiEvents; // allocated in activate, so that process never allocates
+	std::atomic<bool> offline; // set by the render extension on the main thread, and copied into the core at the start of each process call
 };
 
 static const clap_plugin_descriptor_t pluginDescriptor = {
@@ -71,6 +72,67 @@ static const clap_plugin_audio_ports_t extensionAudioPorts = {
 	},
 };
 
+#define STATE_VERSION 1
+
+// streams may handle fewer bytes than asked for at a time
+static bool writeToStream(const clap_ostream_t *stream, const void *data, uint64_t size) {
+	while (size > 0) {
+		const int64_t written = stream->write(stream, data, size);
+		if (written <= 0) return false;
+		data = (const uint8_t *) data + written;
+		size -= written;
+	}
+	return true;
+}
+
+static bool readFromStream(const clap_istream_t *stream, void *data, uint64_t size) {
+	while (size > 0) {
+		const int64_t read = stream->read(stream, data, size);
+		if (read <= 0) return false;
+		data = (uint8_t *) data + read;
+		size -= read;
+	}
+	return true;
+}
+
+// the state is the path of the wave bank file, since clap has no parameters that hold text. Waves sent as sysex aren't saved, since the song sends them again.
+static const clap_plugin_state_t extensionState = {
+	.save = [] (const clap_plugin_t *_plugin, const clap_ostream_t *stream) -> bool {
+		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
+		char *path = copyWaveBankFilePath(&(self->core.waves));
+		const uint32_t header[2] = {STATE_VERSION, path ? (uint32_t) strlen(path) : 0};
+		const bool written = writeToStream(stream, header, sizeof(header)) && writeToStream(stream, path, header[1]);
+		free(path);
+		return written;
+	},
+
+	.load = [] (const clap_plugin_t *_plugin, const clap_istream_t *stream) -> bool {
+		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
+		uint32_t header[2];
+		if (!readFromStream(stream, header, sizeof(header))) return false;
+		if (header[0] > STATE_VERSION || header[1] >= MAX_WAVE_BANK_PATH) return false;
+		char path[MAX_WAVE_BANK_PATH];
+		if (!readFromStream(stream, path, header[1])) return false;
+		path[header[1]] = '\0';
+		// called on the main thread, like on_main_thread, so the file can be read right here
+		loadWaveBankFile(&(self->core.waves), path);
+		return true; // a missing file only loses the waves. Its path is still saved with the project
+	},
+};
+
+// lets the core know when the host is rendering offline
+static const clap_plugin_render_t extensionRender = {
+	.has_hard_realtime_requirement = [] (const clap_plugin_t *_plugin) -> bool {
+		return false;
+	},
+
+	.set = [] (const clap_plugin_t *_plugin, clap_plugin_render_mode mode) -> bool {
+		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
+		self->offline.store(mode == CLAP_RENDER_OFFLINE, std::memory_order_relaxed);
+		return true;
+	},
+};
+
 static const clap_plugin_t pluginClass = { // contains all of the plugin methods that will be called by the DAW
 	.desc = &pluginDescriptor,
 	.plugin_data = nullptr,
@@ -78,13 +140,17 @@ static const clap_plugin_t pluginClass = { // contains all of the plugin methods
 	.init = [] (const clap_plugin *_plugin) -> bool {
 		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
 		
-		setUpNoisePitchList(&(self->core));
+		setUpCCDecodeTables(&(self->core));
 		
-		return true;
+		return waveBankExchangeInit(&(self->core.waves));
 	},
 
 	.destroy = [] (const clap_plugin *_plugin) {
 		GameBoyPlugin *plugin = (GameBoyPlugin *) _plugin->plugin_data;
+		midiEventBufferFree(&(plugin->midiEvents));
+		waveBankExchangeFree(&(plugin->core.waves));
+		releasePowerOnSnapshots(plugin->core.powerOn);
+		resamplerFree(&(plugin->core.resampler));
 		free(plugin);
 	},
 
@@ -92,10 +158,16 @@ static const clap_plugin_t pluginClass = { // contains all of the plugin methods
 		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
 		resetInternalState(&(self->core), sampleRate);
 		self->prevPlaying=false;
-		return true;
+		// room for one event per frame, which is far more than a midi song sends. Blocks with more are still handled, just in several pieces.
+		midiEventBufferFree(&(self->midiEvents));
+		logRingDrain(&(self->core.log)); // activate runs on the main thread
+		return midiEventBufferInit(&(self->midiEvents), maximumFramesCount > MIN_MIDI_EVENT_CAPACITY ? maximumFramesCount : MIN_MIDI_EVENT_CAPACITY);
 	},
 
 	.deactivate = [] (const clap_plugin *_plugin) {
+		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
+		midiEventBufferFree(&(self->midiEvents));
+		logRingDrain(&(self->core.log));
 	},
 
 	.start_processing = [] (const clap_plugin *_plugin) -> bool {
@@ -122,95 +194,74 @@ static const clap_plugin_t pluginClass = { // contains all of the plugin methods
 		float *outputR;
 		outputL = process->audio_outputs[0].data32[0];
 		outputR = process->audio_outputs[0].data32[1];
+		self->core.offline = self->offline.load(std::memory_order_relaxed);
 		
-		// put this block's midi events in a regular array to make processing easier.
-		std::vector<const clap_event_header_t*> midiEvArray; // contains both CLAP_EVENT_MIDI and CLAP_EVENT_MIDI_SYSEX
-		{
-			const uint32_t inputEventCount = process->in_events->size(process->in_events); // transport events are NEVER contained here. Only one transport event is sent per block, in process->transport
-			for (uint32_t eventIndex = 0; eventIndex<inputEventCount; eventIndex++){
-				const clap_event_header_t *event = process->in_events->get(process->in_events, eventIndex);
-				if (event->type == CLAP_EVENT_MIDI || event->type == CLAP_EVENT_MIDI_SYSEX){
-					midiEvArray.push_back(event);
+		// convert this block's midi events to the generic midi format, in one pass over the host's time-ordered event list. The events point into the host's event list instead of copying it.
+		startMidiEventBlock(&(self->midiEvents), frameCount);
+		const uint32_t inputEventCount = process->in_events->size(process->in_events); // transport events are NEVER contained here. Only one transport event is sent per block, in process->transport
+		for (uint32_t eventIndex = 0; eventIndex<inputEventCount; eventIndex++){ // contains both CLAP_EVENT_MIDI and CLAP_EVENT_MIDI_SYSEX
+			const clap_event_header_t *event = process->in_events->get(process->in_events, eventIndex);
+			if (event->type != CLAP_EVENT_MIDI && event->type != CLAP_EVENT_MIDI_SYSEX) continue;
+			midiMessage* newEv = addMidiEvent(&(self->core), &(self->midiEvents), event->time, outputL, outputR);
+			if (event->type == CLAP_EVENT_MIDI_SYSEX) {
+				newEv->statusByte = 0xF7; // a later piece of a sysex that the host split into several events, unless it starts with the status byte. The core treats a piece that continues nothing as a whole sysex, since some hosts leave the status byte out.
+				const uint8_t* sysexData = ((clap_event_midi_sysex_t*)event)->buffer;
+				uint32_t sysexSize = ((clap_event_midi_sysex_t*)event)->size;
+				if (sysexSize > 0 && sysexData[0] == 0xF0) {
+					newEv->statusByte = 0xF0;
+					sysexData++; // move the pointer forward one byte.
+					sysexSize--;
 				}
+				uint32_t dataSize = 0;
+				while (dataSize < sysexSize && sysexData[dataSize] != 0xF7) dataSize++; // never reads past the event
+				newEv->dataBytes = sysexData;
+				newEv->dataSize = dataSize;
+				newEv->sysexEnd = dataSize < sysexSize;
+			} else { // CLAP_EVENT_MIDI
+				newEv->statusByte = (((clap_event_midi_t*)event)->data)[0];
+				newEv->dataBytes = (((clap_event_midi_t*)event)->data) + 1;
+				newEv->dataSize = 2;
 			}
 		}
 		
-		for (uint32_t curFrame = 0; curFrame<frameCount; curFrame++){
-			// output silence
-			outputL[curFrame] = 0;
-			outputR[curFrame] = 0;
-			
-			// store all midi events that happen at the same frame in a sub-vector
-			std::vector<const clap_event_header_t*> curFrameMidiEvs; // use this to reorder conflicting simultaneous midi events
-			for (uint32_t evI=0; evI<midiEvArray.size(); evI++) {
-				if (midiEvArray[evI]==NULL) continue;
-				if (curFrame >= midiEvArray[evI]->time) {
-					curFrameMidiEvs.push_back(midiEvArray[evI]);
-					midiEvArray[evI]=NULL;
-				} /* else if (midiEvArray[evI]->time.frames > pos) {
-					break; // events in midiEvArray are stored in chronological order, so once we reach the first event that is scheduled after the current position, we can assume that the rest of the events in the array are also not ready to be played.
-				}
-				*/
-			}
-			
-			std::vector<midiMessage> curFrameMidiEvsGeneric;
-			for (uint32_t evI=0; evI<curFrameMidiEvs.size(); evI++) { // convert
-				midiMessage newEv;
-				newEv.statusByte = 0; // marker for an invalid event
-				if (curFrameMidiEvs[evI]->type == CLAP_EVENT_MIDI_SYSEX) {
-					newEv.statusByte = 0xF0;
-					const uint8_t* sysexData = ((clap_event_midi_sysex_t*)curFrameMidiEvs[evI])->buffer;
-					const uint32_t sysexSize = ((clap_event_midi_sysex_t*)curFrameMidiEvs[evI])->size;
-					if (sysexData[0] == 0xF0) {
-						sysexData++; // move the pointer forward one byte.
-						printf("Had to advance sysexData pointer\n");
-					}
-					for (uint32_t i=0; i<sysexSize; i++){
-						if (sysexData[i]==0xF7) break;
-						newEv.dataBytes.push_back(sysexData[i]);
-					}
-				} else if (curFrameMidiEvs[evI]->type == CLAP_EVENT_MIDI) {
-					newEv.statusByte = (((clap_event_midi_t*)curFrameMidiEvs[evI])->data)[0];
-					for (int i=0; i<2; i++){
-						newEv.dataBytes.push_back((((clap_event_midi_t*)curFrameMidiEvs[evI])->data)[i+1]);
-					}
-				}
-				curFrameMidiEvsGeneric.push_back(newEv);
-			}
-			
-			// now that we have collected all the midi events that happen simultaneously on this position, we can convert them into APU writes.
-			std::pair<float, float> outputs = processFrame(&(self->core), curFrameMidiEvsGeneric);
-			outputL[curFrame] = outputs.first;
-			outputR[curFrame] = outputs.second;
-		}
+		// the core splits the block at each event, and renders whatever part of the block is left.
+		finishMidiEventBlock(&(self->core), &(self->midiEvents), outputL, outputR);
 		
-		// check if the DAW has just paused. If true, call resetInternalState
+		// check if the DAW has just paused. If true, silence the channels
 		const clap_event_transport_t* blockTransportEvent;
 		blockTransportEvent = process->transport;
 		if (blockTransportEvent != nullptr) {
 			bool isPlaying = ((blockTransportEvent->flags) & CLAP_TRANSPORT_IS_PLAYING) ? true : false;
 			if (isPlaying != self->prevPlaying) {
 				if (isPlaying == false) {
-					printf("isPlaying == false\n");
-					resetInternalState(&(self->core), 0);
+					logInfo(&(self->core.log), "isPlaying == false");
+					parkPlayback(&(self->core));
 					self->prevPlaying=false;
 				} else {
-					printf("isPlaying == true\n");
+					logInfo(&(self->core.log), "isPlaying == true");
 					self->prevPlaying = isPlaying;
 				}
 			}
 		}
 		
+		if (logRingPending(&(self->core.log)) || waveBankHasBackgroundWork(&(self->core.waves))) self->host->request_callback(self->host); // the messages are printed, and waves parsed, in on_main_thread
+		
+		if (self->core.idle) return CLAP_PROCESS_SLEEP; // every channel is muted and the output has settled to 0. The host wakes the plugin up with the next event. This is what tells the host when the sound has ended, since a held note has no tail length that could be reported ahead of time.
 		return CLAP_PROCESS_CONTINUE;
 	},
 
 	.get_extension = [] (const clap_plugin *plugin, const char *id) -> const void * {
 		if (0 == strcmp(id, CLAP_EXT_NOTE_PORTS )) return &extensionNotePorts;
 		if (0 == strcmp(id, CLAP_EXT_AUDIO_PORTS)) return &extensionAudioPorts;
+		if (0 == strcmp(id, CLAP_EXT_STATE      )) return &extensionState;
+		if (0 == strcmp(id, CLAP_EXT_RENDER     )) return &extensionRender;
 		return nullptr;
 	},
 
 	.on_main_thread = [] (const clap_plugin *_plugin) {
+		GameBoyPlugin *self = (GameBoyPlugin *) _plugin->plugin_data;
+		doWaveBankBackgroundWork(&(self->core.waves));
+		logRingDrain(&(self->core.log));
 	},
 };
 
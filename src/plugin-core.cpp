@@ -3,68 +3,81 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
-#include <vector>
-#include <utility>
 #include "gb.h"
 #include "gb_struct_def.h"
 #include "apu.h"
 #include "timing.h"
 #include "plugin-core.hpp"
 
+#define MIDI_PITCH_CENTER 0x2000
+#define PITCH_FRACTION_BITS 12 // pitches are looked up in 1/4096ths of a semitone, which is the resolution of a 14-bit pitch bend with the default bend range of 2 semitones
+#define PERIOD_TABLE_NOTES 72 // C2 to B7
+#define PERIOD_TABLE_SIZE (((PERIOD_TABLE_NOTES - 1) << PITCH_FRACTION_BITS) + 1)
+
+struct PeriodTable { // the GB period of every pitch from C2 to B7, in 1/4096ths of a semitone. Built when the plugin is loaded, and shared by every instance.
+	uint16_t periods[PERIOD_TABLE_SIZE];
+	PeriodTable(){
+		const uint16_t gbPitchArray[PERIOD_TABLE_NOTES] = {44,156,262,363,457,547,631,710,786,854,923,986,1046,1102,1155,1205,1253,1297,1339,1379,1417,1452,1486,1517,1546,1575,1602,1627,1650,1673,1694,1714,1732,1750,1767,1783,1798,1812,1825,1837,1849,1860,1871,1881,1890,1899,1907,1915,1923,1930,1936,1943,1949,1954,1959,1964,1969,1974,1978,1982,1985,1988,1992,1995,1998,2001,2004,2006,2009,2011,2013,2015};
+		// pitches between two notes are linearly interpolated between their periods, rounding to the nearest period.
+		const uint32_t fractionHalf = 1 << (PITCH_FRACTION_BITS - 1);
+		for (uint32_t position=0; position<PERIOD_TABLE_SIZE; position++){
+			const uint32_t note = position >> PITCH_FRACTION_BITS;
+			const uint32_t fraction = position & ((1 << PITCH_FRACTION_BITS) - 1);
+			if (fraction == 0) {
+				periods[position] = gbPitchArray[note];
+			} else {
+				const uint32_t gbPitchDiff = gbPitchArray[note + 1] - gbPitchArray[note];
+				periods[position] = gbPitchArray[note] + ((gbPitchDiff * fraction + fractionHalf) >> PITCH_FRACTION_BITS);
+			}
+		}
+	}
+};
+static const PeriodTable PERIOD_TABLE;
+
+// noise pitch spans the whole midi note range. The list is written backwards because lower values tend to be higher pitched, and skips the noise width bit.
+static const uint8_t NOISE_PITCH_LIST[127] = {0xF7,0xF6,0xF5,0xF4,0xF3,0xF2,0xF1,0xF0,0xE7,0xE6,0xE5,0xE4,0xE3,0xE2,0xE1,0xE0,0xD7,0xD6,0xD5,0xD4,0xD3,0xD2,0xD1,0xD0,0xC7,0xC6,0xC5,0xC4,0xC3,0xC2,0xC1,0xC0,0xB7,0xB6,0xB5,0xB4,0xB3,0xB2,0xB1,0xB0,0xA7,0xA6,0xA5,0xA4,0xA3,0xA2,0xA1,0xA0,0x97,0x96,0x95,0x94,0x93,0x92,0x91,0x90,0x87,0x86,0x85,0x84,0x83,0x82,0x81,0x80,0x77,0x76,0x75,0x74,0x73,0x72,0x71,0x70,0x67,0x66,0x65,0x64,0x63,0x62,0x61,0x60,0x57,0x56,0x55,0x54,0x53,0x52,0x51,0x50,0x47,0x46,0x45,0x44,0x43,0x42,0x41,0x40,0x37,0x36,0x35,0x34,0x33,0x32,0x31,0x30,0x27,0x26,0x25,0x24,0x23,0x22,0x21,0x20,0x17,0x16,0x15,0x14,0x13,0x12,0x11,0x10,0x07,0x06,0x05,0x04,0x03,0x02,0x01};
+
+static void setPitchBendRange(GameBoyPluginCore* self, uint8_t channel, uint8_t semitones, uint8_t cents){
+	self->bendRangeSemitones[channel] = semitones;
+	self->bendRangeCents[channel] = cents;
+	self->bendRange[channel] = ((int32_t)semitones << PITCH_FRACTION_BITS) + (((int32_t)cents << PITCH_FRACTION_BITS) + 50) / 100;
+}
+
 // helper functions of gb plugin
 void resetInternalState(GameBoyPluginCore* self, double rate, bool isInstantiate){
-	memset(&(self->gb),0,sizeof(GB_gameboy_t));
-	if (isInstantiate==true) {
-		self->gb.model = GB_MODEL_DMG_B; // default model.
-	}
-	GB_apu_init(&(self->gb));
-	if (isInstantiate==true) self->gb.model = GB_MODEL_DMG_B;
+	self->idle = false;
+	// a reset keeps the model, except at instantiation, or before the first model has been chosen
+	const GB_model_t model = isInstantiate || powerOnModelIndex(self->gb.model) < 0 ? GB_MODEL_DMG_B /*default model*/ : self->gb.model;
 	if (rate) {
-		printf("DAW sample rate: %lf\n", rate);
+		logInfo(&(self->log), "DAW sample rate: %lf", rate);
 		self->sampleRate=rate;
-		GB_set_sample_rate(&(self->gb),(unsigned)(int)round(rate));
-	} else if (self->sampleRate) {
-		GB_set_sample_rate(&(self->gb),(unsigned)(int)round(self->sampleRate));
+	}
+	unsigned apuSampleRate = 0;
+	if (self->sampleRate) {
+#if INTERNAL_SAMPLE_RATE
+		apuSampleRate = INTERNAL_SAMPLE_RATE;
+		if (!rate) {
+			resamplerReset(&(self->resampler)); // the filter was already found by the reset that set the rate, and looking for it may block
+		} else if (!resamplerInit(&(self->resampler), INTERNAL_SAMPLE_RATE, (uint32_t)round(self->sampleRate))) {
+			logWarning(&(self->log), "no resampler filter, the output will be silent"); // only looks for another filter if the DAW sample rate changed
+		}
+#else
+		apuSampleRate = (unsigned)(int)round(self->sampleRate);
+#endif
 	} else {
-		printf("Warning: GB sample rate not set!\n");
+		logWarning(&(self->log), "GB sample rate not set!");
 	}
-	GB_set_highpass_filter_mode(&(self->gb), GB_HIGHPASS_ACCURATE); // the default mode is GB_HIGHPASS_OFF
-	GB_apu_write(&(self->gb), GB_IO_NR10, 0); // disable square 1 pitch sweep.
-	GB_apu_write(&(self->gb), GB_IO_NR52, 0x8f); // Power on APU. writing to bits 3-0 of this register *shouldn't* do anything because those bits are read only, but some emulators require them to be written to in order to enable channels.
-	GB_apu_write(&(self->gb), GB_IO_NR51, 0xFF); // Enable all channels and set panning to center.
-	GB_apu_write(&(self->gb), GB_IO_NR50, 0x77); // set master volume to max.
-	
-	//set env. Set volume to max, set envelope direction to down (decrease volume), and set envelope length to 0 (disables envelope).
-	GB_apu_write(&(self->gb), GB_IO_NR12, 0xF0);
-	GB_apu_write(&(self->gb), GB_IO_NR22, 0xF0);
-	GB_apu_write(&(self->gb), GB_IO_NR32, 0b01 << 5); // ?
-	GB_apu_write(&(self->gb), GB_IO_NR42, 0xF0);
-	// trigger channel
-	GB_apu_write(&(self->gb), GB_IO_NR14, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR24, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR34, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR44, 0x80);
-		
-	GB_advance_cycles(&(self->gb), 0xFF); // TODO: reduce this cycle number to improve performance slightly.
-		
-	// trigger channel again with 0 vol. This shouldn't mess up the user playing notes, because this is the same state as after a note off.
-	// Envelope settings are: Volume 0, envelope direction up, and envelope length 0.
-	// Setting all envelope settings except envelope direction to 0 is the best way to mute a channel without powering off the channel's DAC (powering off the channel's DAC would cause a pop sound).
-	GB_apu_write(&(self->gb), GB_IO_NR12, 8);
-	GB_apu_write(&(self->gb), GB_IO_NR22, 8);
-	GB_apu_write(&(self->gb), GB_IO_NR32, 0);
-	GB_apu_write(&(self->gb), GB_IO_NR42, 8);
-	GB_apu_write(&(self->gb), GB_IO_NR14, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR24, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR34, 0x80);
-	GB_apu_write(&(self->gb), GB_IO_NR44, 0x80);
-	
-	for (int i=0; i<0xFFFF; i++){
-		GB_advance_cycles(&(self->gb), 0xFF);
-		if (self->gb.apu_output.final_sample.left == 0) break;
-		if (i==0xFFFF-1) printf("loop never broke\n");
+	if (rate && apuSampleRate && (self->powerOn == nullptr || self->powerOn->sampleRate != apuSampleRate)) {
+		// resets given a rate are never made on the audio thread, so the snapshots can be computed here
+		releasePowerOnSnapshots(self->powerOn);
+		self->powerOn = acquirePowerOnSnapshots(apuSampleRate);
+	}
+	const GB_gameboy_t* powerOnState = self->powerOn != nullptr && self->powerOn->sampleRate == apuSampleRate ? getPowerOnState(self->powerOn, model) : nullptr;
+	if (powerOnState != nullptr) {
+		memcpy(&(self->gb), powerOnState, sizeof(GB_gameboy_t));
+	} else if (!powerOnGameBoy(&(self->gb), model, apuSampleRate)) {
+		logWarning(&(self->log), "loop never broke");
 	}
-	// advance past APU pop
 	
 	// I and users should avoid anything that turns the channel off. It will cause the next note played to be too loud
 	
@@ -75,68 +88,41 @@ void resetInternalState(GameBoyPluginCore* self, double rate, bool isInstantiate
 		self->userSoundLen[i]=0;
 		self->lastMidiNote[i]=0xFF; // C4
 		self->lastMidiPitchBend[i]=0x2000; // center.
+		self->rpnMSB[i]=0x7F; // no parameter selected
+		self->rpnLSB[i]=0x7F;
+		setPitchBendRange(self, i, 2, 0);
 	}
 	self->userVol[2]=1;
+	memcpy(self->shadowRegisters, self->gb.io_registers + GB_IO_NR10, APU_REGISTER_COUNT); // the plugin only ever writes whole registers, so after this the shadow stays in sync on its own
+	self->queuedWrites = 0;
+	memset(self->queuePosition, 0xFF, APU_REGISTER_COUNT);
 	self->curWaveIndex = 0;
 	self->curWaveIndexLSB = 0;
 	self->curWaveIndexMSB = 0;
 	
-	if (isInstantiate==true) {
-		for (uint16_t i=0; i<MAX_WAVES; i++){ // if the wave sysex message is only sent at the start of the song, then the wave channel might break if the user pauses and resumes in the middle of a song, which would be bad. Maybe I can get away with not resetting wave stuff during activate()? NOTE: I think I can make wave stuff persist if I turn it into a user-facing control rather than an internal state.
-			for (uint8_t i2=0; i2<16; i2++){
-				self->songWaveArray[i][i2]=0;
-			}
-		}
-	}
+	// waves are kept, so that a song that only sends its wave sysex at the start can be paused and resumed in the middle.
 	
 }
 
-static uint16_t midiNoteAndPitchBend2gbPitch(uint8_t midiNote, uint16_t midiPitchBend, uint8_t channel, uint8_t NOISE_PITCH_LIST[]){
+static uint16_t midiNoteAndPitchBend2gbPitch(GameBoyPluginCore* self, uint8_t midiNote, uint16_t midiPitchBend, uint8_t channel){
 	uint8_t const noteC2=36; // midi note number
 	if (channel!=3) {
-		uint16_t gbPitchArray[] = {44,156,262,363,457,547,631,710,786,854,923,986,1046,1102,1155,1205,1253,1297,1339,1379,1417,1452,1486,1517,1546,1575,1602,1627,1650,1673,1694,1714,1732,1750,1767,1783,1798,1812,1825,1837,1849,1860,1871,1881,1890,1899,1907,1915,1923,1930,1936,1943,1949,1954,1959,1964,1969,1974,1978,1982,1985,1988,1992,1995,1998,2001,2004,2006,2009,2011,2013,2015}; // length: 72
-		// first entry in gbPitchArray is C2
-		int8_t gbPitchArrNoteI = midiNote - noteC2;
-		if (gbPitchArrNoteI < 0) {
-			gbPitchArrNoteI=0;
-		} else if (gbPitchArrNoteI > 71) {
-			gbPitchArrNoteI=71;
+		int32_t position = (int32_t)(int8_t)(midiNote - noteC2) * (1 << PITCH_FRACTION_BITS); // first entry in the period table is C2. lastMidiNote is 0xFF before the first note, which wraps around to below C2.
+		if (position < 0) {
+			position = 0;
+		} else if (position >= PERIOD_TABLE_SIZE) {
+			position = PERIOD_TABLE_SIZE - 1;
 		}
-		uint16_t gbPitchNote = gbPitchArray[gbPitchArrNoteI];
-	#define MIDI_PITCH_CENTER 0x2000
-		if (midiPitchBend == MIDI_PITCH_CENTER) {
-			return gbPitchNote;
-		} else {
-			const int pitchBendRange = 2; // TODO: have this be set by RPN
-			float bendSemitones = ((float)midiPitchBend - (float)MIDI_PITCH_CENTER) * ((float)pitchBendRange / MIDI_PITCH_CENTER); // if pitchBendRange is 2, this will be a number between -2 and +2.
-			if (midiPitchBend > MIDI_PITCH_CENTER) {
-				int intBendSemitones = (int)ceil(bendSemitones);
-				if (gbPitchArrNoteI + intBendSemitones > 71) {
-					return gbPitchArray[71];
-				} else if (intBendSemitones == bendSemitones) {
-					return gbPitchArray[gbPitchArrNoteI + intBendSemitones];
-				} else {
-					int intFlooredBendSemitones = (int)floor(bendSemitones);
-					int gbPitchDiff = gbPitchArray[gbPitchArrNoteI + intBendSemitones] - gbPitchArray[gbPitchArrNoteI + intFlooredBendSemitones];
-					return (uint16_t)round(gbPitchArray[gbPitchArrNoteI + intFlooredBendSemitones] + ((float)gbPitchDiff * (bendSemitones - intFlooredBendSemitones)));
-				}
-			} else { // midiPitchBend < MIDI_PITCH_CENTER
-				int intBendSemitones = (int)floor(bendSemitones);
-				if (gbPitchArrNoteI + intBendSemitones < 0) {
-					return gbPitchArray[0];
-				} else if (intBendSemitones == bendSemitones) {
-					return gbPitchArray[gbPitchArrNoteI + intBendSemitones];
-				} else {
-					int intCeiledBendSemitones = (int)ceil(bendSemitones);
-					int gbPitchDiff = gbPitchArray[gbPitchArrNoteI + intCeiledBendSemitones] - gbPitchArray[gbPitchArrNoteI + intBendSemitones];
-					return (uint16_t)round(gbPitchArray[gbPitchArrNoteI + intCeiledBendSemitones] - ((float)gbPitchDiff * (fabsf(bendSemitones) - fabsf((float)intCeiledBendSemitones))));
-				}
-			}
+		position += (int32_t)(((int64_t)midiPitchBend - MIDI_PITCH_CENTER) * self->bendRange[channel] >> 13); // a bend of MIDI_PITCH_CENTER is the whole bend range
+		if (position < 0) {
+			position = 0;
+		} else if (position >= PERIOD_TABLE_SIZE) {
+			position = PERIOD_TABLE_SIZE - 1;
 		}
+		return PERIOD_TABLE.periods[position];
 	} else {
 		// handle noise
-		// noise pitch spans the whole midi note range.
-		int8_t gbPitchArrNoteI = midiNote;
+		uint8_t gbPitchArrNoteI = midiNote;
 		if (gbPitchArrNoteI > 126) { // NOISE_PITCH_LIST has a size of 127. 126 is the last index
 			gbPitchArrNoteI=126;
 		}
@@ -144,29 +130,78 @@ static uint16_t midiNoteAndPitchBend2gbPitch(uint8_t midiNote, uint16_t midiPitc
 	}
 }
 
-static void writeNewPitchToAPU(GB_gameboy_t* gbPointer, uint16_t newPitch, uint8_t channel, bool isTrigger, uint8_t soundLenEn){
+static void flushAPUWrites(GameBoyPluginCore* self){
+	for (uint8_t i=0; i<self->queuedWrites; i++){
+		GB_apu_write(&(self->gb), self->queuedRegisters[i], self->queuedValues[i]);
+	}
+	self->queuedWrites = 0;
+	memset(self->queuePosition, 0xFF, APU_REGISTER_COUNT);
+}
+
+// whether a write does something at the moment it happens (triggering a channel or turning its DAC off), rather than only setting a value. These keep their place in the queue, and nothing written after them is moved in front of them.
+static bool isOrderedAPUWrite(uint8_t reg, uint8_t value){
+	switch (reg){
+		case GB_IO_NR14: case GB_IO_NR24: case GB_IO_NR34: case GB_IO_NR44:
+			return value & 0x80;
+		case GB_IO_NR12: case GB_IO_NR22: case GB_IO_NR42:
+			return (value & 0xF8) == 0;
+		case GB_IO_NR30:
+			return !(value & 0x80);
+		default:
+			return false;
+	}
+}
+
+static void queueAPUWrite(GameBoyPluginCore* self, uint8_t reg, uint8_t value){
+	const uint8_t regI = reg - GB_IO_NR10;
+	self->shadowRegisters[regI] = value;
+	const bool ordered = isOrderedAPUWrite(reg, value);
+	if (!ordered && self->queuePosition[regI] != 0xFF) {
+		self->queuedValues[self->queuePosition[regI]] = value; // only the last value written in this frame matters
+		return;
+	}
+	if (self->queuedWrites == APU_WRITE_QUEUE_SIZE) flushAPUWrites(self);
+	self->queuedRegisters[self->queuedWrites] = reg;
+	self->queuedValues[self->queuedWrites] = value;
+	if (ordered) {
+		memset(self->queuePosition, 0xFF, APU_REGISTER_COUNT);
+	} else {
+		self->queuePosition[regI] = self->queuedWrites;
+	}
+	self->queuedWrites++;
+}
+
+static uint8_t readAPURegister(GameBoyPluginCore* self, uint8_t reg){
+	return self->shadowRegisters[reg - GB_IO_NR10];
+}
+
+// the two register writes that set a channel's pitch. soundLenEn is 0 or 1 to also set length enable, or 0xFF to keep it.
+static void pitchRegisterOps(uint16_t newPitch, uint8_t channel, bool isTrigger, uint8_t soundLenEn, uint8_t flags, RegisterOp ops[2]){
+	for (int i=0; i<2; i++){
+		ops[i].type = REG_OP_WRITE;
+		ops[i].flags = 0;
+		ops[i].channel = channel;
+		ops[i].data = 0;
+	}
 	if (channel!=3) {
-		uint8_t regVal = 0;
-		if (soundLenEn < 2) {
-			regVal |= soundLenEn << 6;
-		} else {
-			regVal = GB_apu_read(gbPointer, GB_IO_NR14 + channel*5) & 0b01000000; // preserve length enable
-			// NOTE: GB_apu_read can return garbage bits from areas that are write-only! Remember to always zero-out bits that are not needed.
-		}
-		regVal |= (uint8_t)((newPitch & 0b0000011100000000)>>8);
-		if (isTrigger) regVal |= 0b10000000;
-		GB_apu_write(gbPointer, GB_IO_NR14 + channel*5, regVal);
-		regVal = newPitch & 0xFF;
-		GB_apu_write(gbPointer, GB_IO_NR13 + channel*5, regVal);
+		ops[0].reg = GB_IO_NR14 + channel*5;
+		ops[0].mask = soundLenEn < 2 ? 0xFF : 0b10111111; // preserve length enable
+		ops[0].value = (uint8_t)((newPitch & 0b0000011100000000)>>8);
+		if (soundLenEn < 2) ops[0].value |= soundLenEn << 6;
+		ops[1].reg = GB_IO_NR13 + channel*5;
+		ops[1].mask = 0xFF;
+		ops[1].value = newPitch & 0xFF;
 	} else {
 		// handle noise
-		uint8_t regVal = GB_apu_read(gbPointer, GB_IO_NR44) & 0b01000000; // preserve length enable
-		if (isTrigger) regVal |= 0b10000000; // NOTE: for the noise channel, changing the pitch without retriggering the channel does nothing.
-		GB_apu_write(gbPointer, GB_IO_NR44, regVal);
-		regVal = GB_apu_read(gbPointer, GB_IO_NR43) & 0b00001000; // preserve noise width
-		regVal |= ((uint8_t)newPitch & 0b11110111);
-		GB_apu_write(gbPointer, GB_IO_NR43, regVal);
+		ops[0].reg = GB_IO_NR44;
+		ops[0].mask = 0b10111111; // preserve length enable
+		ops[0].value = 0; // NOTE: for the noise channel, changing the pitch without retriggering the channel does nothing.
+		ops[1].reg = GB_IO_NR43;
+		ops[1].mask = 0b11110111; // preserve noise width
+		ops[1].value = (uint8_t)newPitch & 0b11110111;
 	}
+	if (isTrigger) ops[0].value |= 0b10000000;
+	ops[0].flags = flags;
 }
 
 static uint8_t convertMidiValToRange(uint8_t inMidiVal, uint8_t outValMax){ // used to convert midi vals to register bit val range.
@@ -174,84 +209,124 @@ static uint8_t convertMidiValToRange(uint8_t inMidiVal, uint8_t outValMax){ // u
 	return (uint8_t)round((float)outValMax * ((float)inMidiVal / MIDI_CC_MAX));
 }
 
-void setUpNoisePitchList(GameBoyPluginCore* self){
-	// set up NOISE_PITCH_LIST
-	uint8_t noisePitchListSize=0;
-	for (int16_t noisePitch=0xF7; noisePitch >= 0; noisePitch--){ // the list should be written backwards because lower values tend to be higher pitched. 0xF7 is 0b11110111.
-		if ((noisePitch & 8) == 0) {
-			self->NOISE_PITCH_LIST[noisePitchListSize]=(uint8_t)noisePitch;
-			noisePitchListSize++;
+void setUpCCDecodeTables(GameBoyPluginCore* self){
+	CCDecodeTables* tables = &(self->ccTables);
+	for (uint8_t midiVal=0; midiVal<128; midiVal++){
+		tables->volume[0][midiVal] = round((float)(float)(midiVal / (float)0x7F) * (float)0x0F);
+		if (midiVal >= 96) {
+			tables->volume[1][midiVal] = 0b01;
+		} else if (midiVal >= 48) {
+			tables->volume[1][midiVal] = 0b10;
+		} else if (midiVal > 0) {
+			tables->volume[1][midiVal] = 0b11;
+		} else {
+			// if ccVol is 0, set wav vol to 0
+			tables->volume[1][midiVal] = 0;
+		}
+		tables->soundLength[0][midiVal] = convertMidiValToRange(midiVal, 0x3F);
+		tables->soundLength[1][midiVal] = convertMidiValToRange(midiVal, 0xFF);
+		tables->envelopeLength[midiVal] = (uint8_t)round(((float)midiVal / 0x7F) * 7) & 0b00000111;
+		tables->sweepSpeedOrShift[midiVal] = convertMidiValToRange(midiVal, 7) & 0b111;
+		tables->sweepDirection[midiVal] = (convertMidiValToRange(midiVal, 1) ^ 1) & 1; // In GB, 0 is "increase pitch", which is unintuitive. Inverting sweepDir before writing to the emulated GB allows the user to use a CC of 127 as "increase pitch", which is more intuitive.
+		tables->duty[midiVal] = (uint8_t)round(((float)midiVal / 0x7F) * 3);
+		if (midiVal >= 96) {
+			tables->pan[midiVal] = 0x01;
+		} else if (midiVal >= 32) {
+			tables->pan[midiVal] = 0x11;
+		} else {
+			tables->pan[midiVal] = 0x10;
 		}
 	}
 }
 
 // gb helper functions end
 
-// process function. This is run for each frame in the current audio block. Hopefully this works with most plugin standards
-std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMessage>& curFrameMidiEvs){ // TODO: return a pair of float samples
-	// these boolean arrays exist to make sure that simultaneous events don't accidently overwrite each other.
-	bool noteOn[4]={false, false, false, false}; // a note on was sent at this position
-	bool noteTriggered[4]={false, false, false, false};
-	bool cc21set=false;
-	bool cc53set=false;
-	for (uint32_t evI=0; evI<curFrameMidiEvs.size(); evI++) {
-		//const clap_event_header_t *event = curFrameMidiEvs[evI];
-		uint8_t midiMessageType = curFrameMidiEvs[evI].statusByte & 0xF0; // the 4 least significant bits of the status byte contain the channel. Discard them to get just the midi event type
+static RegisterOp* emitRegisterOp(GameBoyPluginCore* self, uint8_t type, uint8_t channel, uint16_t data){
+	RegisterOp* op = &(self->registerOps[self->registerOpCount++]);
+	op->frame = self->compileState.frame;
+	op->type = type;
+	op->flags = 0;
+	op->channel = channel;
+	op->reg = 0;
+	op->mask = 0;
+	op->value = 0;
+	op->data = data;
+	return op;
+}
+
+static void emitRegisterWrite(GameBoyPluginCore* self, uint8_t channel, uint8_t reg, uint8_t mask, uint8_t value, uint8_t flags = 0){
+	RegisterOp* op = emitRegisterOp(self, REG_OP_WRITE, channel, 0);
+	op->flags = flags;
+	op->reg = reg;
+	op->mask = mask;
+	op->value = value;
+}
+
+static void emitPitchWrite(GameBoyPluginCore* self, uint16_t newPitch, uint8_t channel, bool isTrigger, uint8_t soundLenEn, uint8_t flags = 0){
+	RegisterOp ops[2];
+	pitchRegisterOps(newPitch, channel, isTrigger, soundLenEn, flags, ops);
+	for (int i=0; i<2; i++){
+		ops[i].frame = self->compileState.frame;
+		self->registerOps[self->registerOpCount++] = ops[i];
+	}
+}
+
+static void logWaveSysexResult(GameBoyPluginCore* self, WaveSysexResult result){
+	switch (result) {
+		case WAVE_SYSEX_QUEUED:
+			logInfo(&(self->log), "sysex message received (sysexSize: %u). Collecting waves...", self->waves.sysexSize);
+			break;
+		case WAVE_SYSEX_TOO_SHORT:
+			logWarning(&(self->log), "Appears to be a garbage sysex. Ignoring...");
+			break;
+		default:
+			break;
+	}
+}
+
+// the most ops a single midi event compiles to
+#define MAX_OPS_PER_EVENT 3
+
+uint32_t compileMidiEvents(GameBoyPluginCore* self, midiMessage* events, uint32_t nEvents){
+	MidiFrameState* state = &(self->compileState);
+	const CCDecodeTables* tables = &(self->ccTables);
+	for (uint32_t evI=0; evI<nEvents; evI++) {
+		if (self->registerOpCount + MAX_OPS_PER_EVENT > REGISTER_OP_CAPACITY) return evI;
+		if (self->offline && waveSysexQueued(&(self->waves))) return evI; // offline, the waves of a sysex are picked up before anything after it is compiled
+		if (events[evI].frame != state->frame) {
+			// all events that happen at the same frame are handled together, so that simultaneous events (e.g. a note on and a note off) can be reordered.
+			memset(state, 0, sizeof(MidiFrameState));
+			state->frame = events[evI].frame;
+		}
+		if (events[evI].statusByte >= 0x80 && events[evI].statusByte < 0xF8 && events[evI].statusByte != 0xF7 && self->waves.sysexState != WAVE_SYSEX_IDLE) { // any status byte except real-time messages ends a sysex that is still being collected
+			logWaveSysexResult(self, endWaveSysex(&(self->waves)));
+			if (self->offline && waveSysexQueued(&(self->waves))) return evI; // compiled again once the waves are in
+		}
+		uint8_t midiMessageType = events[evI].statusByte & 0xF0; // the 4 least significant bits of the status byte contain the channel. Discard them to get just the midi event type
 		
 		uint8_t msg[3]; // The midi message has a variable length. The first byte is always the status byte.
-		msg[0] = curFrameMidiEvs[evI].statusByte;
+		msg[0] = events[evI].statusByte;
 		for (int i=1; i<3; i++){
-			if (i-1 >= curFrameMidiEvs[evI].dataBytes.size()){
+			if ((uint32_t)(i-1) >= events[evI].dataSize){
 				msg[i] = 0;
 			} else {
-				msg[i] = curFrameMidiEvs[evI].dataBytes[i-1];
+				msg[i] = events[evI].dataBytes[i-1] & 0x7F;
 			}
 		}
 		uint8_t channel=0xFF;
-		channel = (curFrameMidiEvs[evI].statusByte) & 0x0F; // https://michd.me/jottings/midi-message-format-reference/
+		channel = (events[evI].statusByte) & 0x0F; // https://michd.me/jottings/midi-message-format-reference/
 		if (channel > 3) channel=0; // NOTE: this channel value shouldn't be used for midi events that are channel-agnostic
-		// TODO: check if APU exists before running APU methods
-		// convert midi event to gb apu register write
+		// convert midi event to gb apu register ops
 		uint16_t newPitch=0;
 		bool isTrigger=false;
-		uint8_t regVal=0;
+		// if the channel was already triggered at this pos, it should remain triggered. Otherwise, midi pitch bends will never retrigger the gb channel.
+		const uint8_t triggerFlags = state->noteOffMayTrigger[channel] ? REG_OP_TRIGGER_AFTER_NOTE_OFF : 0;
 		
 		switch (midiMessageType) {
 			case 0xF0: // SYSEX
-			{
-				printf("sysex message received. Collecting waves...\n");
-				
-				const uint32_t sysexSize = curFrameMidiEvs[evI].dataBytes.size();
-				printf("sysexSize: %u\n", sysexSize);
-				if (sysexSize < 32) {
-					printf("Appears to be a garbage sysex. Ignoring...\n");
-				} else {
-					std::vector<uint8_t>& sysexData = curFrameMidiEvs[evI].dataBytes;
-				
-					for (uint16_t i=0; i<MAX_WAVES; i++){ // If I'm not resetting wave data during activate(), I need to reset it when a sysex message is received.
-						for (uint8_t i2=0; i2<16; i2++){
-							self->songWaveArray[i][i2]=0;
-						}
-					}
-					
-					bool breakImmediately=false; // I could use a goto instead, but this feels safer.
-					for (uint16_t waveI=0; waveI<MAX_WAVES; waveI++) {
-						printf("Wave %u:\n", waveI);
-						for (uint8_t samplePairI=0; samplePairI<16; samplePairI++) {
-							uint32_t samplePairFirstSysexI = ((uint32_t)waveI)*32+((uint32_t)samplePairI)*2; // index in the sysex data
-							uint32_t samplePairSecondSysexI = samplePairFirstSysexI+1;
-							if (sysexData[samplePairFirstSysexI]==0xF7 || sysexData[samplePairSecondSysexI]==0xF7 || samplePairSecondSysexI >= sysexSize) {breakImmediately=true; break;} // end of sysex
-							self->songWaveArray[waveI][samplePairI] = (sysexData[samplePairFirstSysexI] << 4) | sysexData[samplePairSecondSysexI];
-							printf("%02X ", self->songWaveArray[waveI][samplePairI]);
-						}
-						if (breakImmediately==true) break;
-						printf("\n");
-					}
-					printf("\nend of sysex\n");
-					//printf("sysexSize: %u\n", sysexSize);
+				if (events[evI].statusByte == 0xF0 || events[evI].statusByte == 0xF7) { // other system messages aren't used
+					logWaveSysexResult(self, collectWaveSysex(&(self->waves), events[evI].dataBytes, events[evI].dataSize, events[evI].statusByte == 0xF0, events[evI].sysexEnd));
 				}
-				
-			}
 				break;
 				
 			case 0xB0: // MIDI_MSG_CONTROLLER
@@ -259,69 +334,31 @@ std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMe
 				// msg[2] control value
 				switch (msg[1]){
 					case 7: // MIDI_CTL_MSB_MAIN_VOLUME
-						regVal = GB_apu_read(&(self->gb), GB_IO_NR12 + channel*5);
-						regVal &= 0b00001111; // keep envDir and envLen
-						switch (channel){
-							case 2: // wave
-								if (msg[2] >= 96) {
-									self->userVol[channel] = 0b01;
-								} else if (msg[2] >= 48) {
-									self->userVol[channel] = 0b10;
-								} else if (msg[2] > 0) {
-									self->userVol[channel] = 0b11;
-								} else {
-									// if ccVol is 0, set wav vol to 0
-									self->userVol[channel] = 0;
-								}
-								regVal |= ((self->userVol[channel]) << 5);
-								break;
-							default:
-								self->userVol[channel] = round((float)(float)(msg[2] / (float)0x7F) * (float)0x0F);
-								regVal |= (self->userVol[channel]) << 4;
-								break;
-						}
+						// keep envDir and envLen
+						self->userVol[channel] = tables->volume[channel == 2][msg[2]];
+						emitRegisterWrite(self, channel, GB_IO_NR12 + channel*5, 0xF0, channel == 2 ? self->userVol[channel] << 5 : self->userVol[channel] << 4);
 						//printf("midi vol: %u, new userVol: %u\n", msg[2], self->userVol[channel]);
-						GB_apu_write(&(self->gb), GB_IO_NR12 + channel*5, regVal);
 						break;
 					case 9: /* gb pan mute (0 0) */
 						if (msg[2] >= 64) {
-							regVal=GB_apu_read(&(self->gb), GB_IO_NR51);
-							regVal &= (uint8_t)((~(0x11 << channel)) & 0xFF); // discard only the bits currently being modified.
-							GB_apu_write(&(self->gb), GB_IO_NR51, regVal);
+							emitRegisterWrite(self, channel, GB_IO_NR51, 0x11 << channel, 0); // discard only the bits currently being modified.
 						}
 						break;
 					case 10: // MIDI_CTL_MSB_PAN
-						regVal=GB_apu_read(&(self->gb), GB_IO_NR51);
-						regVal &= (uint8_t)((~(0x11 << channel)) & 0xFF); // discard only the bits currently being modified.
-						if (msg[2] >= 96) {
-							regVal |= (0x01 << channel);
-						} else if (msg[2] >= 32) {
-							regVal |= (0x11 << channel);
-						} else { // if (msg[2] >= 0)
-							regVal |= (0x10 << channel);
-						}
-						GB_apu_write(&(self->gb), GB_IO_NR51, regVal);
+						emitRegisterWrite(self, channel, GB_IO_NR51, 0x11 << channel, tables->pan[msg[2]] << channel);
 						break;
 					case 12: /*cc12 envelope direction*/
 						if (channel!=2) {
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR12 + channel*5);
-							regVal &= 0b11110111; // keep env start vol and envLen
-							if (msg[2] >= 64) {
-								self->userEnvDirec[channel]=1;
-							} else {
-								self->userEnvDirec[channel]=0;
-							}
-							regVal |= (self->userEnvDirec[channel] << 3);
-							GB_apu_write(&(self->gb), GB_IO_NR12 + channel*5, regVal);
+							// keep env start vol and envLen
+							self->userEnvDirec[channel] = msg[2] >= 64 ? 1 : 0;
+							emitRegisterWrite(self, channel, GB_IO_NR12 + channel*5, 0b00001000, self->userEnvDirec[channel] << 3);
 						}
 						break;
 					case 13: /*cc13 envelope length*/
 						if (channel!=2) {
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR12 + channel*5);
-							regVal &= 0b11111000; // keep env start vol and envDir
-							self->userEnvLen[channel] = (uint8_t)round(((float)msg[2] / 0x7F) * 7) & 0b00000111;
-							regVal |= self->userEnvLen[channel];
-							GB_apu_write(&(self->gb), GB_IO_NR12 + channel*5, regVal);
+							// keep env start vol and envDir
+							self->userEnvLen[channel] = tables->envelopeLength[msg[2]];
+							emitRegisterWrite(self, channel, GB_IO_NR12 + channel*5, 0b00000111, self->userEnvLen[channel]);
 						}
 						break;
 					// TODO: find a gbs to TEST sound length settings.
@@ -329,112 +366,83 @@ std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMe
 					case 14: /*sound length enable*/
 					{
 						uint8_t soundLenEn = msg[2] >= 64 ? 1 : 0;
-						newPitch = midiNoteAndPitchBend2gbPitch(self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel, self->NOISE_PITCH_LIST); // pitch is write-only. rewrite pitch so it isn't lost.
-						writeNewPitchToAPU(&(self->gb), newPitch, channel, noteTriggered[channel], soundLenEn);
+						newPitch = midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel); // pitch is write-only. rewrite pitch so it isn't lost.
+						emitPitchWrite(self, newPitch, channel, state->noteTriggered[channel], soundLenEn, triggerFlags);
 					}
 						break;
 					case 15: /*sound length*/ // TODO: verify that the correct value is being written to the GB APU register; it sounds a bit short.
 					{
-						uint8_t soundLen = convertMidiValToRange(msg[2], channel == 2 ? 0xFF : 0x3F);
+						uint8_t soundLen = tables->soundLength[channel == 2][msg[2]];
 						if (channel == 2) {
-							GB_apu_write(&(self->gb), GB_IO_NR11 + channel*5, soundLen);
+							emitRegisterWrite(self, channel, GB_IO_NR11 + channel*5, 0xFF, soundLen);
 						} else {
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR11 + channel*5);
-							regVal &= 0b11000000; // preserve duty cycle.
-							regVal |= (soundLen & 0b00111111);
-							GB_apu_write(&(self->gb), GB_IO_NR11 + channel*5, regVal);
+							emitRegisterWrite(self, channel, GB_IO_NR11 + channel*5, 0b00111111, soundLen & 0b00111111); // preserve duty cycle.
 						}
 						self->userSoundLen[channel] = soundLen;
 					}
 						break;
 					case 16: // sweep speed
 						if (channel == 0){
-							uint8_t sweepSpeed = convertMidiValToRange(msg[2], 7);
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR10);
-							regVal &= 0b00001111;
-							regVal |= ((sweepSpeed & 0b111) << 4);
-							GB_apu_write(&(self->gb), GB_IO_NR10, regVal);
+							emitRegisterWrite(self, channel, GB_IO_NR10, 0b11110000, tables->sweepSpeedOrShift[msg[2]] << 4);
 						}
 						break;
 					case 17: // sweep shift
 						if (channel == 0){ // high period == high frequency == high pitch.
-							uint8_t sweepShift = convertMidiValToRange(msg[2], 7);
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR10);
-							regVal &= 0b01111000; // zero out previous sweep shift, keep all other values.
-							regVal |= (sweepShift & 0b111);
-							GB_apu_write(&(self->gb), GB_IO_NR10, regVal);
+							emitRegisterWrite(self, channel, GB_IO_NR10, 0b10000111, tables->sweepSpeedOrShift[msg[2]]); // zero out previous sweep shift, keep all other values.
 						}
 						break;
 					case 18: // sweep up or down. for readability, pitch should go up when cc18 is 127, and down when cc18 is 0
 						if (channel == 0){
-							uint8_t sweepDir = convertMidiValToRange(msg[2], 1);
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR10);
-							regVal &= 0b01110111;
-							sweepDir ^= 1; // invert sweepDir before writing to register. In GB, 0 is "increase pitch", which is unintuitive. Inverting sweepDir before writing to the emulated GB allows the user to use a CC of 127 as "increase pitch", which is more intuitive.
-							regVal |= ((sweepDir & 1) << 3);
-							GB_apu_write(&(self->gb), GB_IO_NR10, regVal);
+							emitRegisterWrite(self, channel, GB_IO_NR10, 0b10001000, tables->sweepDirection[msg[2]] << 3);
 						}
 						break;
 					case 19: // duty cycle A.K.A. pulse width
 						if (channel <= 1) { // square channels
-							uint8_t dutyCycleVal=0;
-							dutyCycleVal = (uint8_t)round(((float)msg[2] / 0x7F) * 3);
-							regVal=0;
-							regVal |= (dutyCycleVal << 6);
-							regVal |= (self->userSoundLen[channel] & 0b00111111); // sound length is write-only. Rewrite it so it isn't lost
-							GB_apu_write(&(self->gb), GB_IO_NR11 + channel*5, regVal);
+							// sound length is write-only. Rewrite it so it isn't lost
+							emitRegisterWrite(self, channel, GB_IO_NR11 + channel*5, 0xFF, (tables->duty[msg[2]] << 6) | (self->userSoundLen[channel] & 0b00111111));
 						}
 						break;
 					case 20: // noise long or short
 						if (channel == 3) {
-							regVal = GB_apu_read(&(self->gb), GB_IO_NR43); // I believe this is read/write, unlike the other pitch values
-							regVal &= 0b11110111; // remove noise width, keep pitch values.
-							uint8_t noiseWidth = msg[2] >= 64 ? 1 : 0;
-							regVal |= (noiseWidth << 3);
-							GB_apu_write(&(self->gb), GB_IO_NR43, regVal);
+							// remove noise width, keep pitch values.
+							emitRegisterWrite(self, channel, GB_IO_NR43, 0b00001000, (msg[2] >= 64 ? 1 : 0) << 3);
 						}
 						break;
 					case 21: // wave index selector. TODO: although I'm now keeping wave data after activate, which makes it possible to skip through a song, it is still not possible to play wave notes in the piano roll while playback is paused. This is because I reset the GB APU when the user pauses playback so no notes play while paused. Although wave data is saved in the plugin's memory, that data is cleared from the GB APU, and CC21 can't be sent or received while playback is paused. Maybe, in the code for handling when playback is paused, I should use curWaveIndex to rewrite the wave data to the wave channel, so the user can use the piano roll?
+					case 53:
 						// in a hexadecimal representation of a number, the MSB is the leftmost byte, the LSB is the rightmost byte
-						self->curWaveIndexMSB=msg[2];
-						cc21set=true;
-						if (cc53set){
+						if (msg[1] == 21) {
+							self->curWaveIndexMSB=msg[2];
+							state->cc21set=true;
+						} else {
+							self->curWaveIndexLSB=msg[2];
+							state->cc53set=true;
+						}
+						if (state->cc21set && state->cc53set){
 							self->curWaveIndex = ((uint16_t)(self->curWaveIndexMSB) << 7) | self->curWaveIndexLSB;
-							printf("self->curWaveIndex: %u\n", self->curWaveIndex);
-							
-							GB_apu_write(&(self->gb), GB_IO_NR30, 0); // turn off DAC
-							GB_advance_cycles(&(self->gb), 1); // TODO: check if advancing cycles here can mess up other channels.
-							for (uint8_t samplePairI=0; samplePairI<16; samplePairI++) { // write to wave ram
-								GB_apu_write(&(self->gb), GB_IO_WAV_START+samplePairI, self->songWaveArray[self->curWaveIndex][samplePairI]);
-							}
-							GB_advance_cycles(&(self->gb), 1);
-							GB_apu_write(&(self->gb), GB_IO_NR30, 0b10000000); // turn on DAC
-							GB_advance_cycles(&(self->gb), 1);
-							newPitch = midiNoteAndPitchBend2gbPitch(self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel, self->NOISE_PITCH_LIST); // pitch is write-only. rewrite pitch so it isn't lost.
-							writeNewPitchToAPU(&(self->gb), newPitch, channel, true, 0xFF); // trigger channel
-							noteTriggered[channel]=true;
+							logDebug(&(self->log), "self->curWaveIndex: %u", self->curWaveIndex);
+							emitRegisterOp(self, REG_OP_LOAD_WAVE, 2, self->curWaveIndex);
+							newPitch = midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel); // pitch is write-only. rewrite pitch so it isn't lost.
+							emitPitchWrite(self, newPitch, channel, true, 0xFF); // trigger channel
+							state->noteTriggered[channel]=true;
 						}
 						// wave should ONLY be triggered when switching waves. Triggering it at any other time will unpredictably corrupt wave ram.
 						// TODO: does wave need to be re-triggered to change the volume? My midi output suggests that it doesn't need to be re-triggered, but pandocs implies that it does: "Trigger (Write-only): Writing any value to NR34 with this bit set triggers the channel, causing the following to occur:.. ...Volume is set to contents of NR32 initial volume."
 						break;
-					case 53: // TODO: Reduce duplicate code.
-						self->curWaveIndexLSB=msg[2];
-						cc53set=true;
-						if (cc21set){
-							self->curWaveIndex = ((uint16_t)(self->curWaveIndexMSB) << 7) | self->curWaveIndexLSB;
-							//printf("self->curWaveIndex: %u\n", self->curWaveIndex);
-							
-							GB_apu_write(&(self->gb), GB_IO_NR30, 0); // turn off DAC
-							GB_advance_cycles(&(self->gb), 1); // TODO: check if advancing cycles here can mess up other channels.
-							for (uint8_t samplePairI=0; samplePairI<16; samplePairI++) { // write to wave ram
-								GB_apu_write(&(self->gb), GB_IO_WAV_START+samplePairI, self->songWaveArray[self->curWaveIndex][samplePairI]);
+					case 101: // RPN MSB
+						self->rpnMSB[channel]=msg[2];
+						break;
+					case 100: // RPN LSB
+						self->rpnLSB[channel]=msg[2];
+						break;
+					case 6: // data entry MSB
+					case 38: // data entry LSB
+						if (self->rpnMSB[channel] == 0 && self->rpnLSB[channel] == 0) { // RPN 0 is the pitch bend range, in semitones (MSB) and cents (LSB). It only affects the pitch bends sent after it.
+							if (msg[1] == 6) {
+								setPitchBendRange(self, channel, msg[2], 0);
+							} else {
+								setPitchBendRange(self, channel, self->bendRangeSemitones[channel], msg[2]);
 							}
-							GB_advance_cycles(&(self->gb), 1);
-							GB_apu_write(&(self->gb), GB_IO_NR30, 0b10000000); // turn on DAC
-							GB_advance_cycles(&(self->gb), 1);
-							newPitch = midiNoteAndPitchBend2gbPitch(self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel, self->NOISE_PITCH_LIST); // pitch is write-only. rewrite pitch so it isn't lost.
-							writeNewPitchToAPU(&(self->gb), newPitch, channel, true, 0xFF); // trigger channel
-							noteTriggered[channel]=true;
 						}
 						break;
 					case 23:{ // change GB model via midi messages.
@@ -475,47 +483,23 @@ std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMe
 								chosenModel = GB_MODEL_AGB_NATIVE;
 								break;
 						}
-						self->gb.model = chosenModel;
-						resetInternalState(self, false, false);
-						self->gb.model = chosenModel;
-						break;
+						emitRegisterOp(self, REG_OP_SET_MODEL, channel, chosenModel);
+						return evI + 1; // the reset also resets the state the following events are compiled against, so it has to be applied first
 					}
 					default:
 						break;
 				}
 				break;
 			case 0x80: // MIDI_MSG_NOTE_OFF
-				if (noteOn[channel]==false) { // This noteOn variable only tracks if a noteOn has been sent at this exact time. If a Note On and a Note Off occur at the same time on the same channel, the Note On should take priority.
+				if (state->noteOn[channel]==false) { // This noteOn variable only tracks if a noteOn has been sent at this exact time. If a Note On and a Note Off occur at the same time on the same channel, the Note On should take priority.
 					if (channel!=2) {
-						uint8_t tempReg = GB_apu_read(&(self->gb), GB_IO_NR12 + channel*5);
-						uint8_t envDirec = tempReg & 0b00001000;
-						uint8_t envLen = tempReg & 0b00000111;
-						uint8_t curVol=0xFF; // intention: current volume as set by the envelope.
-						switch(channel){
-							case 0:
-								curVol=self->gb.apu.square_channels[0].current_volume;
-								break;
-							case 1:
-								curVol=self->gb.apu.square_channels[1].current_volume;
-								break;
-							case 3:
-								curVol=self->gb.apu.noise_channel.current_volume;
-								break;
-							default:
-								break;
-						}
-						if (GB_apu_read(&(self->gb), GB_IO_NR52) & (0b00000001 << channel) && !((curVol==0 && envDirec == 0/*down*/) || (curVol==0 && envLen==0)) && self->lastMidiNote[channel] == msg[1]) { // if channel is enabled AND the current volume is greater than 0. make sure a false positive doesn't happen when a channel starts at 0 vol then goes up via envelope. Do not silence the channel if the midi note that's currently ending is different from the most recent note-on; this makes it possible to clearly disable note-offs for specific notes by having the note ends trail and overlap each other.
-							regVal = 0b00001000; // set envelope direction to "up" to silence the channel WITHOUT turning off the DAC (which could cause a pop)
-							GB_apu_write(&(self->gb), GB_IO_NR12 + channel*5, regVal);
-							newPitch = midiNoteAndPitchBend2gbPitch(self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel, self->NOISE_PITCH_LIST); // pitch is write-only. rewrite pitch so it isn't lost.
-							writeNewPitchToAPU(&(self->gb), newPitch, channel, true, 0xFF); // have to retrigger the channel for the silence to take effect.
-							noteTriggered[channel]=true;
+						if (self->lastMidiNote[channel] == msg[1]) { // Do not silence the channel if the midi note that's currently ending is different from the most recent note-on; this makes it possible to clearly disable note-offs for specific notes by having the note ends trail and overlap each other.
+							newPitch = midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel); // pitch is write-only. rewrite pitch so it isn't lost.
+							emitRegisterOp(self, REG_OP_NOTE_OFF, channel, newPitch);
+							state->noteOffMayTrigger[channel]=true;
 						}
 					} else { // wave
-						uint8_t curVol=GB_apu_read(&(self->gb), GB_IO_NR32) & 0b01100000; // exact number doesn't matter, I'm just checking if this is zero or not
-						if (GB_apu_read(&(self->gb), GB_IO_NR52) & 0b00000100 && curVol > 0) { // if channel is enabled AND the current volume is greater than 0.
-							GB_apu_write(&(self->gb), GB_IO_NR32, 0); // set volume to 0
-						} 
+						emitRegisterOp(self, REG_OP_NOTE_OFF, channel, 0);
 					}
 				}
 				break;
@@ -524,48 +508,30 @@ std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMe
 				//printf("Midi channel %u: note %u on.\n", channel, msg[1] & 0x7F);
 				// "This time field [ev->time] is a timestamp, but not in real-world time units (like seconds or milliseconds). Instead, it's measured in frames relative to the start of the current audio block."
 				
-				noteOn[channel]=true;
+				state->noteOn[channel]=true;
 				
 				// check if the envelope values were changed by a note off. If it was, use self->userVol etc to set it back to the user's selected env values.
 				if (channel != 2) {
-					regVal = GB_apu_read(&(self->gb), GB_IO_NR12 + channel*5);
-					uint8_t tempVol = (regVal & 0xF0) >> 4;
-					uint8_t tempEnvDirec = (regVal & 8) >> 3;
-					uint8_t tempEnvLen = (regVal & 7);
-					//printf("tempVol: %u\n", tempVol);
-					if (/*tempVol == 0 &&*/ tempVol != self->userVol[channel] || tempEnvDirec != self->userEnvDirec[channel] || tempEnvLen != self->userEnvLen[channel]){ // I think this will be set because it's being written on the same frame as the note being triggered. (if the note is being triggered)
-						regVal = 0; // make absolutely sure there's no stray bits.
-						regVal |= (self->userVol[channel]) << 4;
-						regVal |= (self->userEnvDirec[channel] << 3);
-						regVal |= (self->userEnvLen[channel] & 7);
-						GB_apu_write(&(self->gb), GB_IO_NR12 + channel*5, regVal);
-						//printf("set vol to %u\n", self->userVol[channel]);
-					}
+					emitRegisterWrite(self, channel, GB_IO_NR12 + channel*5, 0xFF, (self->userVol[channel] << 4) | (self->userEnvDirec[channel] << 3) | (self->userEnvLen[channel] & 7), REG_OP_ONLY_IF_CHANGED);
 				} else {
-					uint8_t tempVol = (GB_apu_read(&(self->gb), GB_IO_NR32) & 0b01100000) >> 5;
-					if (tempVol != self->userVol[channel]){
-						regVal = self->userVol[channel] << 5;
-						GB_apu_write(&(self->gb), GB_IO_NR32, regVal);
-					}
+					emitRegisterWrite(self, channel, GB_IO_NR32, 0xFF, self->userVol[channel] << 5, REG_OP_ONLY_IF_CHANGED);
 				}
 				
 				// play note
 				uint8_t velocity = msg[2];
-				if (velocity >= 64){isTrigger=true; noteTriggered[channel] = channel == 2 ? false : true;}
-				newPitch = midiNoteAndPitchBend2gbPitch(msg[1] & 0x7F, self->lastMidiPitchBend[channel], channel, self->NOISE_PITCH_LIST);
-				writeNewPitchToAPU(&(self->gb), newPitch, channel, channel==2 ? false : isTrigger, 0xFF);
+				if (velocity >= 64){isTrigger=true; state->noteTriggered[channel] = channel == 2 ? false : true;}
+				newPitch = midiNoteAndPitchBend2gbPitch(self, msg[1], self->lastMidiPitchBend[channel], channel);
+				emitPitchWrite(self, newPitch, channel, channel==2 ? false : isTrigger, 0xFF);
 				
-				self->lastMidiNote[channel] = msg[1] & 0x7F;
+				self->lastMidiNote[channel] = msg[1];
 				break;
 			}
 			case 0xE0: // MIDI_MSG_PITCH
 				if (channel!=3) {
-					uint16_t midiPitchBend = (((uint16_t)msg[2] & 0x7F)<<7) | (msg[1] & 0x7F);
+					uint16_t midiPitchBend = ((uint16_t)msg[2]<<7) | msg[1];
 					//printf("Midi channel %u: pitch %04X\n", channel, midiPitchBend);
-					newPitch = midiNoteAndPitchBend2gbPitch(self->lastMidiNote[channel], midiPitchBend, channel, self->NOISE_PITCH_LIST);
-					// if the channel was already triggered at this pos, it should remain triggered. Otherwise, midi pitch bends will never retrigger the gb channel.
-					if (noteTriggered[channel]) isTrigger=true;
-					writeNewPitchToAPU(&(self->gb), newPitch, channel, isTrigger, 0xFF);
+					newPitch = midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[channel], midiPitchBend, channel);
+					emitPitchWrite(self, newPitch, channel, state->noteTriggered[channel], 0xFF, triggerFlags);
 					self->lastMidiPitchBend[channel] = midiPitchBend;
 				}
 				break;
@@ -573,11 +539,268 @@ std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMe
 				break;
 		}
 	}
-	
-	// run the emulator for one audio frame, then send the output to the DAW
-	GB_advance_cycles(&(self->gb), (uint8_t)(self->gb.apu_output.cycles_per_sample / 2)); // gb.apu_output.cycles_per_sample is doubled from what I expected it to be. Probably something to do with the word "sample" sometimes refering to an audio frame with left and right, and sometimes refering to a single sample from either the left OR right channel.
-	// asssuming that Audio samples are normalized between -1.0 and 1.0
-	float outputL = (float)((self->gb.apu_output.final_sample.left)) / (float)32768;
-	float outputR = (float)((self->gb.apu_output.final_sample.right)) / (float)32768;
-	return std::make_pair(outputL, outputR);
+	return nEvents;
+}
+
+static void applyRegisterWrite(GameBoyPluginCore* self, const RegisterOp* op){
+	const uint8_t oldValue = readAPURegister(self, op->reg);
+	uint8_t value = (oldValue & ~op->mask) | op->value;
+	if ((op->flags & REG_OP_TRIGGER_AFTER_NOTE_OFF) && self->noteOffTriggered[op->channel]) value |= 0b10000000;
+	if ((op->flags & REG_OP_ONLY_IF_CHANGED) && value == oldValue) return;
+	queueAPUWrite(self, op->reg, value);
+}
+
+// applies the register ops of one frame to the APU.
+static void applyRegisterOps(GameBoyPluginCore* self, const RegisterOp* ops, uint32_t nOps){
+	if (ops[0].frame != self->applyFrame) {
+		self->applyFrame = ops[0].frame;
+		memset(self->noteOffTriggered, 0, sizeof(self->noteOffTriggered));
+	}
+	for (uint32_t opI=0; opI<nOps; opI++){
+		const RegisterOp* op = &ops[opI];
+		const uint8_t channel = op->channel;
+		switch (op->type){
+			case REG_OP_WRITE:
+				applyRegisterWrite(self, op);
+				break;
+			case REG_OP_NOTE_OFF:
+				flushAPUWrites(self); // whether the channel is still playing, and at what volume, can only be known from the emulator
+				if (channel!=2) {
+					uint8_t tempReg = readAPURegister(self, GB_IO_NR12 + channel*5);
+					uint8_t envDirec = tempReg & 0b00001000;
+					uint8_t envLen = tempReg & 0b00000111;
+					uint8_t curVol=0xFF; // intention: current volume as set by the envelope.
+					switch(channel){
+						case 0:
+							curVol=self->gb.apu.square_channels[0].current_volume;
+							break;
+						case 1:
+							curVol=self->gb.apu.square_channels[1].current_volume;
+							break;
+						case 3:
+							curVol=self->gb.apu.noise_channel.current_volume;
+							break;
+						default:
+							break;
+					}
+					if (self->gb.apu.is_active[channel] && !((curVol==0 && envDirec == 0/*down*/) || (curVol==0 && envLen==0))) { // if channel is enabled AND the current volume is greater than 0. make sure a false positive doesn't happen when a channel starts at 0 vol then goes up via envelope.
+						queueAPUWrite(self, GB_IO_NR12 + channel*5, 0b00001000); // set envelope direction to "up" to silence the channel WITHOUT turning off the DAC (which could cause a pop)
+						RegisterOp pitchOps[2];
+						pitchRegisterOps(op->data, channel, true, 0xFF, 0, pitchOps); // have to retrigger the channel for the silence to take effect.
+						applyRegisterWrite(self, &pitchOps[0]);
+						applyRegisterWrite(self, &pitchOps[1]);
+						self->noteOffTriggered[channel]=true;
+					}
+				} else { // wave
+					uint8_t curVol=readAPURegister(self, GB_IO_NR32) & 0b01100000; // exact number doesn't matter, I'm just checking if this is zero or not
+					if (self->gb.apu.is_active[2] && curVol > 0) { // if channel is enabled AND the current volume is greater than 0.
+						queueAPUWrite(self, GB_IO_NR32, 0); // set volume to 0
+					}
+				}
+				break;
+			case REG_OP_LOAD_WAVE:
+				flushAPUWrites(self); // writes before the wave load stay before it
+				{
+					const DecodedWave* wave = getWave(&(self->waves), op->data);
+					GB_apu_load_wave(&(self->gb), wave->waveRAM, wave->samples); // turns the DAC off, replaces wave RAM and turns the DAC back on
+					memcpy(self->shadowRegisters + (GB_IO_WAV_START - GB_IO_NR10), wave->waveRAM, 16);
+					self->shadowRegisters[GB_IO_NR30 - GB_IO_NR10] = 0b10000000;
+				}
+				if (waveBankSwapPending(&(self->waves))) self->waveLoadedFromOldBank = true;
+				GB_advance_cycles(&(self->gb), 3); // the time the separate writes used to be spread over, so that everything after the load happens when it did before
+				break;
+			case REG_OP_SET_MODEL:
+				if (self->powerOn == nullptr || getPowerOnState(self->powerOn, (GB_model_t)op->data) == nullptr) { // without a snapshot the reset would have to settle the emulator right here, which is far too slow for the audio thread
+					logWarning(&(self->log), "no power-on snapshot for model 0x%X, keeping the current model", op->data);
+					break;
+				}
+				self->gb.model = (GB_model_t)op->data;
+				resetInternalState(self, false, false); // copies the new model's snapshot, which already runs the APU code compiled for it
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+// runs the emulator across a span of frames that contains no midi events, writing the output straight into the DAW's buffers.
+#if INTERNAL_SAMPLE_RATE
+static void renderFrames(GameBoyPluginCore* self, float* outputL, float* outputR, uint32_t frameCount){
+	// The APU renders at INTERNAL_SAMPLE_RATE, and the resampler asks for exactly as many internal samples as the DAW frames need, so the emulator never runs ahead of the output.
+	if (self->gb.apu_output.sample_rate == 0 || self->resampler.filter == nullptr) {
+		memset(outputL, 0, frameCount * sizeof(float));
+		memset(outputR, 0, frameCount * sizeof(float));
+		return;
+	}
+	while (frameCount > 0){
+		if (self->queuedWrites > 0) flushAPUWrites(self); // the writes are only made once the emulator runs on, so a frame whose ops are applied in several goes still writes each register once
+		if (self->idle) {
+			memset(outputL, 0, frameCount * sizeof(float));
+			memset(outputR, 0, frameCount * sizeof(float));
+			return;
+		}
+		const uint32_t chunk = frameCount < self->resampler.maxOutputFrames ? frameCount : self->resampler.maxOutputFrames;
+		const uint32_t needed = resamplerInputNeeded(&(self->resampler), chunk);
+		GB_run_samples_float(&(self->gb), self->internalBuffer[0], self->internalBuffer[1], needed);
+		resamplerProcess(&(self->resampler), self->internalBuffer[0], self->internalBuffer[1], needed, outputL, outputR, chunk);
+		outputL += chunk;
+		outputR += chunk;
+		frameCount -= chunk;
+		self->idle = GB_apu_is_idle(&(self->gb)) && resamplerIsSilent(&(self->resampler), 1.0f / 32768); // the same threshold the core uses
+	}
+}
+#else
+static void renderFrames(GameBoyPluginCore* self, float* outputL, float* outputR, uint32_t frameCount){
+	// The core keeps track of the fractional number of cycles per frame, so rendering frameCount frames advances the emulator by exactly the right amount of time.
+	// The core writes normalized floats straight into the DAW's buffers.
+	while (frameCount > 0){
+		if (self->queuedWrites > 0) flushAPUWrites(self);
+		if (self->idle) {
+			memset(outputL, 0, frameCount * sizeof(float));
+			memset(outputR, 0, frameCount * sizeof(float));
+			return;
+		}
+		const uint32_t chunk = frameCount < GB_APU_BLOCK_SIZE ? frameCount : GB_APU_BLOCK_SIZE;
+		GB_run_samples_float(&(self->gb), outputL, outputR, chunk);
+		outputL += chunk;
+		outputR += chunk;
+		frameCount -= chunk;
+		self->idle = GB_apu_is_idle(&(self->gb));
+	}
+}
+#endif
+
+// switches to a newly parsed wave bank, if there is one. Offline, a queued sysex is parsed right here first.
+static void pickUpNewWaveBank(GameBoyPluginCore* self, uint32_t frame){
+	if (self->offline && waveSysexQueued(&(self->waves))) finishWaveBankWork(&(self->waves));
+	if (!pickUpWaveBank(&(self->waves))) return;
+	logInfo(&(self->log), "new wave bank: %u waves", self->waves.current->bank->waveCount);
+	if (self->waveLoadedFromOldBank && !waveBankSwapPending(&(self->waves))) {
+		// the song selected a wave while its bank was being parsed, so the old bank's wave was used. Select it again, the same way CC21 and CC53 do.
+		self->waveLoadedFromOldBank = false;
+		RegisterOp ops[3];
+		memset(ops, 0, sizeof(ops));
+		ops[0].type = REG_OP_LOAD_WAVE;
+		ops[0].channel = 2;
+		ops[0].data = self->curWaveIndex;
+		pitchRegisterOps(midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[2], self->lastMidiPitchBend[2], 2), 2, true, 0xFF, 0, &ops[1]);
+		for (int i=0; i<3; i++) ops[i].frame = frame;
+		self->idle = false;
+		applyRegisterOps(self, ops, 3);
+	}
+}
+
+// renders nFrames frames, applying the events at their frames. Events at frame nFrames are applied as well, without rendering that frame, so that a frame with more events than the buffer holds can be handled in pieces. continuesFrame is set when the first events belong to the frame the last call ended on, so that they are still handled together with that frame's earlier events.
+static void processEvents(GameBoyPluginCore* self, midiMessage* events, uint32_t nEvents, float* outputL, float* outputR, uint32_t nFrames, bool continuesFrame){
+	while (nEvents > 0 && events[nEvents-1].frame > nFrames) nEvents--; // events past the end of the block are never handled
+	if (!continuesFrame) {
+		self->compileState.frame = UINT32_MAX;
+		self->applyFrame = UINT32_MAX;
+	}
+	pickUpNewWaveBank(self, 0);
+	uint32_t curFrame=0;
+	uint32_t evI=0;
+	while (evI < nEvents) {
+		if (self->offline && waveSysexQueued(&(self->waves))) pickUpNewWaveBank(self, curFrame); // a sysex ended in the last pass, which stopped compiling right after it
+		self->registerOpCount = 0;
+		evI += compileMidiEvents(self, &events[evI], nEvents - evI);
+		uint32_t opI=0;
+		while (opI < self->registerOpCount) {
+			const uint32_t opFrame = self->registerOps[opI].frame;
+			if (opFrame > curFrame) { // render up to the next op
+				renderFrames(self, outputL + curFrame, outputR + curFrame, opFrame - curFrame);
+				curFrame = opFrame;
+			}
+			uint32_t frameEndOpI = opI;
+			while (frameEndOpI < self->registerOpCount && self->registerOps[frameEndOpI].frame == opFrame) frameEndOpI++;
+			self->idle = false; // any op can make the APU audible again, so emulation resumes exactly where it stopped.
+			applyRegisterOps(self, &(self->registerOps[opI]), frameEndOpI - opI);
+			opI = frameEndOpI;
+		}
+	}
+	renderFrames(self, outputL + curFrame, outputR + curFrame, nFrames - curFrame);
+}
+
+// process function. This is run once per audio block. All of the block's midi events are compiled into register ops first, then the ops are applied at their frames. The block is only split at the frames where ops happen; everything in between is rendered in one go.
+void processBlock(GameBoyPluginCore* self, midiMessage* events, uint32_t nEvents, float* outputL, float* outputR, uint32_t nFrames){
+	while (nEvents > 0 && events[nEvents-1].frame >= nFrames) nEvents--;
+	processEvents(self, events, nEvents, outputL, outputR, nFrames, false);
+}
+
+// the transport has stopped. Every channel is silenced the same way a note off silences it, and the rest of the state (wave RAM, the user's settings, the current notes) is kept, so that notes played on the piano roll while stopped sound like they do in the song. Once the silenced channels have died away, the output goes idle and the APU stops running until the next midi event.
+void parkPlayback(GameBoyPluginCore* self){
+	RegisterOp ops[4];
+	memset(ops, 0, sizeof(ops));
+	for (uint8_t channel=0; channel<4; channel++){
+		ops[channel].type = REG_OP_NOTE_OFF;
+		ops[channel].channel = channel;
+		ops[channel].data = midiNoteAndPitchBend2gbPitch(self, self->lastMidiNote[channel], self->lastMidiPitchBend[channel], channel);
+	}
+	self->applyFrame = UINT32_MAX;
+	self->idle = false;
+	applyRegisterOps(self, ops, 4);
+	logInfo(&(self->log), "playback parked");
+}
+
+bool midiEventBufferInit(MidiEventBuffer* buffer, uint32_t capacity){
+	buffer->events = (midiMessage*)malloc(capacity * sizeof(midiMessage));
+	buffer->capacity = buffer->events ? capacity : 0;
+	buffer->count = 0;
+	buffer->blockFrames = 0;
+	buffer->startFrame = 0;
+	buffer->continuesFrame = false;
+	return buffer->events != nullptr;
+}
+
+void midiEventBufferFree(MidiEventBuffer* buffer){
+	free(buffer->events);
+	buffer->events = nullptr;
+	buffer->capacity = 0;
+}
+
+void startMidiEventBlock(MidiEventBuffer* buffer, uint32_t nFrames){
+	buffer->count = 0;
+	buffer->blockFrames = nFrames;
+	buffer->startFrame = 0;
+	buffer->continuesFrame = false;
+}
+
+midiMessage* addMidiEvent(GameBoyPluginCore* self, MidiEventBuffer* buffer, uint32_t frame, float* outputL, float* outputR){
+	if (buffer->count == buffer->capacity) {
+		// render up to the last frame that has stored events, and keep that frame's events so that they are still handled together with the new one.
+		const uint32_t lastFrame = buffer->events[buffer->count - 1].frame;
+		uint32_t keptEvI = buffer->count;
+		while (keptEvI > 0 && buffer->events[keptEvI - 1].frame == lastFrame) keptEvI--;
+		uint32_t spanFrames = lastFrame;
+		if (buffer->startFrame + spanFrames > buffer->blockFrames) spanFrames = buffer->blockFrames - buffer->startFrame;
+		// a single frame has more events than fit. They are applied without rendering the frame, and the events after them continue the same frame, so nothing about their order changes.
+		const bool splitsFrame = keptEvI == 0 && spanFrames == lastFrame;
+		if (keptEvI == 0) keptEvI = buffer->count;
+		processEvents(self, buffer->events, keptEvI, outputL + buffer->startFrame, outputR + buffer->startFrame, spanFrames, buffer->continuesFrame);
+		if (splitsFrame) { // the split frame is frame 0 of what is left of the block
+			self->compileState.frame = 0;
+			self->applyFrame = self->applyFrame == spanFrames ? 0 : UINT32_MAX;
+		}
+		buffer->continuesFrame = splitsFrame;
+		buffer->startFrame += spanFrames;
+		buffer->count -= keptEvI;
+		for (uint32_t evI=0; evI<buffer->count; evI++){
+			buffer->events[evI] = buffer->events[keptEvI + evI];
+			buffer->events[evI].frame -= spanFrames;
+		}
+	}
+	midiMessage* newEv = &(buffer->events[buffer->count++]);
+	newEv->frame = frame > buffer->startFrame ? frame - buffer->startFrame : 0;
+	newEv->statusByte = 0;
+	newEv->dataBytes = nullptr;
+	newEv->dataSize = 0;
+	newEv->sysexEnd = false;
+	return newEv;
+}
+
+void finishMidiEventBlock(GameBoyPluginCore* self, MidiEventBuffer* buffer, float* outputL, float* outputR){
+	const uint32_t spanFrames = buffer->blockFrames - buffer->startFrame;
+	while (buffer->count > 0 && buffer->events[buffer->count - 1].frame >= spanFrames) buffer->count--; // events past the end of the block are never handled
+	processEvents(self, buffer->events, buffer->count, outputL + buffer->startFrame, outputR + buffer->startFrame, spanFrames, buffer->continuesFrame);
+	buffer->count = 0;
 }
@@ -5,21 +5,70 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
-#include <vector>
-#include <utility>
 #include "gb.h"
 #include "gb_struct_def.h"
 #include "apu.h"
 #include "timing.h"
+#include "resampler.hpp"
+#include "log-ring.hpp"
+#include "wave-bank.hpp"
+#include "power-on.hpp"
 
 #define GB_CLOCK_RATE 0x400000 // cycles per second
-#define MAX_WAVES 0x3FFF
+#ifndef INTERNAL_SAMPLE_RATE
+#define INTERNAL_SAMPLE_RATE 262144 // the APU always renders at this rate, and the output is resampled to the DAW's sample rate. 0 makes the APU render at the DAW's sample rate directly.
+#endif
+#define APU_REGISTER_COUNT (GB_IO_WAV_END - GB_IO_NR10 + 1) // NR10 to the end of wave RAM
+#define APU_WRITE_QUEUE_SIZE 64
+#define REGISTER_OP_CAPACITY 256 // a block with more midi events than fit is compiled and applied in several passes
+
+// what a CC value is written to the APU as, indexed by the CC value. Built once, so that decoding a CC is a lookup instead of float math.
+struct CCDecodeTables {
+	uint8_t volume[2][128]; // [0] is the 4-bit volume of the square and noise channels, [1] is the wave channel's 2-bit volume code
+	uint8_t soundLength[2][128]; // [0] for the square and noise channels, [1] for the wave channel
+	uint8_t envelopeLength[128];
+	uint8_t sweepSpeedOrShift[128];
+	uint8_t sweepDirection[128]; // already inverted to the GB's meaning
+	uint8_t duty[128];
+	uint8_t pan[128]; // NR51 bits of channel 1. Shifted left by the channel number for the others
+};
+
+enum RegisterOpType : uint8_t {
+	REG_OP_WRITE, // replaces the bits of reg selected by mask with value
+	REG_OP_NOTE_OFF, // silences the channel if it is still playing, retriggering it with pitch `data`
+	REG_OP_LOAD_WAVE, // turns off the wave channel's DAC, loads wave `data` into wave RAM and turns the DAC back on
+	REG_OP_SET_MODEL, // resets the emulator as model `data`
+};
+#define REG_OP_ONLY_IF_CHANGED 1 // the write is skipped if it wouldn't change the register
+#define REG_OP_TRIGGER_AFTER_NOTE_OFF 2 // the trigger bit is set if a note off retriggered the channel earlier in the same frame
+
+// midi events are compiled into these before the emulator runs. Only the parts that depend on the emulator's state (whether a note off still has something to silence) are decided when they are applied.
+struct RegisterOp {
+	uint32_t frame; // relative to the start of the block
+	uint8_t type;
+	uint8_t flags;
+	uint8_t channel;
+	uint8_t reg;
+	uint8_t mask;
+	uint8_t value;
+	uint16_t data;
+};
+
+struct MidiFrameState { // what the midi events handled so far at one frame did. These exist to make sure that simultaneous events don't accidently overwrite each other.
+	uint32_t frame; // UINT32_MAX before the first event of a block
+	bool noteOn[4]; // a note on was sent at this position
+	bool noteTriggered[4];
+	bool noteOffMayTrigger[4]; // a note off at this position retriggers the channel if it is still playing when the note off is applied
+	bool cc21set;
+	bool cc53set;
+};
+
 struct GameBoyPluginCore { // The part of the plugin that is standard agnostic
 	GB_gameboy_t gb;
 	double sampleRate;
-	uint8_t NOISE_PITCH_LIST[127];
-	uint8_t songWaveArray[MAX_WAVES][16]; // all wave data to be used by the song should be stored in a sysex message at the beginning. During the `run` method, if a sysex message is found, the plugin will take the sysex message, parse it as an array of wavetables, and store the result in this songWaveArray variable. Every time a CC21 message is detected, the plugin will use songWaveArray to write the correct wave to the APU. NOTE: the max number of waves is bottlenecked by CC21 which sets the index of the current wave to use; a CC can only go from 0-127, so there can be no more than 127 waves (and, even with garbage wave data, it is unlikely that a single song would have that many waves). TODO: if a song uses a musical sample (e.g. Pokemon Yellow samples pikachu voice clips. Music might sample drum sounds), is a max of 127 waves still enough? if not, I can always use two CC to create a 14-bit wave index selector.
-	// to save space in memory, waves will be stored in the same format as gb: 32 samples long, with two 4-bit samples stored in each byte. However, the sysex message should store each 4-bit sample in its own byte, or else a wave containing the samples 0x0F and 0x07 right next to each other will be confused for the sysex end byte 0xF7.
+	CCDecodeTables ccTables;
+	WaveBankExchange waves; // all wave data to be used by the song should be stored in a sysex message at the beginning. If a sysex message is found, it is parsed as an array of wavetables by a background thread, and the result replaces the current bank at the start of a later block. Every time a CC21 message is detected, the plugin will use the current bank to write the correct wave to the APU. NOTE: the max number of waves is bottlenecked by CC21 and CC53, which set the 14-bit index of the current wave to use.
+	bool waveLoadedFromOldBank; // a wave was loaded while a new bank was still being parsed. The wave is loaded again once the new bank arrives.
 	uint16_t curWaveIndex; // initialize this to 0
 	uint8_t curWaveIndexLSB;
 	uint8_t curWaveIndexMSB;
@@ -31,22 +80,81 @@ struct GameBoyPluginCore { // The part of the plugin that is standard agnostic
 	uint8_t userSoundLen[4];
 	uint8_t lastMidiNote[4];
 	uint16_t lastMidiPitchBend[4]; // 14-bit value
-	//type curMidiPitchBendRange; // defaults to a range of 2 semitones above and below (total of 4).
+	uint8_t rpnMSB[4]; // the registered parameter selected by CC101 and CC100. 0x7F when none is.
+	uint8_t rpnLSB[4];
+	uint8_t bendRangeSemitones[4]; // set by RPN 0. Defaults to a range of 2 semitones above and below (total of 4).
+	uint8_t bendRangeCents[4];
+	int32_t bendRange[4]; // the same range in 1/4096ths of a semitone, the unit pitches are looked up in
+	
+	const PowerOnSnapshots* powerOn; // what resets copy the emulator from. Shared with other instances running at the same sample rate.
 	
 	//user-visible parameters
 	GB_model_t curModel; // Whether the plugin is emulating original DMG Game Boy, Game Boy Color, Super Game Boy, Super Game Boy 2, Game Boy Advance, etc
+	
+	// APU register writes made while handling the midi events of one frame are queued, and a write to a register that already has one queued replaces it instead of reaching the APU twice. The queue is committed before the emulator runs or is asked about its state.
+	uint8_t shadowRegisters[APU_REGISTER_COUNT]; // every APU register as last written by the plugin, including queued writes. Registers are read from here, so write-only bits never come back as garbage.
+	uint8_t queuedRegisters[APU_WRITE_QUEUE_SIZE];
+	uint8_t queuedValues[APU_WRITE_QUEUE_SIZE];
+	uint8_t queuedWrites;
+	uint8_t queuePosition[APU_REGISTER_COUNT]; // where each register's queued write is, or 0xFF if the register has none that a new write can replace
+	
+	RegisterOp registerOps[REGISTER_OP_CAPACITY]; // the compiled midi events of the current block (or pass)
+	uint32_t registerOpCount;
+	MidiFrameState compileState; // updated as events are compiled
+	uint32_t applyFrame; // the frame whose ops are being applied, UINT32_MAX before the first one of a block
+	bool noteOffTriggered[4]; // a note off applied at applyFrame retriggered the channel
+	
+	bool offline; // the host is rendering faster than realtime. Only touched by the audio thread; each plugin standard copies it in before processing. Waves are then parsed on the audio thread as soon as their sysex ends, so that the render comes out the same every time.
+	
+	bool idle; // the APU's output is silent and will stay that way until the next midi event, so the APU is not run until then.
+	
+	LogRing log; // messages from the audio thread. The code for each plugin standard prints them from a thread that is allowed to block.
+	
+	PolyphaseResampler resampler; // only used when INTERNAL_SAMPLE_RATE is not 0
+	float internalBuffer[2][RESAMPLER_MAX_INPUT]; // APU output at INTERNAL_SAMPLE_RATE, before resampling
 };
 
 // helper functions of gb plugin
+// resets the emulator to the power on state of its current model. A rate other than 0 is the DAW's new sample rate, and looks up the power on snapshots and the resampler filter for it, computing them if no instance has them yet, so it must not be given on the audio thread.
 void resetInternalState(GameBoyPluginCore* self, double rate, bool isInstantiate = false /*only used by lv2 currently*/);
 
-void setUpNoisePitchList(GameBoyPluginCore* self);
+void setUpCCDecodeTables(GameBoyPluginCore* self);
 // gb helper functions end
 
+#define MIN_MIDI_EVENT_CAPACITY 256 // the least number of midi events each plugin standard preallocates room for per block
+
 struct midiMessage { // the code for specific plugin standards should convert their midi format to this generic midi format
-	uint8_t statusByte;
-	std::vector<uint8_t> dataBytes;
+	uint32_t frame; // when the event happens, in frames relative to the start of the current audio block.
+	uint8_t statusByte; // 0xF0 for a sysex, and 0xF7 for a later piece of a sysex that the host split into several events
+	const uint8_t* dataBytes; // points into the host's event, so nothing is copied. Only valid until the end of the block.
+	uint32_t dataSize; // not counting the status byte, or a sysex's end byte
+	bool sysexEnd; // this piece of a sysex contained the end byte
 };
 
-// process function. This is run for each frame in the current audio block. Hopefully this works with most plugin standards
-std::pair<float, float> processFrame(GameBoyPluginCore* self, std::vector<midiMessage>& curFrameMidiEvs);
+// preallocated storage for the midi events of one block, filled by the code for a specific plugin standard. When more events arrive than fit, the part of the block before them is rendered to make room, so a block can have any number of events.
+struct MidiEventBuffer {
+	midiMessage* events;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t blockFrames;
+	uint32_t startFrame; // frames of the block before this have already been rendered. The stored events' frames are relative to it.
+	bool continuesFrame; // the stored events at frame 0 belong to a frame whose first events were already handled, because there were more of them than fit
+};
+
+// allocates the storage. Returns false if that failed. Not for the audio thread.
+bool midiEventBufferInit(MidiEventBuffer* buffer, uint32_t capacity);
+void midiEventBufferFree(MidiEventBuffer* buffer);
+// events must be added in chronological order, between startMidiEventBlock and finishMidiEventBlock. addMidiEvent returns the message to fill in, with its frame already set.
+void startMidiEventBlock(MidiEventBuffer* buffer, uint32_t nFrames);
+midiMessage* addMidiEvent(GameBoyPluginCore* self, MidiEventBuffer* buffer, uint32_t frame, float* outputL, float* outputR);
+// renders the rest of the block
+void finishMidiEventBlock(GameBoyPluginCore* self, MidiEventBuffer* buffer, float* outputL, float* outputR);
+
+// turns midi events into register ops, appending to self->registerOps. Returns how many events were compiled, which is less than nEvents if the ops ran out of room, a model change has to wait for the ops before it to be applied, or (offline) a sysex's waves have to be picked up before the events after it. Doesn't touch the emulator, so it can be run (and timed) on its own.
+uint32_t compileMidiEvents(GameBoyPluginCore* self, midiMessage* events, uint32_t nEvents);
+
+// audio thread. Silences every channel when the transport stops, keeping everything else. Much cheaper than resetInternalState, which would also clear wave RAM. Playback and auditioning simply continue with the next midi event.
+void parkPlayback(GameBoyPluginCore* self);
+
+// process function. This is run once per audio block. A wave bank that has finished parsing is picked up at the start, or offline, right after the sysex it was parsed from. events must be sorted by frame. Hopefully this works with most plugin standards
+void processBlock(GameBoyPluginCore* self, midiMessage* events, uint32_t nEvents, float* outputL, float* outputR, uint32_t nFrames);
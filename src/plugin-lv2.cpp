@@ -12,11 +12,15 @@
 #include <lv2/midi/midi.h>
 #include <lv2/urid/urid.h> // need this to map URIDs to integers, which I need in order to determine if an event is a midi event
 #include <lv2/time/time.h>
+#include <lv2/worker/worker.h> // the worker thread prints the log and parses waves, since the audio thread must not block
+#include <lv2/patch/patch.h> // the host sets the wave bank file with a patch:Set message
+#include <lv2/state/state.h> // the wave bank file is saved with the project
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h> // printf. NOTE to self: to view output, start reaper from the terminal.
 #include <math.h> // round
+#include <string.h>
 #include "gb.h"
 #include "gb_struct_def.h"
 #include "apu.h"
@@ -24,6 +28,8 @@
 #include "plugin-core.hpp"
 
 #define GAMEBOY_URI "https://github.com/Thysbelon/Nelly-GB-synth"
+#define WAVE_BANK_URI GAMEBOY_URI "#waveBank"
+#define MIDI_EVENT_CAPACITY 1024 // events stored per piece of a block. Blocks with more are handled in several pieces.
 
 typedef struct { // only including these because they may improve performance
 	LV2_URID atom_Path;
@@ -33,6 +39,11 @@ typedef struct { // only including these because they may improve performance
 	//LV2_URID midi_Event;
 } GameBoyPluginURIs;
 
+struct LoadWaveBankFileWork { // what run sends to the worker to load a wave bank file
+	uint32_t workType;
+	char path[MAX_WAVE_BANK_PATH];
+};
+
 typedef struct {
 	GameBoyPluginCore core; // The part of the plugin that is standard agnostic
 	float prevSpeed;
@@ -40,6 +51,7 @@ typedef struct {
 	float* outputRight;
 	const LV2_Atom_Sequence* inMidi;
 	const LV2_Atom_Sequence* inTime;
+	const float* freeWheeling; // 1 while the host renders faster than realtime. nullptr if the host left the port unconnected
 	
 	LV2_URID_Map* map;
 	LV2_URID midi_Event;
@@ -47,10 +59,27 @@ typedef struct {
 	LV2_URID time_Position;
 	LV2_URID atom_Object;
 	LV2_URID atom_Float;
+	LV2_URID patch_Set;
+	LV2_URID patch_property;
+	LV2_URID patch_value;
+	LV2_URID waveBank; // the parameter holding the path of the wave bank file
 	
 	GameBoyPluginURIs uris;
+	
+	MidiEventBuffer midiEvents; // allocated in instantiate, so that run never allocates
+	
+	LV2_Worker_Schedule* schedule; // required. The wave banks are parsed and the log is printed on its thread, never in run.
+	bool logDrainScheduled; // only touched by the audio thread
+	bool waveWorkScheduled; // same
+	LoadWaveBankFileWork loadWork; // same. Kept here so that run doesn't need room for a whole path on its stack
 } GameBoyPlugin;
 
+enum WorkType : uint32_t { // the message sent to the worker thread
+	WORK_DRAIN_LOG,
+	WORK_WAVE_BANK, // parse queued waves and free replaced ones
+	WORK_LOAD_WAVE_BANK_FILE, // followed by the file's NUL-terminated path
+};
+
 static LV2_Handle instantiate(const LV2_Descriptor*     descriptor,
             double                    rate, // DAW sample rate
             const char*               bundle_path,
@@ -59,7 +88,15 @@ static LV2_Handle instantiate(const LV2_Descriptor*     descriptor,
 	resetInternalState(&(self->core), rate, true);
 	self->prevSpeed = 0;
 	
-	setUpNoisePitchList(&(self->core));
+	setUpCCDecodeTables(&(self->core));
+	if (!midiEventBufferInit(&(self->midiEvents), MIDI_EVENT_CAPACITY) || !waveBankExchangeInit(&(self->core.waves))) {
+		midiEventBufferFree(&(self->midiEvents));
+		waveBankExchangeFree(&(self->core.waves));
+		releasePowerOnSnapshots(self->core.powerOn);
+		resamplerFree(&(self->core.resampler));
+		free(self);
+		return NULL;
+	}
 	
 	// map midi event URI to integer, so that later I can compare ev->body.type to the midi event URI integer.
 	
@@ -69,6 +106,7 @@ static LV2_Handle instantiate(const LV2_Descriptor*     descriptor,
     features,
     //LV2_LOG__log,  &self->logger.log, false,
     LV2_URID__map, &self->map,        true,
+    LV2_WORKER__schedule, &self->schedule, true,
     NULL);
   // clang-format on
 
@@ -76,6 +114,10 @@ static LV2_Handle instantiate(const LV2_Descriptor*     descriptor,
   if (missing) {
     //lv2_log_error(&self->logger, "Missing feature <%s>\n", missing);
 		fprintf(stderr, "Missing feature <%s>\n", missing);
+		midiEventBufferFree(&(self->midiEvents));
+		waveBankExchangeFree(&(self->core.waves));
+		releasePowerOnSnapshots(self->core.powerOn);
+		resamplerFree(&(self->core.resampler));
     free(self);
     return NULL;
   }
@@ -85,6 +127,10 @@ static LV2_Handle instantiate(const LV2_Descriptor*     descriptor,
 	self->time_Position = self->map->map(self->map->handle, LV2_TIME__Position);
 	self->atom_Object = self->map->map(self->map->handle, LV2_ATOM__Object);
 	self->atom_Float = self->map->map(self->map->handle, LV2_ATOM__Float);
+	self->patch_Set = self->map->map(self->map->handle, LV2_PATCH__Set);
+	self->patch_property = self->map->map(self->map->handle, LV2_PATCH__property);
+	self->patch_value = self->map->map(self->map->handle, LV2_PATCH__value);
+	self->waveBank = self->map->map(self->map->handle, WAVE_BANK_URI);
 	
 	self->uris.atom_Path = self->map->map(self->map->handle, LV2_ATOM__Path);
 	self->uris.atom_Sequence = self->map->map(self->map->handle, LV2_ATOM__Sequence);
@@ -112,6 +158,9 @@ static void connect_port(LV2_Handle instance, uint32_t port, void* data) {
 			self->outputRight = (float*)data;
 			//printf("Connected port %d to address %p\n", port, data);
 			break;
+		case 4:
+			self->freeWheeling = (const float*)data;
+			break;
 		default:
 			break;
 	}
@@ -122,71 +171,67 @@ activate(LV2_Handle instance) {
 	printf("activate called.\n");
 	resetInternalState(&(((GameBoyPlugin*)instance)->core), 0, false);
 	((GameBoyPlugin*)instance)->prevSpeed = 0;
+	((GameBoyPlugin*)instance)->logDrainScheduled = false;
+	((GameBoyPlugin*)instance)->waveWorkScheduled = false;
+}
+
+// handles a patch:Set of the wave bank file. The file is read by the worker, since reading it can block.
+static void setWaveBankFile(GameBoyPlugin* self, const LV2_Atom_Object* obj) {
+	if (obj->body.otype != self->patch_Set) return;
+	const LV2_Atom* property = NULL;
+	const LV2_Atom* value = NULL;
+	lv2_atom_object_get(obj,
+		self->patch_property, &property,
+		self->patch_value, &value,
+		NULL);
+	if (!property || property->type != self->uris.atom_URID || ((const LV2_Atom_URID*)property)->body != self->waveBank) return;
+	if (!value || value->type != self->uris.atom_Path) return;
+	if (value->size >= MAX_WAVE_BANK_PATH) {
+		logWarning(&(self->core.log), "wave bank file path too long (%u bytes). Ignoring...", value->size);
+		return;
+	}
+	LoadWaveBankFileWork* work = &(self->loadWork);
+	work->workType = WORK_LOAD_WAVE_BANK_FILE;
+	memcpy(work->path, LV2_ATOM_BODY_CONST(value), value->size);
+	work->path[value->size] = '\0'; // the atom normally includes the terminating NUL, but hosts don't have to send one
+	const LV2_Worker_Status status = self->schedule->schedule_work(self->schedule->handle, sizeof(work->workType) + value->size + 1, work);
+	if (status != LV2_WORKER_SUCCESS) logWarning(&(self->core.log), "couldn't schedule loading the wave bank file (worker status %d). The waves are unchanged", (int)status);
 }
 
 static void run(LV2_Handle instance, uint32_t n_samples) { // most of the code should be in here. n_samples refers to audio frames, not interleaved samples.
 	GameBoyPlugin* self = (GameBoyPlugin*)instance;
-#define MAX_EVS 0xFF
-#define EV_I_TYPE uint8_t
-	LV2_Atom_Event* midiEvArray[MAX_EVS];
-	EV_I_TYPE midiEvArrSize=0;
-	
-	// events are looped through in the order that they happen chronologically
-	// midi events are scheduled for different times in the current run call.
-	// store incoming scheduled midi events for later.
+	self->core.offline = self->freeWheeling && *self->freeWheeling > 0.5f;
+	// events are looped through in the order that they happen chronologically, and converted to the generic midi format as they are found. The events point into the atom sequence instead of copying it.
+	startMidiEventBlock(&(self->midiEvents), n_samples);
 	LV2_ATOM_SEQUENCE_FOREACH (self->inMidi, ev) {
-		if (ev->body.type == self->midi_Event /*midi event URI mapped to an integer*/) {
-			midiEvArray[midiEvArrSize]=ev;
-			if (midiEvArrSize < MAX_EVS) midiEvArrSize++;
-		}
-	}
-
-  // Render audio
-	for (uint32_t pos = 0; pos < n_samples; pos++) { // when there is no audio to be rendered, output silence. If I don't do this, the plugin constantly outputs garbage noise.
-		self->outputLeft[pos] = 0;
-		self->outputRight[pos] = 0;
-		// compare pos (measure of elapsed time / progress through this current audio block) with the scheduledTime of each event in this run cycle
-		LV2_Atom_Event* curPosMidiEvs[MAX_EVS]; // use this to reorder conflicting simultaneous midi events
-		EV_I_TYPE curPosMidiEvsSize=0;
-		for (EV_I_TYPE evI=0; evI<midiEvArrSize; evI++) {
-			if (midiEvArray[evI]==NULL) continue;
-			if (pos >= midiEvArray[evI]->time.frames) {
-				curPosMidiEvs[curPosMidiEvsSize] = midiEvArray[evI];
-				if (curPosMidiEvsSize < MAX_EVS) curPosMidiEvsSize++;
-				midiEvArray[evI]=NULL;
-			} /* else if (midiEvArray[evI]->time.frames > pos) {
-				break; // events in midiEvArray are stored in chronological order, so once we reach the first event that is scheduled after the current position, we can assume that the rest of the events in the array are also not ready to be played.
-			}
-			*/
+		if (ev->body.type == self->atom_Object) {
+			setWaveBankFile(self, (const LV2_Atom_Object*)&ev->body);
+			continue;
 		}
-		
-		std::vector<midiMessage> curFrameMidiEvsGeneric;
-		for (EV_I_TYPE evI=0; evI<curPosMidiEvsSize; evI++) {
-			midiMessage newEv;
-			newEv.statusByte = 0; // marker for an invalid event
-			const uint8_t* const msg = (const uint8_t*)(curPosMidiEvs[evI] + 1); // ev is a pointer to the event. Once the event has been identified as a midi event, advance the pointer one byte forward and save the result as a new pointer to the midi message.
-			newEv.statusByte = msg[0];
-			if (newEv.statusByte == 0xF0) { // sysex
-				for (int i = 1; i<0xFFFFFFFF; i++){ // effectively a while loop with a failsafe
-					if (msg[i] == 0xF7) break;
-					newEv.dataBytes.push_back(msg[i]);
-				}
-			} else {
-				for (int i=0; i<2; i++){
-					newEv.dataBytes.push_back(msg[i+1]);
-				}
-			}
-			curFrameMidiEvsGeneric.push_back(newEv);
+		if (ev->body.type != self->midi_Event /*midi event URI mapped to an integer*/) continue;
+		const uint8_t* const msg = (const uint8_t*)(ev + 1); // ev is a pointer to the event. Once the event has been identified as a midi event, advance the pointer one byte forward and save the result as a new pointer to the midi message.
+		const uint32_t msgSize = ev->body.size;
+		if (msgSize == 0) continue;
+		midiMessage* newEv = addMidiEvent(&(self->core), &(self->midiEvents), (uint32_t)ev->time.frames, self->outputLeft, self->outputRight);
+		newEv->statusByte = msg[0];
+		newEv->dataBytes = msg + 1;
+		newEv->dataSize = msgSize - 1;
+		if (msg[0] == 0xF0 || msg[0] == 0xF7 || msg[0] < 0x80) { // sysex, or a later piece of one that the host split into several events. Later pieces start with data bytes, or with the end byte.
+			const uint8_t* sysexData = msg[0] == 0xF0 ? msg + 1 : msg;
+			const uint32_t sysexSize = msgSize - (uint32_t)(sysexData - msg);
+			uint32_t dataSize = 0;
+			while (dataSize < sysexSize && sysexData[dataSize] != 0xF7) dataSize++; // never reads past the event
+			newEv->statusByte = msg[0] == 0xF0 ? 0xF0 : 0xF7;
+			newEv->dataBytes = sysexData;
+			newEv->dataSize = dataSize;
+			newEv->sysexEnd = dataSize < sysexSize;
 		}
-		
-		// now that we have collected all the midi events that happen simultaneously on this position, we can convert them into APU writes.
-		std::pair<float, float> outputs = processFrame(&(self->core), curFrameMidiEvsGeneric);
-		
-		// LV2: "Audio samples are normalized between -1.0 and 1.0"
-		self->outputLeft[pos] = outputs.first;
-		self->outputRight[pos] = outputs.second;
 	}
 	
+	// Render audio
+	// LV2: "Audio samples are normalized between -1.0 and 1.0"
+	finishMidiEventBlock(&(self->core), &(self->midiEvents), self->outputLeft, self->outputRight);
+	
 	LV2_ATOM_SEQUENCE_FOREACH (self->inTime, ev) {
 		// Check if this event is an Object
 		if (ev->body.type == self->atom_Object) {
@@ -204,7 +249,7 @@ static void run(LV2_Handle instance, uint32_t n_samples) { // most of the code s
 					curSpeed = ((LV2_Atom_Float*)speed)->body;
 					if (curSpeed != self->prevSpeed) {
 						if (curSpeed == 0) {
-							resetInternalState(&(self->core), 0, false);
+							parkPlayback(&(self->core));
 							self->prevSpeed = 0;
 						} else {
 							self->prevSpeed = curSpeed;
@@ -214,15 +259,120 @@ static void run(LV2_Handle instance, uint32_t n_samples) { // most of the code s
 			}
 		}
 	}
+	
+	if (!self->waveWorkScheduled && waveBankHasBackgroundWork(&(self->core.waves))) {
+		const uint32_t workType = WORK_WAVE_BANK;
+		if (self->schedule->schedule_work(self->schedule->handle, sizeof(workType), &workType) == LV2_WORKER_SUCCESS) self->waveWorkScheduled = true;
+	}
+	
+	if (!self->logDrainScheduled && logRingPending(&(self->core.log))) {
+		const uint32_t workType = WORK_DRAIN_LOG;
+		if (self->schedule->schedule_work(self->schedule->handle, sizeof(workType), &workType) == LV2_WORKER_SUCCESS) self->logDrainScheduled = true;
+	}
 }
 
 static void deactivate(LV2_Handle instance) {
 	printf("deactivate called.\n");
 }
 
+// runs on the worker thread
+static LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function respond, LV2_Worker_Respond_Handle handle, uint32_t size, const void* data) {
+	GameBoyPlugin* self = (GameBoyPlugin*)instance;
+	if (size < sizeof(uint32_t)) return LV2_WORKER_ERR_UNKNOWN;
+	const uint32_t workType = *(const uint32_t*)data;
+	switch (workType) {
+		case WORK_DRAIN_LOG:
+			logRingDrain(&(self->core.log));
+			return respond(handle, sizeof(workType), &workType);
+		case WORK_WAVE_BANK:
+			doWaveBankBackgroundWork(&(self->core.waves));
+			return respond(handle, sizeof(workType), &workType);
+		case WORK_LOAD_WAVE_BANK_FILE: {
+			const char* path = (const char*)data + sizeof(workType);
+			const uint32_t pathSize = size - sizeof(workType);
+			if (pathSize == 0 || path[pathSize-1] != '\0') return LV2_WORKER_ERR_UNKNOWN;
+			loadWaveBankFile(&(self->core.waves), path);
+			return LV2_WORKER_SUCCESS; // the bank is picked up at the start of the next run, so nothing needs to respond
+		}
+		default:
+			return LV2_WORKER_ERR_UNKNOWN;
+	}
+}
+
+// runs on the audio thread, after work has responded
+static LV2_Worker_Status work_response(LV2_Handle instance, uint32_t size, const void* data) {
+	GameBoyPlugin* self = (GameBoyPlugin*)instance;
+	if (size != sizeof(uint32_t)) return LV2_WORKER_ERR_UNKNOWN;
+	switch (*(const uint32_t*)data) {
+		case WORK_DRAIN_LOG:
+			self->logDrainScheduled = false;
+			return LV2_WORKER_SUCCESS;
+		case WORK_WAVE_BANK:
+			self->waveWorkScheduled = false; // the bank is picked up at the start of the next run
+			return LV2_WORKER_SUCCESS;
+		default:
+			return LV2_WORKER_ERR_UNKNOWN;
+	}
+}
+
+// saves the path of the wave bank file. Waves sent as sysex aren't saved, since the song sends them again.
+static LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store, LV2_State_Handle handle, uint32_t flags, const LV2_Feature* const* features) {
+	GameBoyPlugin* self = (GameBoyPlugin*)instance;
+	char* filePath = copyWaveBankFilePath(&(self->core.waves)); // the worker may replace the path while this runs
+	if (!filePath) return LV2_STATE_SUCCESS;
+	LV2_State_Map_Path* mapPath = NULL;
+	LV2_State_Free_Path* freePath = NULL;
+	lv2_features_query(features,
+		LV2_STATE__mapPath, &mapPath, false,
+		LV2_STATE__freePath, &freePath, false,
+		NULL);
+	char* path = mapPath ? mapPath->abstract_path(mapPath->handle, filePath) : filePath; // abstract paths let the host move the file along with the project
+	const LV2_State_Status status = store(handle, self->waveBank, path, strlen(path) + 1, self->uris.atom_Path, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+	if (mapPath) {
+		if (freePath) freePath->free_path(freePath->handle, path);
+		else free(path);
+	}
+	free(filePath);
+	return status;
+}
+
+static LV2_State_Status restore(LV2_Handle instance, LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle, uint32_t flags, const LV2_Feature* const* features) {
+	GameBoyPlugin* self = (GameBoyPlugin*)instance;
+	size_t size = 0;
+	uint32_t type = 0;
+	uint32_t valueFlags = 0;
+	const char* value = (const char*)retrieve(handle, self->waveBank, &size, &type, &valueFlags);
+	if (!value || type != self->uris.atom_Path || size == 0 || value[size-1] != '\0') return LV2_STATE_SUCCESS; // a project without a wave bank file
+	LV2_State_Map_Path* mapPath = NULL;
+	LV2_State_Free_Path* freePath = NULL;
+	lv2_features_query(features,
+		LV2_STATE__mapPath, &mapPath, false,
+		LV2_STATE__freePath, &freePath, false,
+		NULL);
+	char* path = mapPath ? mapPath->absolute_path(mapPath->handle, value) : (char*)value;
+	loadWaveBankFile(&(self->core.waves), path); // restore isn't called on the audio thread, so the file can be read right here
+	if (mapPath) {
+		if (freePath) freePath->free_path(freePath->handle, path);
+		else free(path);
+	}
+	return LV2_STATE_SUCCESS;
+}
+
+static const void* extension_data(const char* uri) {
+	static const LV2_Worker_Interface worker = {work, work_response, NULL};
+	static const LV2_State_Interface state = {save, restore};
+	if (!strcmp(uri, LV2_WORKER__interface)) return &worker;
+	if (!strcmp(uri, LV2_STATE__interface)) return &state;
+	return NULL;
+}
+
 static void cleanup(LV2_Handle instance) {
     GameBoyPlugin* self = (GameBoyPlugin*)instance;
     //apu_cleanup(&self->apu);
+		midiEventBufferFree(&self->midiEvents);
+		waveBankExchangeFree(&(self->core.waves));
+		releasePowerOnSnapshots(self->core.powerOn);
+		resamplerFree(&(self->core.resampler));
 		//free(&(self->gb)); // "double free or corruption (!prev)"
     free(self);
 }
@@ -234,7 +384,7 @@ static const LV2_Descriptor descriptor = {GAMEBOY_URI,
                                           run,
                                           deactivate,
                                           cleanup,
-                                          NULL}; // extension_data 
+                                          extension_data};
 
 LV2_SYMBOL_EXPORT const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
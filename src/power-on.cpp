@@ -0,0 +1,137 @@
+#include "power-on.hpp"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mutex>
+#include "apu.h"
+#include "timing.h"
+#include "plugin-core.hpp" // INTERNAL_SAMPLE_RATE
+
+static const GB_model_t POWER_ON_MODELS[POWER_ON_MODEL_COUNT] = {
+	GB_MODEL_DMG_B,
+	GB_MODEL_SGB_NTSC,
+	GB_MODEL_SGB_PAL,
+	GB_MODEL_SGB_NTSC_NO_SFC,
+	GB_MODEL_SGB_PAL_NO_SFC,
+	GB_MODEL_SGB2,
+	GB_MODEL_SGB2_NO_SFC,
+	GB_MODEL_CGB_C,
+	GB_MODEL_CGB_E,
+	GB_MODEL_AGB,
+	GB_MODEL_AGB_NATIVE,
+};
+
+// every set of snapshots that some instance holds. Only used off the audio thread, which may block on the mutex.
+static std::mutex powerOnCacheMutex;
+static PowerOnSnapshots* cachedPowerOnSnapshots;
+
+bool powerOnGameBoy(GB_gameboy_t* gb, GB_model_t model, unsigned sampleRate){
+	memset(gb, 0, sizeof(GB_gameboy_t));
+	gb->model = model;
+	GB_apu_init(gb);
+	if (sampleRate) GB_set_sample_rate(gb, sampleRate);
+	GB_set_highpass_filter_mode(gb, GB_HIGHPASS_ACCURATE); // the default mode is GB_HIGHPASS_OFF
+	// at the DAW's sample rate, high square and noise pitches alias audibly without band-limited steps. At INTERNAL_SAMPLE_RATE the resampler's filter removes everything the plain box filter lets alias, so the steps would only cost time, and they also keep the noise channel from stepping its LFSR in bulk.
+	GB_set_band_limited_output(gb, INTERNAL_SAMPLE_RATE == 0);
+	GB_apu_write(gb, GB_IO_NR10, 0); // disable square 1 pitch sweep.
+	GB_apu_write(gb, GB_IO_NR52, 0x8f); // Power on APU. writing to bits 3-0 of this register *shouldn't* do anything because those bits are read only, but some emulators require them to be written to in order to enable channels.
+	GB_apu_write(gb, GB_IO_NR51, 0xFF); // Enable all channels and set panning to center.
+	GB_apu_write(gb, GB_IO_NR50, 0x77); // set master volume to max.
+
+	//set env. Set volume to max, set envelope direction to down (decrease volume), and set envelope length to 0 (disables envelope).
+	GB_apu_write(gb, GB_IO_NR12, 0xF0);
+	GB_apu_write(gb, GB_IO_NR22, 0xF0);
+	GB_apu_write(gb, GB_IO_NR32, 0b01 << 5); // ?
+	GB_apu_write(gb, GB_IO_NR42, 0xF0);
+	// trigger channel
+	GB_apu_write(gb, GB_IO_NR14, 0x80);
+	GB_apu_write(gb, GB_IO_NR24, 0x80);
+	GB_apu_write(gb, GB_IO_NR34, 0x80);
+	GB_apu_write(gb, GB_IO_NR44, 0x80);
+
+	GB_advance_cycles(gb, 0xFF); // TODO: reduce this cycle number to improve performance slightly.
+
+	// trigger channel again with 0 vol. This shouldn't mess up the user playing notes, because this is the same state as after a note off.
+	// Envelope settings are: Volume 0, envelope direction up, and envelope length 0.
+	// Setting all envelope settings except envelope direction to 0 is the best way to mute a channel without powering off the channel's DAC (powering off the channel's DAC would cause a pop sound).
+	GB_apu_write(gb, GB_IO_NR12, 8);
+	GB_apu_write(gb, GB_IO_NR22, 8);
+	GB_apu_write(gb, GB_IO_NR32, 0);
+	GB_apu_write(gb, GB_IO_NR42, 8);
+	GB_apu_write(gb, GB_IO_NR14, 0x80);
+	GB_apu_write(gb, GB_IO_NR24, 0x80);
+	GB_apu_write(gb, GB_IO_NR34, 0x80);
+	GB_apu_write(gb, GB_IO_NR44, 0x80);
+
+	// advance past APU pop
+	unsigned silentSamples = 0; // band-limited output lags behind the APU, so the output has to stay silent for a whole kernel before the pop is really over
+	for (int i=0; i<0xFFFF; i++){
+		GB_sample_t sample;
+		GB_run_samples(gb, &sample, 1);
+		silentSamples = sample.left == 0 ? silentSamples + 1 : 0;
+		if (silentSamples > GB_BLIP_KERNEL_SIZE) return true;
+	}
+	return false;
+}
+
+static PowerOnSnapshots* findCachedPowerOnSnapshots(unsigned sampleRate){
+	for (PowerOnSnapshots* snapshots = cachedPowerOnSnapshots; snapshots != nullptr; snapshots = snapshots->nextCached) {
+		if (snapshots->sampleRate == sampleRate) {
+			snapshots->refCount++;
+			return snapshots;
+		}
+	}
+	return nullptr;
+}
+
+const PowerOnSnapshots* acquirePowerOnSnapshots(unsigned sampleRate){
+	{
+		std::lock_guard<std::mutex> lock(powerOnCacheMutex);
+		PowerOnSnapshots* snapshots = findCachedPowerOnSnapshots(sampleRate);
+		if (snapshots != nullptr) return snapshots;
+	}
+	PowerOnSnapshots* snapshots = (PowerOnSnapshots*)malloc(sizeof(PowerOnSnapshots));
+	if (snapshots == nullptr) {
+		printf("[warning] Not enough memory for the power on snapshots. Resets will be slow...\n");
+		return nullptr;
+	}
+	// computed outside the lock, so other instances aren't kept waiting
+	snapshots->sampleRate = sampleRate;
+	snapshots->refCount = 1;
+	for (uint8_t modelI=0; modelI<POWER_ON_MODEL_COUNT; modelI++) {
+		if (!powerOnGameBoy(&(snapshots->states[modelI]), POWER_ON_MODELS[modelI], sampleRate)) printf("[warning] The power on pop of model 0x%03X never died away\n", POWER_ON_MODELS[modelI]);
+	}
+	std::lock_guard<std::mutex> lock(powerOnCacheMutex);
+	PowerOnSnapshots* cachedSnapshots = findCachedPowerOnSnapshots(sampleRate); // another instance may have computed the same ones in the meantime
+	if (cachedSnapshots != nullptr) {
+		free(snapshots);
+		return cachedSnapshots;
+	}
+	snapshots->nextCached = cachedPowerOnSnapshots;
+	cachedPowerOnSnapshots = snapshots;
+	return snapshots;
+}
+
+void releasePowerOnSnapshots(const PowerOnSnapshots* constSnapshots){
+	if (constSnapshots == nullptr) return;
+	PowerOnSnapshots* snapshots = (PowerOnSnapshots*)constSnapshots;
+	std::lock_guard<std::mutex> lock(powerOnCacheMutex);
+	if (--snapshots->refCount == 0) {
+		PowerOnSnapshots** link = &cachedPowerOnSnapshots;
+		while (*link != snapshots) link = &((*link)->nextCached);
+		*link = snapshots->nextCached;
+		free(snapshots);
+	}
+}
+
+int powerOnModelIndex(GB_model_t model){
+	for (int modelI=0; modelI<POWER_ON_MODEL_COUNT; modelI++) {
+		if (POWER_ON_MODELS[modelI] == model) return modelI;
+	}
+	return -1;
+}
+
+const GB_gameboy_t* getPowerOnState(const PowerOnSnapshots* snapshots, GB_model_t model){
+	const int modelI = powerOnModelIndex(model);
+	return modelI < 0 ? nullptr : &(snapshots->states[modelI]);
+}
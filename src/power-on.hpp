@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include "gb.h"
+#include "gb_struct_def.h"
+
+// Resetting the emulator means powering the APU on, triggering every channel, muting them again, and then running the APU until the pop that makes has died away, which can take tens of thousands of samples. The audio thread resets on every model change, so the settled state of each model is computed once per APU sample rate, on a thread that is allowed to block, and a reset is just a copy of it.
+// Every instance in a project runs at the same sample rate, so the snapshots are kept in a process-wide cache and shared between instances.
+#define POWER_ON_MODEL_COUNT 11 // the models CC23 can select
+
+struct PowerOnSnapshots { // never changed once it is in the cache
+	unsigned sampleRate; // of the APU
+	uint32_t refCount; // instances holding the snapshots. Guarded by the cache's mutex
+	PowerOnSnapshots* nextCached;
+	GB_gameboy_t states[POWER_ON_MODEL_COUNT]; // the settled state of each model, in the order of CC23's values
+};
+
+// runs the whole power on sequence on gb, as model, at the given APU sample rate. Returns false if the pop never died away. Slow, so only the fallback for when there are no snapshots.
+bool powerOnGameBoy(GB_gameboy_t* gb, GB_model_t model, unsigned sampleRate);
+
+// the snapshots for the APU sample rate, from the cache if an instance already has them. nullptr if there wasn't enough memory. Not for the audio thread.
+const PowerOnSnapshots* acquirePowerOnSnapshots(unsigned sampleRate);
+// accepts nullptr. Not for the audio thread.
+void releasePowerOnSnapshots(const PowerOnSnapshots* snapshots);
+// where model's snapshot is in PowerOnSnapshots::states, or -1 if CC23 can't select model
+int powerOnModelIndex(GB_model_t model);
+// audio thread. The settled state of model, or nullptr if CC23 can't select it.
+const GB_gameboy_t* getPowerOnState(const PowerOnSnapshots* snapshots, GB_model_t model);
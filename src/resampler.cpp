@@ -0,0 +1,246 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <mutex>
+#include "resampler.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static double besselI0(double x){
+	double sum = 1;
+	double term = 1;
+	for (int k=1; k<64; k++){
+		term *= (x / (2*k)) * (x / (2*k));
+		sum += term;
+		if (term < sum * 1e-15) break;
+	}
+	return sum;
+}
+
+// libm's sin isn't correctly rounded, so it can differ in the last bits between platforms. This only uses basic arithmetic, so the filter comes out the same everywhere.
+static double reproducibleSin(double x){
+	x -= 2 * M_PI * floor(x / (2 * M_PI) + 0.5); // reduce to [-pi, pi]
+	if (x > M_PI / 2) x = M_PI - x;
+	else if (x < -M_PI / 2) x = -M_PI - x;
+	double term = x;
+	double sum = x;
+	for (int i=1; i<14; i++){
+		term *= -x * x / ((2 * i) * (2 * i + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+static int64_t floorDiv(int64_t a, int64_t b){
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// every filter that some resampler uses. Only used off the audio thread, which may block on the mutex.
+static std::mutex resamplerFilterCacheMutex;
+static ResamplerFilter* cachedResamplerFilters;
+
+static void designFilter(ResamplerFilter* filter, uint32_t inputRate, uint32_t outputRate){
+	filter->inputRate = inputRate;
+	filter->outputRate = outputRate;
+
+	// Kaiser windowed sinc. The stopband starts at the lower of the two Nyquist frequencies, so nothing folds back below it, and the transition band is 15% of it wide.
+	const double attenuation = 80; // dB
+	const double beta = 0.1102 * (attenuation - 8.7);
+	const double nyquist = 0.5 * (inputRate < outputRate ? inputRate : outputRate) / inputRate; // relative to the input rate
+	double transition = 2 * M_PI * 0.15 * nyquist;
+	uint32_t taps = (uint32_t)ceil((attenuation - 8) / (2.285 * transition));
+	taps = (taps + 7) & ~7u;
+	if (taps > RESAMPLER_MAX_TAPS) { // very low output rates get a wider transition band instead
+		taps = RESAMPLER_MAX_TAPS;
+		transition = (attenuation - 8) / (2.285 * taps);
+	}
+	filter->taps = taps;
+	const double cutoff = nyquist - transition / (4 * M_PI);
+
+	const double center = taps / 2.0;
+	for (uint32_t phase=0; phase<=RESAMPLER_PHASES; phase++){
+		double sum = 0;
+		double row[RESAMPLER_MAX_TAPS];
+		for (uint32_t i=0; i<taps; i++){
+			// coefs are applied from the oldest input frame to the newest, and the output frame is phase/RESAMPLER_PHASES input frames past the newest one.
+			const double x = (double)phase / RESAMPLER_PHASES + (taps - 1 - i) - center;
+			const double sincArg = 2 * M_PI * cutoff * x;
+			const double sinc = x == 0 ? 1 : reproducibleSin(sincArg) / sincArg;
+			const double windowPos = x / center;
+			const double window = windowPos*windowPos < 1 ? besselI0(beta * sqrt(1 - windowPos*windowPos)) / besselI0(beta) : 0;
+			row[i] = sinc * window;
+			sum += row[i];
+		}
+		for (uint32_t i=0; i<taps; i++){
+			filter->coefs[phase][i] = (float)(row[i] / sum); // unity gain at DC for every phase
+		}
+		for (uint32_t i=taps; i<RESAMPLER_MAX_TAPS; i++){
+			filter->coefs[phase][i] = 0;
+		}
+	}
+}
+
+static ResamplerFilter* findCachedResamplerFilter(uint32_t inputRate, uint32_t outputRate){
+	for (ResamplerFilter* filter = cachedResamplerFilters; filter != nullptr; filter = filter->nextCached) {
+		if (filter->inputRate == inputRate && filter->outputRate == outputRate) {
+			filter->refCount++;
+			return filter;
+		}
+	}
+	return nullptr;
+}
+
+static const ResamplerFilter* acquireResamplerFilter(uint32_t inputRate, uint32_t outputRate){
+	{
+		std::lock_guard<std::mutex> lock(resamplerFilterCacheMutex);
+		ResamplerFilter* filter = findCachedResamplerFilter(inputRate, outputRate);
+		if (filter != nullptr) return filter;
+	}
+	ResamplerFilter* filter = (ResamplerFilter*)malloc(sizeof(ResamplerFilter));
+	if (filter == nullptr) {
+		printf("[warning] Not enough memory for the resampler's filter\n");
+		return nullptr;
+	}
+	designFilter(filter, inputRate, outputRate); // designed outside the lock, so other instances aren't kept waiting
+	filter->refCount = 1;
+	std::lock_guard<std::mutex> lock(resamplerFilterCacheMutex);
+	ResamplerFilter* cachedFilter = findCachedResamplerFilter(inputRate, outputRate); // another instance may have designed the same one in the meantime
+	if (cachedFilter != nullptr) {
+		free(filter);
+		return cachedFilter;
+	}
+	filter->nextCached = cachedResamplerFilters;
+	cachedResamplerFilters = filter;
+	return filter;
+}
+
+static void releaseResamplerFilter(const ResamplerFilter* constFilter){
+	if (constFilter == nullptr) return;
+	ResamplerFilter* filter = (ResamplerFilter*)constFilter;
+	std::lock_guard<std::mutex> lock(resamplerFilterCacheMutex);
+	if (--filter->refCount == 0) {
+		ResamplerFilter** link = &cachedResamplerFilters;
+		while (*link != filter) link = &((*link)->nextCached);
+		*link = filter->nextCached;
+		free(filter);
+	}
+}
+
+bool resamplerInit(PolyphaseResampler* self, uint32_t inputRate, uint32_t outputRate){
+	if (self->filter == nullptr || self->filter->inputRate != inputRate || self->filter->outputRate != outputRate) {
+		releaseResamplerFilter(self->filter);
+		self->filter = acquireResamplerFilter(inputRate, outputRate);
+		self->maxOutputFrames = (uint32_t)((uint64_t)(RESAMPLER_MAX_INPUT - 1) * outputRate / inputRate);
+		if (self->maxOutputFrames == 0) self->maxOutputFrames = 1;
+	}
+	resamplerReset(self);
+	return self->filter != nullptr;
+}
+
+void resamplerFree(PolyphaseResampler* self){
+	releaseResamplerFilter(self->filter);
+	self->filter = nullptr;
+}
+
+void resamplerReset(PolyphaseResampler* self){
+	self->time = 0;
+	memset(self->history, 0, sizeof(self->history));
+}
+
+uint32_t resamplerInputNeeded(const PolyphaseResampler* self, uint32_t outputFrames){
+	if (outputFrames == 0) return 0;
+	const int64_t newest = floorDiv(self->time + (int64_t)(outputFrames - 1) * self->filter->inputRate, self->filter->outputRate);
+	return newest + 1 > 0 ? (uint32_t)(newest + 1) : 0;
+}
+
+bool resamplerIsSilent(const PolyphaseResampler* self, float threshold){
+	for (uint32_t i=0; i<self->filter->taps; i++){
+		if (fabsf(self->history[0][i]) >= threshold || fabsf(self->history[1][i]) >= threshold) return false;
+	}
+	return true;
+}
+
+static inline float sumLanes(const float* lanes){
+	return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+}
+
+// The FIR kernel: interpolates between two phases' coefficients and filters both channels with the result.
+// Every version accumulates into 8 lanes and adds them up in the same order, so they all give the same result.
+static inline void firStereo(const float* inL, const float* inR, const float* coefs0, const float* coefs1, float weight, uint32_t taps, float* outL, float* outR){
+	float lanesL[8];
+	float lanesR[8];
+#if defined(__AVX__)
+	const __m256 w = _mm256_set1_ps(weight);
+	__m256 accL = _mm256_setzero_ps();
+	__m256 accR = _mm256_setzero_ps();
+	for (uint32_t i=0; i<taps; i+=8){
+		const __m256 c0 = _mm256_loadu_ps(coefs0 + i);
+		const __m256 c = _mm256_add_ps(c0, _mm256_mul_ps(w, _mm256_sub_ps(_mm256_loadu_ps(coefs1 + i), c0)));
+		accL = _mm256_add_ps(accL, _mm256_mul_ps(c, _mm256_loadu_ps(inL + i)));
+		accR = _mm256_add_ps(accR, _mm256_mul_ps(c, _mm256_loadu_ps(inR + i)));
+	}
+	_mm256_storeu_ps(lanesL, accL);
+	_mm256_storeu_ps(lanesR, accR);
+#elif defined(__SSE2__)
+	const __m128 w = _mm_set1_ps(weight);
+	__m128 accL0 = _mm_setzero_ps(), accL1 = _mm_setzero_ps();
+	__m128 accR0 = _mm_setzero_ps(), accR1 = _mm_setzero_ps();
+	for (uint32_t i=0; i<taps; i+=8){
+		const __m128 c00 = _mm_loadu_ps(coefs0 + i);
+		const __m128 c01 = _mm_loadu_ps(coefs0 + i + 4);
+		const __m128 c0 = _mm_add_ps(c00, _mm_mul_ps(w, _mm_sub_ps(_mm_loadu_ps(coefs1 + i), c00)));
+		const __m128 c1 = _mm_add_ps(c01, _mm_mul_ps(w, _mm_sub_ps(_mm_loadu_ps(coefs1 + i + 4), c01)));
+		accL0 = _mm_add_ps(accL0, _mm_mul_ps(c0, _mm_loadu_ps(inL + i)));
+		accL1 = _mm_add_ps(accL1, _mm_mul_ps(c1, _mm_loadu_ps(inL + i + 4)));
+		accR0 = _mm_add_ps(accR0, _mm_mul_ps(c0, _mm_loadu_ps(inR + i)));
+		accR1 = _mm_add_ps(accR1, _mm_mul_ps(c1, _mm_loadu_ps(inR + i + 4)));
+	}
+	_mm_storeu_ps(lanesL, accL0);
+	_mm_storeu_ps(lanesL + 4, accL1);
+	_mm_storeu_ps(lanesR, accR0);
+	_mm_storeu_ps(lanesR + 4, accR1);
+#else
+	for (int lane=0; lane<8; lane++){
+		lanesL[lane] = 0;
+		lanesR[lane] = 0;
+	}
+	for (uint32_t i=0; i<taps; i+=8){
+		for (int lane=0; lane<8; lane++){
+			const float c = coefs0[i+lane] + weight * (coefs1[i+lane] - coefs0[i+lane]);
+			lanesL[lane] += c * inL[i+lane];
+			lanesR[lane] += c * inR[i+lane];
+		}
+	}
+#endif
+	*outL = sumLanes(lanesL);
+	*outR = sumLanes(lanesR);
+}
+
+void resamplerProcess(PolyphaseResampler* self, const float* inputL, const float* inputR, uint32_t inputFrames, float* outputL, float* outputR, uint32_t outputFrames){
+	const ResamplerFilter* filter = self->filter;
+	const uint32_t taps = filter->taps;
+	float* historyL = self->history[0];
+	float* historyR = self->history[1];
+	memcpy(historyL + taps, inputL, inputFrames * sizeof(float));
+	memcpy(historyR + taps, inputR, inputFrames * sizeof(float));
+
+	int64_t time = self->time;
+	for (uint32_t i=0; i<outputFrames; i++){
+		const int64_t newest = floorDiv(time, filter->outputRate); // index of the newest input frame at or before the output frame, never below -1
+		const uint64_t position = (uint64_t)(time - newest * filter->outputRate) * (RESAMPLER_PHASES << 16) / filter->outputRate;
+		const uint32_t phase = (uint32_t)(position >> 16);
+		const float weight = (float)(position & 0xFFFF) / 65536.0f;
+		// the oldest tap of the newest input frame is taps - 1 frames before it, and the history starts `taps` frames before the first input frame
+		firStereo(historyL + newest + 1, historyR + newest + 1, filter->coefs[phase], filter->coefs[phase + 1], weight, taps, outputL + i, outputR + i);
+		time += filter->inputRate;
+	}
+	self->time = time - (int64_t)inputFrames * filter->outputRate;
+
+	memmove(historyL, historyL + inputFrames, taps * sizeof(float));
+	memmove(historyR, historyR + inputFrames, taps * sizeof(float));
+}
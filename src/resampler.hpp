@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+// Polyphase FIR resampler, used to bring the APU's fixed internal sample rate to the host's sample rate.
+// The history is stored inline so the struct can live inside the calloc'd plugin struct, and nothing is allocated while processing. The filter is the same for every instance at the same pair of rates, and much larger than the history, so filters are kept in a process-wide cache and shared.
+#define RESAMPLER_PHASES 128 // coefficients between two phases are linearly interpolated
+#define RESAMPLER_MAX_TAPS 512 // must be a multiple of 8
+#define RESAMPLER_MAX_INPUT 2048 // input frames per resamplerProcess call
+
+struct ResamplerFilter { // never changed once it is in the cache
+	uint32_t inputRate;
+	uint32_t outputRate;
+	uint32_t taps; // multiple of 8
+	uint32_t refCount; // resamplers using the filter. Guarded by the cache's mutex
+	ResamplerFilter* nextCached;
+	float coefs[RESAMPLER_PHASES + 1][RESAMPLER_MAX_TAPS]; // coefs[phase] is applied to the input frames from oldest to newest
+};
+
+struct PolyphaseResampler {
+	const ResamplerFilter* filter; // nullptr before resamplerInit, or if there wasn't enough memory for the filter
+	uint32_t maxOutputFrames; // the most output frames that can be processed in one call without going over RESAMPLER_MAX_INPUT
+	int64_t time; // when the next output frame happens, in 1/outputRate input frames, relative to the first input frame of the next call
+	float history[2][RESAMPLER_MAX_TAPS + RESAMPLER_MAX_INPUT]; // the last `taps` input frames, followed by the input of the current call
+};
+
+// gets the filter for the rates, designing it if no other resampler uses it yet. Slow and may block, so it should not be called on the audio thread unless the rates changed. Also resets the resampler. Returns false if there wasn't enough memory, in which case the resampler must not be used.
+bool resamplerInit(PolyphaseResampler* self, uint32_t inputRate, uint32_t outputRate);
+// releases the filter. Not for the audio thread.
+void resamplerFree(PolyphaseResampler* self);
+// forgets all previous input
+void resamplerReset(PolyphaseResampler* self);
+// how many input frames the next call to resamplerProcess must be given to produce outputFrames
+uint32_t resamplerInputNeeded(const PolyphaseResampler* self, uint32_t outputFrames);
+// whether all the input frames that still affect the output are quieter than threshold
+bool resamplerIsSilent(const PolyphaseResampler* self, float threshold);
+// inputFrames must be resamplerInputNeeded(self, outputFrames), and outputFrames must not be more than maxOutputFrames
+void resamplerProcess(PolyphaseResampler* self, const float* inputL, const float* inputR, uint32_t inputFrames, float* outputL, float* outputR, uint32_t outputFrames);
@@ -0,0 +1,451 @@
+#include "wave-bank.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include "log-ring.hpp" // LOG_MIN_LEVEL
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const DecodedWave SILENT_WAVE = {};
+
+static_assert(sizeof(WaveBankFileHeader) == 16, "the wave bank file header is read straight from the file");
+static_assert(sizeof(WaveBankFileIndexEntry) == 32, "index entries are read straight from the file");
+
+// splits wave RAM into the samples the APU plays, the first of each pair being the high nibble.
+static void expandWave(DecodedWave* wave){
+#if defined(__SSE2__)
+	const __m128i packed = _mm_loadu_si128((const __m128i*)wave->waveRAM);
+	const __m128i lowNibble = _mm_set1_epi8(0x0F);
+	const __m128i highNibbles = _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibble);
+	const __m128i lowNibbles = _mm_and_si128(packed, lowNibble);
+	_mm_storeu_si128((__m128i*)wave->samples, _mm_unpacklo_epi8(highNibbles, lowNibbles));
+	_mm_storeu_si128((__m128i*)(wave->samples + 16), _mm_unpackhi_epi8(highNibbles, lowNibbles));
+#else
+	for (uint8_t samplePairI=0; samplePairI<16; samplePairI++) {
+		wave->samples[samplePairI*2] = wave->waveRAM[samplePairI] >> 4;
+		wave->samples[samplePairI*2+1] = wave->waveRAM[samplePairI] & 0xF;
+	}
+#endif
+}
+
+#ifdef _WIN32
+// the file's size, and what tells this version of it from every other: its index on its volume and its last write time, in 100 ns units.
+static bool getFileIdentity(FILE* file, uint64_t* size, uint64_t identity[2]){
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(file)), &info)) return false;
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	identity[0] = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	identity[1] = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+#else
+// the file's size, and what tells this version of it from every other: its inode and its modification time, in nanoseconds. A file rewritten within the same second, or replaced by renaming another over it, still gets a new identity.
+static bool getFileIdentity(FILE* file, uint64_t* size, uint64_t identity[2]){
+	struct stat fileInfo;
+	if (fstat(fileno(file), &fileInfo) != 0) return false;
+	*size = fileInfo.st_size;
+	identity[0] = fileInfo.st_ino;
+#ifdef __APPLE__
+	identity[1] = (uint64_t)fileInfo.st_mtimespec.tv_sec * 1000000000 + fileInfo.st_mtimespec.tv_nsec;
+#else
+	identity[1] = (uint64_t)fileInfo.st_mtim.tv_sec * 1000000000 + fileInfo.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+#endif
+
+// every bank that some instance holds. Only used by background threads, which may block on the mutex.
+static std::mutex waveBankCacheMutex;
+static WaveBank* cachedWaveBanks;
+// guards every exchange's filePath. LV2 replaces it on the worker thread while the host may be saving on the main thread.
+static std::mutex waveBankFilePathMutex;
+
+// replaces the saved path. Returns the path, or nullptr if there wasn't enough memory to copy it.
+static char* setWaveBankFilePath(WaveBankExchange* exchange, const char* path){
+	char* pathCopy = path ? strdup(path) : nullptr;
+	std::lock_guard<std::mutex> lock(waveBankFilePathMutex);
+	free(exchange->filePath);
+	exchange->filePath = pathCopy;
+	return pathCopy;
+}
+
+char* copyWaveBankFilePath(WaveBankExchange* exchange){
+	std::lock_guard<std::mutex> lock(waveBankFilePathMutex);
+	return exchange->filePath ? strdup(exchange->filePath) : nullptr;
+}
+
+static void releaseWaveBankRef(WaveBankRef* ref){
+	if (ref == nullptr) return;
+	std::lock_guard<std::mutex> lock(waveBankCacheMutex);
+	WaveBank* bank = (WaveBank*)ref->bank;
+	if (--bank->refCount == 0) {
+		WaveBank** link = &cachedWaveBanks;
+		while (*link != bank) link = &((*link)->nextCached);
+		*link = bank->nextCached;
+		free(bank);
+	}
+	free(ref);
+}
+
+bool waveBankExchangeInit(WaveBankExchange* exchange){
+	bool allocated = true;
+	for (uint8_t bufferI=0; bufferI<WAVE_SYSEX_BUFFERS; bufferI++) {
+		exchange->sysexBuffers[bufferI].data = (uint8_t*)malloc(MAX_WAVE_SYSEX_SIZE);
+		exchange->sysexBuffers[bufferI].size = 0;
+		exchange->sysexBuffers[bufferI].sequence = 0;
+		if (exchange->sysexBuffers[bufferI].data == nullptr) allocated = false;
+	}
+	exchange->queuedSysex.store(WAVE_SYSEX_BUFFERS);
+	exchange->sysexSequence = 0;
+	exchange->backgroundBusy.store(false);
+	exchange->collectingSysex = 0;
+	exchange->lastQueuedSysex = WAVE_SYSEX_BUFFERS;
+	exchange->sysexSize = 0;
+	exchange->readyBank.store(nullptr);
+	exchange->retiredBank.store(nullptr);
+	exchange->current = nullptr;
+	exchange->retiring = nullptr;
+	exchange->sysexState = WAVE_SYSEX_IDLE;
+	exchange->filePath = nullptr;
+	return allocated;
+}
+
+void waveBankExchangeFree(WaveBankExchange* exchange){
+	for (uint8_t bufferI=0; bufferI<WAVE_SYSEX_BUFFERS; bufferI++) {
+		free(exchange->sysexBuffers[bufferI].data);
+		exchange->sysexBuffers[bufferI].data = nullptr;
+	}
+	releaseWaveBankRef(exchange->readyBank.exchange(nullptr));
+	releaseWaveBankRef(exchange->retiredBank.exchange(nullptr));
+	releaseWaveBankRef(exchange->current);
+	exchange->current = nullptr;
+	releaseWaveBankRef(exchange->retiring);
+	exchange->retiring = nullptr;
+	free(exchange->filePath);
+	exchange->filePath = nullptr;
+}
+
+// whether the sysex names a wave bank file instead of holding waves
+static bool isWaveBankFileSysex(const uint8_t* sysexData, uint32_t sysexSize){
+	return sysexSize >= WAVE_BANK_FILE_SYSEX_ID_SIZE && memcmp(sysexData, WAVE_BANK_FILE_SYSEX_ID, WAVE_BANK_FILE_SYSEX_ID_SIZE) == 0;
+}
+
+WaveSysexResult endWaveSysex(WaveBankExchange* exchange){
+	WaveSysexResult result = WAVE_SYSEX_INCOMPLETE;
+	if (exchange->sysexState == WAVE_SYSEX_COLLECTING) {
+		if (exchange->sysexSize < WAVE_SYSEX_SIZE && !isWaveBankFileSysex(exchange->sysexBuffers[exchange->collectingSysex].data, exchange->sysexSize)) {
+			result = WAVE_SYSEX_TOO_SHORT;
+		} else {
+			const uint8_t queued = exchange->collectingSysex;
+			WaveSysexBuffer* buffer = &(exchange->sysexBuffers[queued]);
+			buffer->size = exchange->sysexSize;
+			buffer->sequence = exchange->sysexSequence.load(std::memory_order_relaxed) + 1;
+			exchange->sysexSequence.store(buffer->sequence, std::memory_order_relaxed);
+			const uint8_t replaced = exchange->queuedSysex.exchange(queued, std::memory_order_acq_rel);
+			if (replaced != WAVE_SYSEX_BUFFERS) {
+				exchange->collectingSysex = replaced; // the background thread never started on it, so it is free again
+			} else {
+				// the background thread took the sysex queued before this one, and may still be parsing it. Anything it took before that is finished, since it parses one at a time, so the third buffer is free.
+				uint8_t unused = 0;
+				while (unused == queued || unused == exchange->lastQueuedSysex) unused++;
+				exchange->collectingSysex = unused;
+			}
+			exchange->lastQueuedSysex = queued;
+			result = WAVE_SYSEX_QUEUED;
+		}
+	}
+	exchange->sysexState = WAVE_SYSEX_IDLE;
+	return result;
+}
+
+WaveSysexResult collectWaveSysex(WaveBankExchange* exchange, const uint8_t* data, uint32_t size, bool isStart, bool isEnd){
+	WaveSysexResult result = WAVE_SYSEX_INCOMPLETE;
+	if (isStart) endWaveSysex(exchange); // a status byte ends the previous sysex
+	if (exchange->sysexState == WAVE_SYSEX_IDLE) {
+		exchange->sysexState = WAVE_SYSEX_COLLECTING;
+		exchange->sysexSize = 0;
+	}
+	const uint32_t room = MAX_WAVE_SYSEX_SIZE - exchange->sysexSize;
+	if (size > room) size = room;
+	memcpy(exchange->sysexBuffers[exchange->collectingSysex].data + exchange->sysexSize, data, size);
+	exchange->sysexSize += size;
+	if (isEnd) return endWaveSysex(exchange);
+	return result;
+}
+
+bool pickUpWaveBank(WaveBankExchange* exchange){
+	if (exchange->retiring != nullptr) { // the background thread hasn't freed the last replaced bank yet. The new bank waits until it has, so that the audio thread never has to loop or free.
+		WaveBankRef* empty = nullptr;
+		if (!exchange->retiredBank.compare_exchange_strong(empty, exchange->retiring, std::memory_order_release, std::memory_order_relaxed)) return false;
+		exchange->retiring = nullptr;
+	}
+	if (exchange->readyBank.load(std::memory_order_relaxed) == nullptr) return false;
+	WaveBankRef* newBank = exchange->readyBank.exchange(nullptr, std::memory_order_acquire);
+	if (newBank == nullptr) return false;
+	WaveBankRef* oldBank = exchange->current;
+	exchange->current = newBank;
+	if (oldBank != nullptr) {
+		WaveBankRef* empty = nullptr;
+		if (!exchange->retiredBank.compare_exchange_strong(empty, oldBank, std::memory_order_release, std::memory_order_relaxed)) exchange->retiring = oldBank;
+	}
+	return true;
+}
+
+bool waveBankSwapPending(const WaveBankExchange* exchange){
+	const uint32_t bankSequence = exchange->current ? exchange->current->sequence : 0;
+	return bankSequence != exchange->sysexSequence.load(std::memory_order_relaxed);
+}
+
+const DecodedWave* getWave(const WaveBankExchange* exchange, uint16_t index){
+	if (exchange->current == nullptr) return &SILENT_WAVE;
+	const WaveBank* bank = exchange->current->bank;
+	if (index >= bank->waveCount) return &SILENT_WAVE;
+	return &(bank->waves[index]);
+}
+
+bool waveSysexQueued(const WaveBankExchange* exchange){
+	return exchange->queuedSysex.load(std::memory_order_relaxed) != WAVE_SYSEX_BUFFERS;
+}
+
+bool waveBankHasBackgroundWork(const WaveBankExchange* exchange){
+	return waveSysexQueued(exchange) || exchange->retiredBank.load(std::memory_order_relaxed) != nullptr;
+}
+
+// packs the 32 one-sample-per-byte values of a wave's sysex into 16 bytes of wave RAM, two samples per byte with the first in the high nibble, then expands wave RAM back into samples. The samples come from the packed bytes rather than the sysex, so that they match what writing the bytes to wave RAM would give.
+static void decodeWave(const uint8_t* sysexWave, DecodedWave* wave){
+#if defined(__SSE2__)
+	// each 16-bit lane holds a pair of samples, the first one in its low byte.
+	const __m128i lowByte = _mm_set1_epi16(0x00FF);
+	const __m128i pairs0 = _mm_loadu_si128((const __m128i*)sysexWave);
+	const __m128i pairs1 = _mm_loadu_si128((const __m128i*)(sysexWave + 16));
+	const __m128i packed0 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(pairs0, 4), _mm_srli_epi16(pairs0, 8)), lowByte);
+	const __m128i packed1 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(pairs1, 4), _mm_srli_epi16(pairs1, 8)), lowByte);
+	_mm_storeu_si128((__m128i*)wave->waveRAM, _mm_packus_epi16(packed0, packed1));
+#else
+	for (uint8_t samplePairI=0; samplePairI<16; samplePairI++) {
+		wave->waveRAM[samplePairI] = (uint8_t)((sysexWave[samplePairI*2] << 4) | sysexWave[samplePairI*2+1]);
+	}
+#endif
+	expandWave(wave);
+}
+
+// turns the sysex into a bank. The sysex never contains its end byte, so every whole wave in it is used.
+static WaveBank* parseWaveSysex(const uint8_t* sysexData, uint32_t sysexSize){
+	const uint32_t waveCount = sysexSize / WAVE_SYSEX_SIZE; // a partial wave at the end is left out
+	WaveBank* bank = (WaveBank*)malloc(sizeof(WaveBank) + waveCount * sizeof(bank->waves[0])); // every wave is written below, so nothing needs clearing
+	if (bank == nullptr) return nullptr;
+	bank->waveCount = waveCount;
+	for (uint32_t waveI=0; waveI<bank->waveCount; waveI++) {
+		decodeWave(sysexData + waveI*WAVE_SYSEX_SIZE, &(bank->waves[waveI]));
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+		const uint8_t* wave = bank->waves[waveI].waveRAM;
+		printf("[debug] Wave %u: %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n", waveI, wave[0], wave[1], wave[2], wave[3], wave[4], wave[5], wave[6], wave[7], wave[8], wave[9], wave[10], wave[11], wave[12], wave[13], wave[14], wave[15]);
+#endif
+	}
+	return bank;
+}
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325
+
+// 64-bit FNV-1a. Continues from hash, so that several pieces of data can be hashed together
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS){
+	for (size_t i=0; i<size; i++) {
+		hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001B3;
+	}
+	return hash;
+}
+
+// the cached bank for the sysex, with its refCount raised. nullptr if there is none.
+static WaveBank* findCachedWaveBank(uint64_t hash, uint64_t sourceSize, bool fromFile){
+	for (WaveBank* bank = cachedWaveBanks; bank != nullptr; bank = bank->nextCached) {
+		if (bank->hash == hash && bank->sourceSize == sourceSize && bank->fromFile == fromFile) {
+			bank->refCount++;
+			return bank;
+		}
+	}
+	return nullptr;
+}
+
+// adds a new bank to the cache, unless another instance added the same one in the meantime, in which case the new one is thrown away and the cached one is returned.
+static WaveBank* cacheWaveBank(WaveBank* bank, uint64_t hash, uint64_t sourceSize, bool fromFile){
+	bank->hash = hash;
+	bank->sourceSize = sourceSize;
+	bank->fromFile = fromFile;
+	bank->refCount = 1;
+	std::lock_guard<std::mutex> lock(waveBankCacheMutex);
+	WaveBank* cachedBank = findCachedWaveBank(hash, sourceSize, fromFile);
+	if (cachedBank != nullptr) {
+		free(bank);
+		return cachedBank;
+	}
+	bank->nextCached = cachedWaveBanks;
+	cachedWaveBanks = bank;
+	return bank;
+}
+
+// the bank for the sysex, from the cache if an instance already has it
+static WaveBank* acquireWaveBank(const uint8_t* sysexData, uint32_t sysexSize){
+	const uint64_t hash = hashBytes(sysexData, sysexSize);
+	{
+		std::lock_guard<std::mutex> lock(waveBankCacheMutex);
+		WaveBank* bank = findCachedWaveBank(hash, sysexSize, false);
+		if (bank != nullptr) return bank;
+	}
+	WaveBank* bank = parseWaveSysex(sysexData, sysexSize); // parsed outside the lock, so other instances aren't kept waiting
+	if (bank == nullptr) return nullptr;
+	return cacheWaveBank(bank, hash, sysexSize, false);
+}
+
+// hands a bank to the audio thread
+static void publishWaveBank(WaveBankExchange* exchange, WaveBankRef* ref, const WaveBank* bank, uint32_t sequence){
+	ref->bank = bank;
+	ref->sequence = sequence;
+	releaseWaveBankRef(exchange->readyBank.exchange(ref, std::memory_order_acq_rel)); // a bank the audio thread never picked up has been replaced before it was used
+}
+
+static bool loadWaveBankFileAs(WaveBankExchange* exchange, const char* path, uint32_t sequence);
+
+// loads the file a sysex names, as the bank of that sysex
+static void loadWaveBankFileSysex(WaveBankExchange* exchange, const WaveSysexBuffer* buffer){
+	const uint32_t pathSize = (buffer->size - WAVE_BANK_FILE_SYSEX_ID_SIZE) / 2; // a lone nibble at the end is left out
+	if (pathSize >= MAX_WAVE_BANK_PATH) {
+		printf("[warning] The wave bank file's path in the sysex is too long. Ignoring it...\n");
+		return;
+	}
+	char path[MAX_WAVE_BANK_PATH];
+	const uint8_t* pathNibbles = buffer->data + WAVE_BANK_FILE_SYSEX_ID_SIZE;
+	for (uint32_t charI=0; charI<pathSize; charI++) {
+		path[charI] = (char)(((pathNibbles[charI*2] & 0xF) << 4) | (pathNibbles[charI*2+1] & 0xF));
+		if (path[charI] == '\0') {
+			printf("[warning] The wave bank file's path in the sysex contains a zero byte. Ignoring it...\n");
+			return;
+		}
+	}
+	path[pathSize] = '\0';
+	loadWaveBankFileAs(exchange, path, buffer->sequence);
+}
+
+// the background work, once the calling thread has set backgroundBusy
+static void doClaimedWaveBankWork(WaveBankExchange* exchange){
+	releaseWaveBankRef(exchange->retiredBank.exchange(nullptr, std::memory_order_acquire));
+	const uint8_t queued = exchange->queuedSysex.exchange(WAVE_SYSEX_BUFFERS, std::memory_order_acq_rel); // the audio thread won't collect into this buffer until it has queued another one after it
+	if (queued == WAVE_SYSEX_BUFFERS) return;
+	const WaveSysexBuffer* buffer = &(exchange->sysexBuffers[queued]);
+	if (isWaveBankFileSysex(buffer->data, buffer->size)) {
+		loadWaveBankFileSysex(exchange, buffer);
+		return;
+	}
+	WaveBankRef* ref = (WaveBankRef*)malloc(sizeof(WaveBankRef));
+	WaveBank* bank = ref ? acquireWaveBank(buffer->data, buffer->size) : nullptr;
+	if (bank == nullptr) {
+		free(ref);
+		printf("[warning] Not enough memory for the waves. Ignoring them...\n");
+		return;
+	}
+	publishWaveBank(exchange, ref, bank, buffer->sequence);
+}
+
+void doWaveBankBackgroundWork(WaveBankExchange* exchange){
+	if (exchange->backgroundBusy.exchange(true, std::memory_order_acquire)) return;
+	doClaimedWaveBankWork(exchange);
+	exchange->backgroundBusy.store(false, std::memory_order_release);
+}
+
+void finishWaveBankWork(WaveBankExchange* exchange){
+	while (exchange->backgroundBusy.exchange(true, std::memory_order_acquire)) std::this_thread::yield(); // the other thread may have taken the sysex already, and is publishing its bank
+	doClaimedWaveBankWork(exchange);
+	exchange->backgroundBusy.store(false, std::memory_order_release);
+}
+
+// reads the waves of a wave bank file into a bank of their own, so that the audio thread never touches the file. nullptr if it isn't a wave bank file, or it couldn't be read.
+static WaveBank* readWaveBankFile(const char* path, FILE* file, uint64_t size){
+	WaveBankFileHeader header;
+	if (size < sizeof(header) || fread(&header, sizeof(header), 1, file) != 1) {
+		printf("[warning] %s is too small to be a wave bank file\n", path);
+		return nullptr;
+	}
+	const uint64_t wavesEnd = (uint64_t)header.headerSize + (uint64_t)header.waveCount * 16;
+	const char* problem = nullptr;
+	if (memcmp(header.magic, WAVE_BANK_FILE_MAGIC, 4) != 0) {
+		problem = "is not a wave bank file";
+	} else if (header.version > WAVE_BANK_FILE_VERSION) {
+		problem = "needs a newer version of the plugin";
+	} else if (header.headerSize < sizeof(header) || wavesEnd > size) {
+		problem = "is cut off";
+	} else if (header.indexOffset != 0 && (uint64_t)header.indexOffset + (uint64_t)header.waveCount * sizeof(WaveBankFileIndexEntry) > size) {
+		problem = "has a cut off index";
+	}
+	const uint32_t waveCount = header.waveCount < MAX_WAVES ? header.waveCount : MAX_WAVES; // the rest couldn't be selected by CC21 and CC53
+	WaveBank* bank = problem ? nullptr : (WaveBank*)malloc(sizeof(WaveBank) + waveCount * sizeof(bank->waves[0]));
+	if (bank == nullptr) {
+		printf("[warning] %s %s. Ignoring it...\n", path, problem ? problem : "couldn't be loaded");
+		return nullptr;
+	}
+	bank->waveCount = waveCount;
+	if (fseek(file, header.headerSize, SEEK_SET) != 0) problem = "couldn't be read";
+	for (uint32_t waveI=0; waveI<waveCount && !problem; waveI++) {
+		if (fread(bank->waves[waveI].waveRAM, 16, 1, file) != 1) problem = "was cut off while it was being read";
+		expandWave(&(bank->waves[waveI]));
+	}
+	if (problem) {
+		printf("[warning] %s %s. Ignoring it...\n", path, problem);
+		free(bank);
+		return nullptr;
+	}
+	return bank;
+}
+
+// loads the file as the bank of the sysex numbered sequence
+static bool loadWaveBankFileAs(WaveBankExchange* exchange, const char* path, uint32_t sequence){
+	// the path is kept even if the file can't be read, so that saving a project whose file is missing for now doesn't lose it
+	if (path[0] == '\0') {
+		setWaveBankFilePath(exchange, nullptr);
+		return true;
+	}
+	if (setWaveBankFilePath(exchange, path) == nullptr) printf("[warning] Not enough memory to keep the path of %s. It won't be saved\n", path);
+	FILE* file = fopen(path, "rb");
+	uint64_t size = 0;
+	uint64_t identity[2];
+	if (file == nullptr || !getFileIdentity(file, &size, identity)) {
+		if (file) fclose(file);
+		printf("[warning] Couldn't open the wave bank file %s\n", path);
+		return false;
+	}
+	// files are cached by path and identity, so that checking for a cached bank doesn't read the file
+	const uint64_t hash = hashBytes(identity, sizeof(identity), hashBytes(path, strlen(path)));
+	WaveBankRef* ref = (WaveBankRef*)malloc(sizeof(WaveBankRef));
+	WaveBank* bank = nullptr;
+	if (ref) {
+		{
+			std::lock_guard<std::mutex> lock(waveBankCacheMutex);
+			bank = findCachedWaveBank(hash, size, true);
+		}
+		if (bank == nullptr) {
+			bank = readWaveBankFile(path, file, size); // read outside the lock, so other instances aren't kept waiting
+			if (bank != nullptr) bank = cacheWaveBank(bank, hash, size, true);
+		}
+	}
+	fclose(file);
+	if (bank == nullptr) {
+		free(ref);
+		return false;
+	}
+	publishWaveBank(exchange, ref, bank, sequence);
+	printf("[info] Loaded %u waves from %s\n", bank->waveCount, path);
+	return true;
+}
+
+bool loadWaveBankFile(WaveBankExchange* exchange, const char* path){
+	return loadWaveBankFileAs(exchange, path, exchange->sysexSequence.load(std::memory_order_relaxed)); // doesn't count as a queued sysex, so it doesn't make wave loads look stale
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Waves are sent to the plugin in a sysex message, usually at the start of a song. Parsing one can take a while (a bank can be up to half a megabyte of sysex), so the audio thread only copies the message, and a thread that is allowed to block and allocate turns it into a WaveBank. The finished bank is handed back to the audio thread with a pointer swap.
+// When rendering offline, the audio thread parses the sysex itself as soon as it ends instead, so that which notes get the new waves doesn't depend on when the other thread gets to run.
+// Projects usually run one instance per midi channel, and every one of them receives the same sysex, again each time playback restarts. So banks are kept in a process-wide cache keyed by a hash of the sysex, and instances that received the same sysex share one bank.
+// Waves can also come from a wave bank file, which skips the host's midi path (some hosts choke on a large sysex). The background thread reads the file into a bank of its own, so the audio thread never waits on the disk, and editing or deleting the file later can't affect playback.
+#define MAX_WAVES 0x3FFF
+#define WAVE_SYSEX_SIZE 32 // each 4-bit sample is sent in its own byte, or else a wave containing the samples 0x0F and 0x07 right next to each other would be confused for the sysex end byte 0xF7.
+#define MAX_WAVE_SYSEX_SIZE (MAX_WAVES * WAVE_SYSEX_SIZE) // anything past this couldn't be selected by CC21 and CC53, so it is dropped
+#define WAVE_SYSEX_BUFFERS 3 // one being collected, one waiting to be parsed, and one being parsed, so that a new sysex never has to be dropped
+
+enum WaveSysexState : uint8_t { // where the audio thread is in collecting a sysex
+	WAVE_SYSEX_IDLE,
+	WAVE_SYSEX_COLLECTING, // pieces are being added to the sysex buffer
+};
+
+enum WaveSysexResult : uint8_t {
+	WAVE_SYSEX_INCOMPLETE, // more pieces are expected
+	WAVE_SYSEX_QUEUED, // complete, and handed to the background thread. Replaces a sysex that was still waiting to be parsed
+	WAVE_SYSEX_TOO_SHORT, // complete, but without a single whole wave or a file's path. Ignored
+};
+
+// wave bank file format. Every field is little-endian.
+#define WAVE_BANK_FILE_MAGIC "NGBW"
+#define WAVE_BANK_FILE_VERSION 1
+#define MAX_WAVE_BANK_PATH 4096 // in bytes, including the terminating NUL
+// a sysex can name a wave bank file instead of holding waves, which works in every plugin standard, including those without text parameters (CLAP). It is WAVE_BANK_FILE_SYSEX_ID, followed by the path's bytes, each split into two data bytes with the high nibble first, like a wave's samples. An empty path forgets the file.
+#define WAVE_BANK_FILE_SYSEX_ID "\x7D" "NGBF" // 0x7D is the manufacturer ID for non-commercial use. A wave sysex can't start with it, since its bytes are all 4-bit samples.
+#define WAVE_BANK_FILE_SYSEX_ID_SIZE 5
+
+struct WaveBankFileHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t headerSize; // where the waves start. Later versions can add fields in between
+	uint32_t waveCount; // followed by waveCount waves, 16 bytes each, in the same format as gb wave RAM
+	uint32_t indexOffset; // 0, or where waveCount WaveBankFileIndexEntry start. The index is for the tools that edit banks, playback doesn't need it.
+};
+
+struct WaveBankFileIndexEntry {
+	uint64_t hash; // 64-bit FNV-1a of the wave's 16 bytes
+	char name[24]; // padded with NULs, and not terminated if it is 24 characters long
+};
+
+struct DecodedWave { // a wave in both of the forms the APU keeps wave RAM in, so that loading it is just a copy
+	uint8_t waveRAM[16]; // to save space in the sysex buffer, waves are stored in the same format as gb: 32 samples long, with two 4-bit samples stored in each byte.
+	int8_t samples[32]; // one sample per byte, like the APU's wave_form
+};
+
+struct WaveBank { // never changed once it is in the cache. Allocated with room for exactly waveCount waves, since songs only use a few of the MAX_WAVES they could
+	uint64_t hash; // of the sysex it was parsed from, or of a file's path, inode and modification time
+	uint64_t sourceSize; // of the sysex or the file
+	bool fromFile;
+	uint32_t refCount; // instances holding the bank. Guarded by the cache's mutex
+	WaveBank* nextCached;
+	uint32_t waveCount;
+	DecodedWave waves[];
+};
+
+struct WaveBankRef { // one instance's hold on a shared bank
+	const WaveBank* bank;
+	uint32_t sequence; // sysexSequence of the sysex it was parsed from
+};
+
+struct WaveSysexBuffer {
+	uint8_t* data; // MAX_WAVE_SYSEX_SIZE bytes, allocated up front. It is never cleared, so the system only backs the pages that a sysex actually reaches with memory.
+	uint32_t size;
+	uint32_t sequence; // sysexSequence of the sysex
+};
+
+struct WaveBankExchange {
+	// the audio thread collects a sysex into one buffer while the background thread parses another. A finished sysex takes the place of one that is still waiting, so only the newest is parsed.
+	WaveSysexBuffer sysexBuffers[WAVE_SYSEX_BUFFERS];
+	std::atomic<uint8_t> queuedSysex; // the buffer waiting to be parsed, or WAVE_SYSEX_BUFFERS if there is none. The background thread takes it by swapping WAVE_SYSEX_BUFFERS in.
+	std::atomic<uint32_t> sysexSequence; // counts the sysex messages queued so far. Only written by the audio thread
+	std::atomic<bool> backgroundBusy; // a thread is running doWaveBankBackgroundWork
+	std::atomic<WaveBankRef*> readyBank; // parsed, but not picked up by the audio thread yet
+	std::atomic<WaveBankRef*> retiredBank; // replaced, waiting to be released by the background thread
+	// only touched by the audio thread
+	WaveBankRef* current; // the bank wave loads read from. nullptr before the first sysex.
+	WaveBankRef* retiring; // replaced, but retiredBank was still full
+	uint8_t sysexState;
+	uint8_t collectingSysex; // the buffer the current sysex goes into
+	uint8_t lastQueuedSysex; // the buffer queued last, which the background thread may have taken. WAVE_SYSEX_BUFFERS if there is none.
+	uint32_t sysexSize; // of the current sysex, or the last one if none is being collected
+	char* filePath; // of the last wave bank file asked for, so that it can be saved in the plugin's state. Kept even if the file couldn't be read. nullptr if there is none. Only read through copyWaveBankFilePath, since it can be replaced on another thread.
+};
+
+// allocates the sysex buffers. Returns false if that failed. Not for the audio thread.
+bool waveBankExchangeInit(WaveBankExchange* exchange);
+// releases every bank and frees the sysex buffers. Neither thread may be using the exchange.
+void waveBankExchangeFree(WaveBankExchange* exchange);
+
+// audio thread. Adds a piece of a wave sysex (without the status and end bytes) to the sysex buffer. Hosts can split a large sysex across several events, and even several blocks. isStart is set for the piece that began with the status byte, and isEnd for the one that contained the end byte. A piece that continues no sysex starts a new one, since some hosts leave the status byte out. Once the end is reached, the sysex is handed to the background thread.
+WaveSysexResult collectWaveSysex(WaveBankExchange* exchange, const uint8_t* data, uint32_t size, bool isStart, bool isEnd);
+// audio thread. Ends a sysex whose end byte never came, as midi does at the next status byte (other than real-time messages). Returns WAVE_SYSEX_INCOMPLETE if there was none.
+WaveSysexResult endWaveSysex(WaveBankExchange* exchange);
+// audio thread. Wait-free. Switches to the newest parsed bank if there is one, and returns whether it did.
+bool pickUpWaveBank(WaveBankExchange* exchange);
+// audio thread. Whether a sysex has been queued whose bank hasn't been picked up yet, meaning that wave loads still read the previous bank.
+bool waveBankSwapPending(const WaveBankExchange* exchange);
+// audio thread. A wave of the current bank. Waves the bank doesn't have are silent.
+const DecodedWave* getWave(const WaveBankExchange* exchange, uint16_t index);
+
+// whether a finished sysex is waiting to be parsed. Safe to call from either thread.
+bool waveSysexQueued(const WaveBankExchange* exchange);
+// whether the background thread has anything to do. Safe to call from either thread.
+bool waveBankHasBackgroundWork(const WaveBankExchange* exchange);
+// background thread: looks the queued sysex up in the cache, parsing it if it isn't there (or loads the file it names), and releases the banks the audio thread has retired. If another thread is already doing this, returns at once, and whatever that thread misses is left for the next call.
+void doWaveBankBackgroundWork(WaveBankExchange* exchange);
+// audio thread, only when rendering offline, since it blocks and allocates. Does the background work right here, waiting for a background thread that is already doing it, so that the queued sysex's bank is ready for pickUpWaveBank.
+void finishWaveBankWork(WaveBankExchange* exchange);
+// background thread. Reads a wave bank file and hands it to the audio thread, like a parsed sysex. An empty path forgets the file without changing the waves. Returns false, keeping the current waves, if the file can't be used. The path is saved either way.
+bool loadWaveBankFile(WaveBankExchange* exchange, const char* path);
+// a copy of the wave bank file's path, for saving it in the plugin's state. nullptr if there is none. The caller frees it. Not for the audio thread.
+char* copyWaveBankFilePath(WaveBankExchange* exchange);